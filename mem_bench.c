@@ -0,0 +1,583 @@
+/*
+ * Timing and latency helpers shared by the benchmark tools.
+ */
+
+#define _GNU_SOURCE // for syscall()
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mem_bench.h"
+
+/* Constants */
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} BENCH_COUNTER_EVENTS[MEM_BENCH_NUM_COUNTERS] = {
+        {"cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"L1d-misses",   PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"LLC-misses",   PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"dTLB-misses",  PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+
+/* Forward declarations of static functions */
+static unsigned _mem_bench_bucket(uint64_t ns);
+static uint64_t _mem_bench_bucket_value(unsigned bucket);
+static int _mem_bench_double_cmp(const void *a, const void *b);
+static double _mem_bench_t_critical(double df);
+static double _mem_bench_json_number(const char *object, const char *end, const char *key);
+
+
+/* Definitions of user-facing functions */
+
+/*
+ * Function Name: mem_bench_now_ns
+ * Passed Variables: none
+ * Return Type: uint64_t
+ * Purpose: This function returns the monotonic clock in nanoseconds.
+ */
+uint64_t mem_bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * Function Name: mem_bench_latency_add
+ * Passed Variables: bench_latency_pt latency, uint64_t ns
+ * Return Type: void
+ * Purpose: This function counts one call that took ns nanoseconds.
+ */
+void mem_bench_latency_add(bench_latency_pt latency, uint64_t ns) {
+    latency->count++;
+    latency->total_ns += ns;
+    if (ns > latency->max_ns){
+        latency->max_ns = ns;
+    }
+    latency->buckets[_mem_bench_bucket(ns)]++;
+}
+
+/*
+ * Function Name: mem_bench_latency_merge
+ * Passed Variables: bench_latency_pt into, const bench_latency_t *from
+ * Return Type: void
+ * Purpose: This function adds the calls of one distribution to another,
+ * e.g. to sum up the threads of a run.
+ */
+void mem_bench_latency_merge(bench_latency_pt into, const bench_latency_t *from) {
+    into->count += from->count;
+    into->total_ns += from->total_ns;
+    if (from->max_ns > into->max_ns){
+        into->max_ns = from->max_ns;
+    }
+    for (unsigned b = 0; b < MEM_BENCH_NUM_BUCKETS; ++b){
+        into->buckets[b] += from->buckets[b];
+    }
+}
+
+/*
+ * Function Name: mem_bench_latency_percentile
+ * Passed Variables: const bench_latency_t *latency, double percentile
+ * Return Type: uint64_t
+ * Purpose: This function returns the latency that the passed percentage
+ * of the calls did not exceed, 0 if there were no calls.
+ */
+uint64_t mem_bench_latency_percentile(const bench_latency_t *latency, double percentile) {
+    if (latency->count == 0){
+        return 0;
+    }
+    unsigned long rank = (unsigned long) (percentile / 100.0 * latency->count);
+    if (rank == 0){
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (unsigned b = 0; b < MEM_BENCH_NUM_BUCKETS; ++b){
+        seen += latency->buckets[b];
+        if (seen >= rank){
+            const uint64_t value = _mem_bench_bucket_value(b);
+            return (value < latency->max_ns) ? value : latency->max_ns;
+        }
+    }
+    return latency->max_ns;
+}
+
+/*
+ * Function Name: mem_bench_counters_open
+ * Passed Variables: bench_counters_pt counters
+ * Return Type: int
+ * Purpose: This function opens the hardware counters of the calling
+ * thread, in user space only, each on its own so the kernel can multiplex
+ * them when the CPU has too few. Returns how many could be opened, which
+ * is 0 without a PMU or when perf_event_paranoid forbids it.
+ */
+int mem_bench_counters_open(bench_counters_pt counters) {
+    int num_open = 0;
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = BENCH_COUNTER_EVENTS[c].type;
+        attr.config = BENCH_COUNTER_EVENTS[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[c] >= 0){
+            ++num_open;
+        } else {
+            counters->fds[c] = -1;
+        }
+    }
+    return num_open;
+}
+
+/*
+ * Function Name: mem_bench_counters_close
+ * Passed Variables: bench_counters_pt counters
+ * Return Type: void
+ * Purpose: This function closes the counters.
+ */
+void mem_bench_counters_close(bench_counters_pt counters) {
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        if (counters->fds[c] >= 0){
+            close(counters->fds[c]);
+            counters->fds[c] = -1;
+        }
+    }
+}
+
+/*
+ * Function Name: mem_bench_counters_start
+ * Passed Variables: bench_counters_pt counters
+ * Return Type: void
+ * Purpose: This function zeroes the counters and starts them.
+ */
+void mem_bench_counters_start(bench_counters_pt counters) {
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        if (counters->fds[c] >= 0){
+            ioctl(counters->fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * Function Name: mem_bench_counters_stop
+ * Passed Variables: bench_counters_pt counters, double *values
+ * Return Type: void
+ * Purpose: This function stops the counters and passes back their counts
+ * since the start, by bench_counter. A count is scaled up by the share of
+ * the time its counter was multiplexed out; it is -1 if the counter is
+ * not open or never ran.
+ */
+void mem_bench_counters_stop(bench_counters_pt counters, double *values) {
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        if (counters->fds[c] >= 0){
+            ioctl(counters->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        uint64_t data[3]; // value, time enabled, time running
+        values[c] = -1.0;
+        if (counters->fds[c] >= 0 && read(counters->fds[c], data, sizeof(data)) == sizeof(data) && data[2] > 0){
+            values[c] = (double) data[0] * ((double) data[1] / (double) data[2]);
+        }
+    }
+}
+
+/*
+ * Function Name: mem_bench_counter_name
+ * Passed Variables: bench_counter counter
+ * Return Type: const char *
+ * Purpose: This function returns the short name of a counter.
+ */
+const char *mem_bench_counter_name(bench_counter counter) {
+    return BENCH_COUNTER_EVENTS[counter].name;
+}
+
+/*
+ * Function Name: mem_bench_measure
+ * Passed Variables: bench_fn fn, void *arg, const bench_config_t *config, bench_stats_pt stats
+ * Return Type: void
+ * Purpose: This function times a benchmark. The iterations are doubled,
+ * or scaled up from the last time, until a run takes min_rep_ns; then
+ * warmup runs are thrown away and reps runs of that many iterations are
+ * timed. The stats are of the nanoseconds per operation of the runs and,
+ * if the config asks for them, of the hardware counters per operation
+ * over all the runs.
+ */
+void mem_bench_measure(bench_fn fn, void *arg, const bench_config_t *config, bench_stats_pt stats) {
+    memset(stats, 0, sizeof(bench_stats_t));
+
+    unsigned long iterations = 1;
+    for (;;){
+        const uint64_t start = mem_bench_now_ns();
+        fn(arg, iterations);
+        const uint64_t elapsed = mem_bench_now_ns() - start;
+        if (elapsed >= config->min_rep_ns || iterations >= (1ul << 40)){
+            break;
+        }
+        unsigned long next = iterations * 2;
+        if (elapsed > 0 && (double) iterations * config->min_rep_ns / elapsed * 1.2 > next){
+            next = (unsigned long) ((double) iterations * config->min_rep_ns / elapsed * 1.2);
+        }
+        iterations = next;
+    }
+    for (unsigned w = 0; w < config->warmup; ++w){
+        fn(arg, iterations);
+    }
+
+    bench_counters_t counters;
+    double totals[MEM_BENCH_NUM_COUNTERS] = {0.0};
+    const int counting = config->counters && mem_bench_counters_open(&counters) > 0;
+    unsigned long total_ops = 0;
+
+    stats->iterations = iterations;
+    stats->reps = (config->reps > MEM_BENCH_MAX_REPS) ? MEM_BENCH_MAX_REPS : config->reps;
+    for (unsigned r = 0; r < stats->reps; ++r){
+        if (counting){
+            mem_bench_counters_start(&counters);
+        }
+        const uint64_t start = mem_bench_now_ns();
+        const unsigned long ops = fn(arg, iterations);
+        const uint64_t elapsed = mem_bench_now_ns() - start;
+        if (counting){
+            double values[MEM_BENCH_NUM_COUNTERS];
+            mem_bench_counters_stop(&counters, values);
+            for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+                totals[c] = (values[c] < 0.0 || totals[c] < 0.0) ? -1.0 : totals[c] + values[c];
+            }
+        }
+        total_ops += ops;
+        stats->ops = ops;
+        stats->ns_per_op[r] = (ops == 0) ? 0.0 : (double) elapsed / (double) ops;
+    }
+    for (unsigned c = 0; c < MEM_BENCH_NUM_COUNTERS; ++c){
+        stats->per_op[c] = (!counting || totals[c] < 0.0 || total_ops == 0) ? -1.0 : totals[c] / total_ops;
+    }
+    if (counting){
+        mem_bench_counters_close(&counters);
+    }
+    if (stats->reps == 0){
+        return;
+    }
+
+    double sorted[MEM_BENCH_MAX_REPS];
+    memcpy(sorted, stats->ns_per_op, stats->reps * sizeof(double));
+    qsort(sorted, stats->reps, sizeof(double), _mem_bench_double_cmp);
+    stats->min_ns = sorted[0];
+    stats->median_ns = (stats->reps % 2) ? sorted[stats->reps / 2] :
+                       (sorted[stats->reps / 2 - 1] + sorted[stats->reps / 2]) / 2;
+    double sum = 0.0;
+    for (unsigned r = 0; r < stats->reps; ++r){
+        sum += stats->ns_per_op[r];
+    }
+    stats->mean_ns = sum / stats->reps;
+    double squares = 0.0;
+    for (unsigned r = 0; r < stats->reps; ++r){
+        squares += (stats->ns_per_op[r] - stats->mean_ns) * (stats->ns_per_op[r] - stats->mean_ns);
+    }
+    stats->stddev_ns = (stats->reps > 1) ? sqrt(squares / (stats->reps - 1)) : 0.0;
+}
+
+/*
+ * Function Name: mem_bench_baseline_add
+ * Passed Variables: bench_baseline_pt baseline, const char *name, const bench_stats_t *stats,
+ *                   size_t metadata_bytes, double fragmentation
+ * Return Type: int
+ * Purpose: This function adds a benchmark's results to a baseline. The
+ * name may not contain quotes or braces. Returns 0 if out of memory.
+ */
+int mem_bench_baseline_add(bench_baseline_pt baseline, const char *name, const bench_stats_t *stats,
+                           size_t metadata_bytes, double fragmentation) {
+    if (baseline->count == baseline->capacity){
+        const unsigned capacity = (baseline->capacity == 0) ? 64 : baseline->capacity * 2;
+        bench_record_pt records = realloc(baseline->records, capacity * sizeof(bench_record_t));
+        if (records == NULL){
+            return 0;
+        }
+        baseline->records = records;
+        baseline->capacity = capacity;
+    }
+    bench_record_pt record = &baseline->records[baseline->count++];
+    memset(record, 0, sizeof(bench_record_t));
+    strncpy(record->name, name, MEM_BENCH_NAME_SIZE - 1);
+    record->stats = *stats;
+    record->metadata_bytes = metadata_bytes;
+    record->fragmentation = fragmentation;
+    return 1;
+}
+
+/*
+ * Function Name: mem_bench_baseline_find
+ * Passed Variables: const bench_baseline_t *baseline, const char *name
+ * Return Type: const bench_record_t *
+ * Purpose: This function returns the results of a benchmark, or NULL.
+ */
+const bench_record_t *mem_bench_baseline_find(const bench_baseline_t *baseline, const char *name) {
+    for (unsigned i = 0; i < baseline->count; ++i){
+        if (strcmp(baseline->records[i].name, name) == 0){
+            return &baseline->records[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: mem_bench_baseline_save
+ * Passed Variables: const bench_baseline_t *baseline, const char *path
+ * Return Type: int
+ * Purpose: This function writes a baseline as JSON, a benchmark per line
+ * with the ns/op of every repetition. Returns 0 if the file cannot be
+ * written.
+ */
+int mem_bench_baseline_save(const bench_baseline_t *baseline, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL){
+        return 0;
+    }
+    fprintf(file, "{\"version\": %d, \"benchmarks\": [", MEM_BENCH_BASELINE_VERSION);
+    for (unsigned i = 0; i < baseline->count; ++i){
+        const bench_record_t *record = &baseline->records[i];
+        fprintf(file, "%s\n  {\"name\": \"%s\", \"ops\": %lu, \"median_ns\": %.17g, \"mean_ns\": %.17g, "
+                      "\"stddev_ns\": %.17g, \"metadata_bytes\": %zu, \"fragmentation\": %.17g, \"samples\": [",
+                (i == 0) ? "" : ",", record->name, record->stats.ops, record->stats.median_ns,
+                record->stats.mean_ns, record->stats.stddev_ns, record->metadata_bytes, record->fragmentation);
+        for (unsigned r = 0; r < record->stats.reps; ++r){
+            fprintf(file, "%s%.17g", (r == 0) ? "" : ", ", record->stats.ns_per_op[r]);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+/*
+ * Function Name: mem_bench_baseline_load
+ * Passed Variables: bench_baseline_pt baseline, const char *path
+ * Return Type: int
+ * Purpose: This function reads a baseline written by
+ * mem_bench_baseline_save into an empty one. It only understands that
+ * layout, not JSON at large. Returns 0 if the file cannot be read or is
+ * of another version.
+ */
+int mem_bench_baseline_load(bench_baseline_pt baseline, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL){
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    const long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = (length > 0) ? malloc((size_t) length + 1) : NULL;
+    if (text == NULL || fread(text, 1, (size_t) length, file) != (size_t) length){
+        free(text);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    text[length] = '\0';
+    if (_mem_bench_json_number(text, text + length, "version") != MEM_BENCH_BASELINE_VERSION){
+        free(text);
+        return 0;
+    }
+
+    int ok = 1;
+    for (const char *object = strchr(text + 1, '{'); ok && object != NULL; object = strchr(object + 1, '{')){
+        const char *end = strchr(object, '}');
+        const char *name = strstr(object, "\"name\": \"");
+        if (end == NULL || name == NULL || name > end){
+            break;
+        }
+        name += strlen("\"name\": \"");
+        const char *name_end = strchr(name, '"');
+        bench_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        stats.ops = (unsigned long) _mem_bench_json_number(object, end, "ops");
+        stats.median_ns = _mem_bench_json_number(object, end, "median_ns");
+        stats.mean_ns = _mem_bench_json_number(object, end, "mean_ns");
+        stats.stddev_ns = _mem_bench_json_number(object, end, "stddev_ns");
+        const char *samples = strstr(object, "\"samples\": [");
+        if (samples != NULL && samples < end){
+            char *next = (char *) samples + strlen("\"samples\": [");
+            while (stats.reps < MEM_BENCH_MAX_REPS && *next != ']'){
+                char *after;
+                stats.ns_per_op[stats.reps] = strtod(next, &after);
+                if (after == next){
+                    break;
+                }
+                stats.reps++;
+                next = after + strspn(after, ", ");
+            }
+        }
+        stats.min_ns = stats.median_ns;
+        for (unsigned r = 0; r < stats.reps; ++r){
+            stats.min_ns = (stats.ns_per_op[r] < stats.min_ns) ? stats.ns_per_op[r] : stats.min_ns;
+        }
+
+        char record_name[MEM_BENCH_NAME_SIZE] = {0};
+        const size_t name_length = (size_t) (name_end - name);
+        memcpy(record_name, name, (name_length < MEM_BENCH_NAME_SIZE) ? name_length : MEM_BENCH_NAME_SIZE - 1);
+        ok = mem_bench_baseline_add(baseline, record_name, &stats,
+                                    (size_t) _mem_bench_json_number(object, end, "metadata_bytes"),
+                                    _mem_bench_json_number(object, end, "fragmentation"));
+        object = end;
+    }
+    free(text);
+    return ok;
+}
+
+/*
+ * Function Name: mem_bench_baseline_free
+ * Passed Variables: bench_baseline_pt baseline
+ * Return Type: void
+ * Purpose: This function empties a baseline.
+ */
+void mem_bench_baseline_free(bench_baseline_pt baseline) {
+    free(baseline->records);
+    baseline->records = NULL;
+    baseline->count = 0;
+    baseline->capacity = 0;
+}
+
+/*
+ * Function Name: mem_bench_compare
+ * Passed Variables: const bench_record_t *base, const bench_record_t *now,
+ *                   const bench_thresholds_t *thresholds, double *change_pct, double *interval_pct
+ * Return Type: unsigned
+ * Purpose: This function compares a benchmark with its baseline and
+ * returns its bench_regression flags. The change of the mean ns/op is
+ * passed back with the half-width of its 95% confidence interval, from
+ * Welch's t-test on the repetitions of both runs. The time has regressed
+ * if it got slower by more than the threshold and the whole interval is
+ * above zero, so noise within the repetitions is not flagged; with a
+ * single repetition on either side, the threshold alone decides.
+ */
+unsigned mem_bench_compare(const bench_record_t *base, const bench_record_t *now,
+                           const bench_thresholds_t *thresholds, double *change_pct, double *interval_pct) {
+    unsigned regressed = 0;
+    const double base_mean = base->stats.mean_ns;
+    const double diff = now->stats.mean_ns - base_mean;
+    *change_pct = (base_mean == 0.0) ? 0.0 : 100.0 * diff / base_mean;
+    *interval_pct = 0.0;
+
+    const unsigned n0 = base->stats.reps, n1 = now->stats.reps;
+    if (n0 > 1 && n1 > 1 && base_mean != 0.0){
+        const double v0 = base->stats.stddev_ns * base->stats.stddev_ns / n0;
+        const double v1 = now->stats.stddev_ns * now->stats.stddev_ns / n1;
+        const double df = (v0 + v1 == 0.0) ? 1e9 :
+                          (v0 + v1) * (v0 + v1) / (v0 * v0 / (n0 - 1) + v1 * v1 / (n1 - 1));
+        *interval_pct = 100.0 * _mem_bench_t_critical(df) * sqrt(v0 + v1) / base_mean;
+    }
+    if (*change_pct > thresholds->time_pct && *change_pct - *interval_pct > 0.0){
+        regressed |= BENCH_REGRESSED_TIME;
+    }
+    if (base->metadata_bytes > 0 &&
+        now->metadata_bytes > base->metadata_bytes * (1.0 + thresholds->memory_pct / 100.0)){
+        regressed |= BENCH_REGRESSED_MEMORY;
+    }
+    if (now->fragmentation > base->fragmentation + thresholds->fragmentation_diff){
+        regressed |= BENCH_REGRESSED_FRAGMENTATION;
+    }
+    return regressed;
+}
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _mem_bench_bucket
+ * Passed Variables: uint64_t ns
+ * Return Type: unsigned
+ * Purpose: This function returns the bucket of a latency. Latencies below
+ * MEM_BENCH_SUB_BUCKETS have a bucket each; above that every power of two
+ * is split into MEM_BENCH_SUB_BUCKETS equal steps.
+ */
+static unsigned _mem_bench_bucket(uint64_t ns) {
+    if (ns < MEM_BENCH_SUB_BUCKETS){
+        return (unsigned) ns;
+    }
+    const unsigned shift = 63 - __builtin_clzll(ns) - 4; // log2(MEM_BENCH_SUB_BUCKETS)
+    return (shift + 1) * MEM_BENCH_SUB_BUCKETS + (unsigned) ((ns >> shift) & (MEM_BENCH_SUB_BUCKETS - 1));
+}
+
+/*
+ * Function Name: _mem_bench_bucket_value
+ * Passed Variables: unsigned bucket
+ * Return Type: uint64_t
+ * Purpose: This function returns the largest latency of a bucket.
+ */
+static uint64_t _mem_bench_bucket_value(unsigned bucket) {
+    if (bucket < MEM_BENCH_SUB_BUCKETS){
+        return bucket;
+    }
+    const unsigned shift = bucket / MEM_BENCH_SUB_BUCKETS - 1;
+    const uint64_t lower = (uint64_t) (MEM_BENCH_SUB_BUCKETS + bucket % MEM_BENCH_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+/*
+ * Function Name: _mem_bench_double_cmp
+ * Passed Variables: const void *a, const void *b
+ * Return Type: int
+ * Purpose: This function is the qsort comparator of doubles.
+ */
+static int _mem_bench_double_cmp(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function Name: _mem_bench_t_critical
+ * Passed Variables: double df
+ * Return Type: double
+ * Purpose: This function returns the two-sided 95% critical value of
+ * Student's t distribution with df degrees of freedom, rounded down to a
+ * whole df.
+ */
+static double _mem_bench_t_critical(double df) {
+    static const double table[] = {
+            12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (df < 1.0){
+        return table[0];
+    }
+    if (df < 31.0){
+        return table[(int) df - 1];
+    }
+    return (df < 61.0) ? 2.021 : (df < 121.0) ? 2.000 : 1.960;
+}
+
+/*
+ * Function Name: _mem_bench_json_number
+ * Passed Variables: const char *object, const char *end, const char *key
+ * Return Type: double
+ * Purpose: This function returns the number of a key in the text from
+ * object to end, 0 if the key is not there.
+ */
+static double _mem_bench_json_number(const char *object, const char *end, const char *key) {
+    char quoted[MEM_BENCH_NAME_SIZE];
+    snprintf(quoted, sizeof(quoted), "\"%s\": ", key);
+    const char *found = strstr(object, quoted);
+    if (found == NULL || found >= end){
+        return 0.0;
+    }
+    return strtod(found + strlen(quoted), NULL);
+}
@@ -0,0 +1,151 @@
+/*
+ * Timing and latency helpers shared by the benchmark tools.
+ */
+
+#ifndef DENVER_OS_PA_C_MEM_BENCH_H
+#define DENVER_OS_PA_C_MEM_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEM_BENCH_SUB_BUCKETS 16 // linear steps per power of two
+#define MEM_BENCH_NUM_BUCKETS (64 * MEM_BENCH_SUB_BUCKETS)
+#define MEM_BENCH_MAX_REPS 64
+#define MEM_BENCH_NUM_COUNTERS 6
+#define MEM_BENCH_NAME_SIZE 128
+#define MEM_BENCH_BASELINE_VERSION 1
+
+/* type declarations */
+
+/*
+ * A latency distribution. Buckets are within 1/MEM_BENCH_SUB_BUCKETS of
+ * the values they hold, so percentiles are too.
+ */
+typedef struct _bench_latency {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long buckets[MEM_BENCH_NUM_BUCKETS];
+} bench_latency_t, *bench_latency_pt;
+
+typedef enum _bench_counter {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_L1D_MISSES,
+    BENCH_LLC_MISSES,
+    BENCH_DTLB_MISSES,
+    BENCH_BRANCH_MISSES
+} bench_counter;
+
+/*
+ * The hardware counters of the calling thread, from perf_event_open. A
+ * counter the CPU or the kernel does not give us has an fd of -1.
+ */
+typedef struct _bench_counters {
+    int fds[MEM_BENCH_NUM_COUNTERS];
+} bench_counters_t, *bench_counters_pt;
+
+/*
+ * The body of a benchmark: runs the passed number of iterations and
+ * returns how many operations they were.
+ */
+typedef unsigned long (*bench_fn)(void *arg, unsigned long iterations);
+
+typedef struct _bench_config {
+    unsigned warmup;     // repetitions run and thrown away after calibrating
+    unsigned reps;       // repetitions measured, at most MEM_BENCH_MAX_REPS
+    uint64_t min_rep_ns; // the iterations of a repetition are chosen to take this long
+    int counters;        // 1 to read the hardware counters of the repetitions too
+} bench_config_t, *bench_config_pt;
+
+typedef struct _bench_stats {
+    unsigned long iterations; // per repetition
+    unsigned long ops;        // per repetition
+    unsigned reps;
+    double ns_per_op[MEM_BENCH_MAX_REPS];
+    double min_ns;            // of ns_per_op
+    double median_ns;
+    double mean_ns;
+    double stddev_ns;
+    double per_op[MEM_BENCH_NUM_COUNTERS]; // counts per operation, negative if not counted
+} bench_stats_t, *bench_stats_pt;
+
+/* a benchmark's results as kept in a baseline */
+typedef struct _bench_record {
+    char name[MEM_BENCH_NAME_SIZE];
+    bench_stats_t stats;
+    size_t metadata_bytes; // of the benchmark's pool after it ran, 0 if none
+    double fragmentation;  // ditto
+} bench_record_t, *bench_record_pt;
+
+typedef struct _bench_baseline {
+    bench_record_pt records;
+    unsigned count;
+    unsigned capacity;
+} bench_baseline_t, *bench_baseline_pt;
+
+typedef struct _bench_thresholds {
+    double time_pct;           // a slower ns/op than this is a regression...
+    double memory_pct;         // ...as is more metadata than this
+    double fragmentation_diff; // ...or more fragmentation by this much
+} bench_thresholds_t, *bench_thresholds_pt;
+
+typedef enum _bench_regression {
+    BENCH_REGRESSED_TIME          = 0x1,
+    BENCH_REGRESSED_MEMORY        = 0x2,
+    BENCH_REGRESSED_FRAGMENTATION = 0x4
+} bench_regression;
+
+/* function declarations */
+
+uint64_t
+mem_bench_now_ns();
+
+void
+mem_bench_latency_add(bench_latency_pt latency, uint64_t ns);
+
+void
+mem_bench_latency_merge(bench_latency_pt into, const bench_latency_t *from);
+
+uint64_t
+mem_bench_latency_percentile(const bench_latency_t *latency, double percentile);
+
+int
+mem_bench_counters_open(bench_counters_pt counters);
+
+void
+mem_bench_counters_close(bench_counters_pt counters);
+
+void
+mem_bench_counters_start(bench_counters_pt counters);
+
+void
+mem_bench_counters_stop(bench_counters_pt counters, double *values);
+
+const char *
+mem_bench_counter_name(bench_counter counter);
+
+void
+mem_bench_measure(bench_fn fn, void *arg, const bench_config_t *config, bench_stats_pt stats);
+
+int
+mem_bench_baseline_add(bench_baseline_pt baseline, const char *name, const bench_stats_t *stats,
+                       size_t metadata_bytes, double fragmentation);
+
+const bench_record_t *
+mem_bench_baseline_find(const bench_baseline_t *baseline, const char *name);
+
+int
+mem_bench_baseline_save(const bench_baseline_t *baseline, const char *path);
+
+int
+mem_bench_baseline_load(bench_baseline_pt baseline, const char *path);
+
+void
+mem_bench_baseline_free(bench_baseline_pt baseline);
+
+unsigned
+mem_bench_compare(const bench_record_t *base, const bench_record_t *now,
+                  const bench_thresholds_t *thresholds, double *change_pct, double *interval_pct);
+
+#endif //DENVER_OS_PA_C_MEM_BENCH_H
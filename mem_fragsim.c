@@ -0,0 +1,317 @@
+/*
+ * Fragmentation simulator: churns a pool for a long run of operations
+ * at a steady occupancy and samples how fragmented it gets, for every
+ * placement policy with eager and lazy coalescing, as a CSV or JSON time
+ * series.
+ *
+ * usage: mem_fragsim [-n ops] [-i interval] [-p size] [-u occupancy] [-m min] [-M max]
+ *                    [-k share] [-r seed] [-c filter] [-j]
+ *
+ *   -n ops        operations per configuration (10000000)
+ *   -i interval   operations between samples (100000)
+ *   -p size       bytes of the pool (16 MiB)
+ *   -u occupancy  share of the pool to keep allocated (0.7)
+ *   -m min        smallest size (16)
+ *   -M max        largest size (16384); sizes are log-uniform in between
+ *   -k share      share of the allocations that live for the whole run,
+ *                 up to a third of the occupancy (0.02)
+ *   -r seed       random seed (1)
+ *   -c filter     run only the configurations whose name contains filter
+ *   -j            print JSON instead of CSV
+ *
+ * A sample has the allocated bytes, the gaps, the largest gap, the free
+ * bytes and the fragmentation, 1 - largest gap / free bytes, from
+ * mem_inspect_pool; the metadata bytes from mem_pool_stats; and the share
+ * of the allocations since the last sample that failed. Every
+ * configuration draws the same random numbers, so they see the same
+ * requests as long as none fails.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt()
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "mem_pool.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const unsigned long  FRAGSIM_DEFAULT_OPS         = 10000000;
+static const unsigned long  FRAGSIM_DEFAULT_INTERVAL    = 100000;
+static const size_t         FRAGSIM_DEFAULT_POOL_SIZE   = 16 << 20;
+static const double         FRAGSIM_DEFAULT_OCCUPANCY   = 0.7;
+static const double         FRAGSIM_DEFAULT_KEEP        = 0.02;
+static const double         FRAGSIM_BAND                = 0.05; // allocate below occupancy - band, free above
+
+
+
+/* Type declarations */
+
+typedef struct _fragsim_config {
+    const char *name;
+    alloc_policy policy;
+    unsigned flags;
+} fragsim_config_t;
+
+static const fragsim_config_t FRAGSIM_CONFIGS[] = {
+        {"first-fit",      FIRST_FIT, POOL_DEFAULT},
+        {"best-fit",       BEST_FIT,  POOL_DEFAULT},
+        {"first-fit-lazy", FIRST_FIT, POOL_LAZY_COALESCE},
+        {"best-fit-lazy",  BEST_FIT,  POOL_LAZY_COALESCE}
+};
+#define FRAGSIM_NUM_CONFIGS (sizeof(FRAGSIM_CONFIGS) / sizeof(FRAGSIM_CONFIGS[0]))
+
+typedef struct _fragsim_params {
+    unsigned long num_ops;
+    unsigned long interval;
+    size_t pool_size;
+    double occupancy;
+    size_t min_size;
+    size_t max_size;
+    double keep;
+    uint64_t seed;
+    int json;
+} fragsim_params_t, *fragsim_params_pt;
+
+/* the allocations of a run; short-lived ones are freed at random */
+typedef struct _fragsim_live {
+    alloc_pt *allocs;
+    size_t count;
+    size_t capacity;
+} fragsim_live_t, *fragsim_live_pt;
+
+
+
+/* Forward declarations of static functions */
+static double _fragsim_uniform(uint64_t *state);
+static int _fragsim_push(fragsim_live_pt live, alloc_pt alloc);
+static void _fragsim_sample(const fragsim_params_t *params, const fragsim_config_t *config, pool_pt pool,
+                            unsigned long ops, double seconds, unsigned long attempts,
+                            unsigned long failures, int first);
+static void _fragsim_run(const fragsim_params_t *params, const fragsim_config_t *config, int first);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    fragsim_params_t params = {FRAGSIM_DEFAULT_OPS, FRAGSIM_DEFAULT_INTERVAL, FRAGSIM_DEFAULT_POOL_SIZE,
+                               FRAGSIM_DEFAULT_OCCUPANCY, 16, 16384, FRAGSIM_DEFAULT_KEEP, 1, 0};
+    const char *filter = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:p:u:m:M:k:r:c:j")) != -1){
+        switch (opt){
+            case 'n': params.num_ops = strtoul(optarg, NULL, 0); break;
+            case 'i': params.interval = strtoul(optarg, NULL, 0); break;
+            case 'p': params.pool_size = strtoul(optarg, NULL, 0); break;
+            case 'u': params.occupancy = strtod(optarg, NULL); break;
+            case 'm': params.min_size = strtoul(optarg, NULL, 0); break;
+            case 'M': params.max_size = strtoul(optarg, NULL, 0); break;
+            case 'k': params.keep = strtod(optarg, NULL); break;
+            case 'r': params.seed = strtoull(optarg, NULL, 0); break;
+            case 'c': filter = optarg; break;
+            case 'j': params.json = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-n ops] [-i interval] [-p size] [-u occupancy] [-m min] [-M max]\n"
+                                "       [-k share] [-r seed] [-c filter] [-j]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (params.interval == 0 || params.min_size == 0 || params.min_size > params.max_size ||
+        params.occupancy <= 0.0 || params.occupancy >= 1.0){
+        fprintf(stderr, "%s: bad parameters\n", argv[0]);
+        return 2;
+    }
+
+    mem_init();
+    if (params.json){
+        printf("{\"series\": [");
+    } else {
+        printf("config,ops,seconds,alloc_bytes,allocs,gaps,largest_gap,free_bytes,fragmentation,"
+               "metadata_bytes,failed_rate\n");
+    }
+    int first = 1;
+    for (unsigned c = 0; c < FRAGSIM_NUM_CONFIGS; ++c){
+        if (filter != NULL && strstr(FRAGSIM_CONFIGS[c].name, filter) == NULL){
+            continue;
+        }
+        _fragsim_run(&params, &FRAGSIM_CONFIGS[c], first);
+        first = 0;
+    }
+    if (params.json){
+        printf("\n]}\n");
+    }
+    mem_free();
+
+    return 0;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _fragsim_uniform
+ * Passed Variables: uint64_t *state
+ * Return Type: double
+ * Purpose: This function returns a random number in [0, 1) from a
+ * xorshift64* generator.
+ */
+static double _fragsim_uniform(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double) ((x * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Function Name: _fragsim_push
+ * Passed Variables: fragsim_live_pt live, alloc_pt alloc
+ * Return Type: int
+ * Purpose: This function adds an allocation to a live set. Returns 0 if
+ * out of memory.
+ */
+static int _fragsim_push(fragsim_live_pt live, alloc_pt alloc) {
+    if (live->count == live->capacity){
+        const size_t capacity = (live->capacity == 0) ? 1024 : live->capacity * 2;
+        alloc_pt *allocs = realloc(live->allocs, capacity * sizeof(alloc_pt));
+        if (allocs == NULL){
+            return 0;
+        }
+        live->allocs = allocs;
+        live->capacity = capacity;
+    }
+    live->allocs[live->count++] = alloc;
+    return 1;
+}
+
+/*
+ * Function Name: _fragsim_sample
+ * Passed Variables: const fragsim_params_t *params, const fragsim_config_t *config, pool_pt pool,
+ *                   unsigned long ops, double seconds, unsigned long attempts,
+ *                   unsigned long failures, int first
+ * Return Type: void
+ * Purpose: This function prints a sample of the pool. First is set for
+ * the first sample of the output, which JSON does not put a comma before.
+ */
+static void _fragsim_sample(const fragsim_params_t *params, const fragsim_config_t *config, pool_pt pool,
+                            unsigned long ops, double seconds, unsigned long attempts,
+                            unsigned long failures, int first) {
+    pool_segment_pt segments;
+    unsigned num_segments;
+    mem_inspect_pool(pool, &segments, &num_segments);
+    size_t alloc_bytes = 0, free_bytes = 0, largest_gap = 0;
+    unsigned long num_allocs = 0, num_gaps = 0;
+    for (unsigned s = 0; s < num_segments; ++s){
+        if (segments[s].allocated){
+            alloc_bytes += segments[s].size;
+            num_allocs++;
+        } else {
+            free_bytes += segments[s].size;
+            num_gaps++;
+            if (segments[s].size > largest_gap){
+                largest_gap = segments[s].size;
+            }
+        }
+    }
+    free(segments);
+    pool_stats_t stats;
+    const size_t metadata_bytes = (mem_pool_stats(pool, &stats) == ALLOC_OK) ? stats.metadata_bytes : 0;
+    const double fragmentation = (free_bytes == 0) ? 0.0 : 1.0 - (double) largest_gap / (double) free_bytes;
+    const double failed_rate = (attempts == 0) ? 0.0 : (double) failures / (double) attempts;
+
+    if (params->json){
+        printf("%s\n  {\"config\": \"%s\", \"ops\": %lu, \"seconds\": %.3f, \"alloc_bytes\": %zu, "
+               "\"allocs\": %lu, \"gaps\": %lu, \"largest_gap\": %zu, \"free_bytes\": %zu, "
+               "\"fragmentation\": %.6f, \"metadata_bytes\": %zu, \"failed_rate\": %.6f}",
+               first ? "" : ",", config->name, ops, seconds, alloc_bytes, num_allocs, num_gaps,
+               largest_gap, free_bytes, fragmentation, metadata_bytes, failed_rate);
+    } else {
+        printf("%s,%lu,%.3f,%zu,%lu,%lu,%zu,%zu,%.6f,%zu,%.6f\n", config->name, ops, seconds, alloc_bytes,
+               num_allocs, num_gaps, largest_gap, free_bytes, fragmentation, metadata_bytes, failed_rate);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Function Name: _fragsim_run
+ * Passed Variables: const fragsim_params_t *params, const fragsim_config_t *config, int first
+ * Return Type: void
+ * Purpose: This function runs one configuration. Each operation
+ * allocates while the pool is below the occupancy band, frees a random
+ * short-lived allocation while it is above, and tosses a coin in
+ * between. A share of the allocations is kept for the whole run, so the
+ * pool ages the way long-running ones do.
+ */
+static void _fragsim_run(const fragsim_params_t *params, const fragsim_config_t *config, int first) {
+    pool_pt pool = mem_pool_open_ex(params->pool_size, config->policy, config->flags);
+    if (pool == NULL){
+        fprintf(stderr, "mem_fragsim: cannot open a pool of %zu bytes\n", params->pool_size);
+        return;
+    }
+    fragsim_live_t live = {NULL, 0, 0}, kept = {NULL, 0, 0};
+    uint64_t rng = params->seed * 0x9E3779B97F4A7C15ull + 1;
+    const double target = params->occupancy * (double) params->pool_size;
+    const double log_min = log((double) params->min_size);
+    const double log_range = log((double) params->max_size + 1) - log_min;
+    size_t kept_bytes = 0;
+    unsigned long attempts = 0, failures = 0;
+    const uint64_t start = mem_bench_now_ns();
+
+    for (unsigned long op = 1; op <= params->num_ops; ++op){
+        /* draw the same numbers whatever happens */
+        const double coin = _fragsim_uniform(&rng);
+        const double size_draw = _fragsim_uniform(&rng);
+        const double victim_draw = _fragsim_uniform(&rng);
+        const double keep_draw = _fragsim_uniform(&rng);
+
+        const double used = (double) pool->alloc_size;
+        const int allocate = (used < target * (1.0 - FRAGSIM_BAND)) ||
+                             (used <= target && coin < 0.5) || live.count == 0;
+        if (allocate){
+            size_t size = (size_t) exp(log_min + size_draw * log_range);
+            if (size > params->max_size){
+                size = params->max_size;
+            }
+            attempts++;
+            alloc_pt alloc = mem_new_alloc(pool, size);
+            if (alloc == NULL){
+                failures++;
+            } else if (keep_draw < params->keep && kept_bytes + size <= target / 3){
+                kept_bytes += size;
+                if (!_fragsim_push(&kept, alloc)){
+                    mem_del_alloc(pool, alloc);
+                }
+            } else if (!_fragsim_push(&live, alloc)){
+                mem_del_alloc(pool, alloc);
+            }
+        } else {
+            const size_t victim = (size_t) (victim_draw * live.count);
+            mem_del_alloc(pool, live.allocs[victim]);
+            live.allocs[victim] = live.allocs[--live.count];
+        }
+
+        if (op % params->interval == 0 || op == params->num_ops){
+            _fragsim_sample(params, config, pool, op, (double) (mem_bench_now_ns() - start) / 1e9,
+                            attempts, failures, first);
+            first = 0;
+            attempts = 0;
+            failures = 0;
+        }
+    }
+
+    for (size_t i = 0; i < live.count; ++i){
+        mem_del_alloc(pool, live.allocs[i]);
+    }
+    for (size_t i = 0; i < kept.count; ++i){
+        mem_del_alloc(pool, kept.allocs[i]);
+    }
+    free(live.allocs);
+    free(kept.allocs);
+    mem_pool_close(pool);
+}
@@ -0,0 +1,452 @@
+/*
+ * Microbenchmarks of the hot paths of the pools, under both policies and
+ * with pools fragmented into from ten to a million gaps.
+ *
+ * usage: mem_microbench [-r reps] [-w warmup] [-t ms] [-g gaps] [-F fill] [-b filter] [-e]
+ *                        [-s baseline.json] [-c baseline.json] [-x pct] [-m pct] [-f diff]
+ *
+ *   -r reps     timed repetitions of every benchmark (5)
+ *   -w warmup   repetitions run before them and thrown away (1)
+ *   -t ms       the least time a repetition takes (20)
+ *   -g gaps     the most gaps to fragment a pool into (1000000)
+ *   -F fill     the most allocations of the fill benchmark (10000); a
+ *               first-fit fill walks the allocations so far, so it is
+ *               quadratic
+ *   -b filter   run only the benchmarks whose name contains filter
+ *   -e          count cycles, instructions, L1d, LLC and dTLB misses and
+ *               branch mispredictions per operation with perf_event_open;
+ *               "-" marks a counter the machine does not give us
+ *   -s file     save the results to a JSON baseline
+ *   -c file     compare the results with a saved baseline and exit with 1
+ *               if any regressed
+ *   -x pct      the slowdown of the mean ns/op that is a regression (5)
+ *   -m pct      the growth of the pool metadata that is a regression (5)
+ *   -f diff     the rise in fragmentation that is a regression (0.02)
+ *
+ * When comparing, every benchmark gets the change of its mean ns/op with
+ * the 95% confidence interval of that change, from the spread of the
+ * repetitions of both runs. A slowdown is only a regression if it is over
+ * the threshold and the interval does not reach down to zero, so use
+ * enough repetitions (-r) for noise to average out. The metadata bytes
+ * and fragmentation of a benchmark's pool are taken after it ran.
+ *
+ * Benchmarks:
+ *
+ *   pair        mem_new_alloc and mem_del_alloc of one size
+ *   churn       random allocations and deallocations of 16 to 1024
+ *               bytes over 1024 slots
+ *   inspect     mem_inspect_pool
+ *   fill        fill a fresh pool with 64-byte allocations and free them
+ *   open_close  mem_pool_open and mem_pool_close of a 1 MiB pool
+ *
+ * The first three run on a pool whose allocations of 16 bytes alternate
+ * with gaps of 16 bytes, followed by the free end of the pool.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt()
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mem_pool.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const size_t     MICRO_GAP_SIZE          = 16;
+static const size_t     MICRO_HEADROOM          = 1 << 20; // free end of a fragmented pool
+static const size_t     MICRO_PAIR_SIZES[]      = {16, 64, 512, 4096, 65536};
+static const unsigned   MICRO_GAP_COUNTS[]      = {10, 1000, 100000, 1000000};
+static const unsigned   MICRO_FILL_COUNTS[]     = {10, 100, 1000, 10000, 100000};
+static const size_t     MICRO_FILL_SIZE         = 64;
+static const size_t     MICRO_OPEN_SIZE         = 1 << 20;
+#define MICRO_CHURN_SLOTS 1024
+#define MICRO_NUM(array) (sizeof(array) / sizeof((array)[0]))
+
+
+
+/* Type declarations */
+
+typedef struct _micro_case {
+    pool_pt pool;
+    alloc_policy policy;
+    size_t size;
+    unsigned count;
+    uint64_t rng;
+    alloc_pt allocs[MICRO_CHURN_SLOTS];
+    alloc_pt *fill;
+} micro_case_t, *micro_case_pt;
+
+static const char *MICRO_POLICY_NAMES[] = {"first-fit", "best-fit"};
+
+
+
+/* Static global variables */
+static bench_config_t micro_config = {1, 5, 20000000, 0};
+static const char *micro_filter = NULL;
+static bench_baseline_t micro_results = {NULL, 0, 0};
+static bench_baseline_t micro_baseline = {NULL, 0, 0};
+static bench_thresholds_t micro_thresholds = {5.0, 5.0, 0.02};
+static int micro_comparing = 0;
+static unsigned micro_regressions = 0;
+
+
+
+/* Forward declarations of static functions */
+static pool_pt _micro_fragment(alloc_policy policy, unsigned gaps, alloc_pt **keep);
+static void _micro_unfragment(pool_pt pool, alloc_pt *keep, unsigned gaps);
+static void _micro_run(const char *name, bench_fn fn, micro_case_pt c);
+static unsigned long _micro_pair(void *arg, unsigned long iterations);
+static unsigned long _micro_churn(void *arg, unsigned long iterations);
+static unsigned long _micro_inspect(void *arg, unsigned long iterations);
+static unsigned long _micro_fill(void *arg, unsigned long iterations);
+static unsigned long _micro_open_close(void *arg, unsigned long iterations);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    unsigned max_gaps = MICRO_GAP_COUNTS[MICRO_NUM(MICRO_GAP_COUNTS) - 1];
+    unsigned max_fill = 10000;
+    const char *save_path = NULL;
+    const char *compare_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:t:g:F:b:es:c:x:m:f:")) != -1){
+        switch (opt){
+            case 'r': micro_config.reps = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'w': micro_config.warmup = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 't': micro_config.min_rep_ns = strtoull(optarg, NULL, 0) * 1000000; break;
+            case 'g': max_gaps = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'F': max_fill = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'b': micro_filter = optarg; break;
+            case 'e': micro_config.counters = 1; break;
+            case 's': save_path = optarg; break;
+            case 'c': compare_path = optarg; break;
+            case 'x': micro_thresholds.time_pct = strtod(optarg, NULL); break;
+            case 'm': micro_thresholds.memory_pct = strtod(optarg, NULL); break;
+            case 'f': micro_thresholds.fragmentation_diff = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "usage: %s [-r reps] [-w warmup] [-t ms] [-g gaps] [-F fill] [-b filter] [-e]\n"
+                                "       [-s baseline.json] [-c baseline.json] [-x pct] [-m pct] [-f diff]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (compare_path != NULL){
+        if (!mem_bench_baseline_load(&micro_baseline, compare_path)){
+            fprintf(stderr, "mem_microbench: cannot read the baseline %s\n", compare_path);
+            return 1;
+        }
+        micro_comparing = 1;
+    }
+
+    if (micro_config.counters){
+        bench_counters_t counters;
+        if (mem_bench_counters_open(&counters) == 0){
+            fprintf(stderr, "mem_microbench: no hardware counters (see perf_event_paranoid)\n");
+        }
+        mem_bench_counters_close(&counters);
+    }
+
+    mem_init();
+    printf("%-44s %12s %12s %8s %14s", "benchmark", "ns/op", "min ns/op", "+-%", "ops/s");
+    for (bench_counter e = 0; micro_config.counters && e < MEM_BENCH_NUM_COUNTERS; ++e){
+        printf(" %13s", mem_bench_counter_name(e));
+    }
+    if (micro_comparing){
+        printf(" %18s  %s", "vs baseline %", "verdict");
+    }
+    printf("\n");
+
+    micro_case_t c;
+    char name[128];
+    for (alloc_policy policy = FIRST_FIT; policy <= BEST_FIT; ++policy){
+        const char *policy_name = MICRO_POLICY_NAMES[policy];
+
+        for (unsigned g = 0; g < MICRO_NUM(MICRO_GAP_COUNTS) && MICRO_GAP_COUNTS[g] <= max_gaps; ++g){
+            alloc_pt *keep;
+            memset(&c, 0, sizeof(c));
+            c.policy = policy;
+            c.count = MICRO_GAP_COUNTS[g];
+            c.pool = _micro_fragment(policy, c.count, &keep);
+            if (c.pool == NULL){
+                fprintf(stderr, "mem_microbench: cannot make a pool of %u gaps\n", c.count);
+                continue;
+            }
+
+            snprintf(name, sizeof(name), "inspect/%s/gaps=%u", policy_name, c.count);
+            _micro_run(name, _micro_inspect, &c);
+            for (unsigned s = 0; s < MICRO_NUM(MICRO_PAIR_SIZES); ++s){
+                c.size = MICRO_PAIR_SIZES[s];
+                snprintf(name, sizeof(name), "pair/%s/gaps=%u/size=%zu", policy_name, c.count, c.size);
+                _micro_run(name, _micro_pair, &c);
+            }
+            c.rng = 1;
+            snprintf(name, sizeof(name), "churn/%s/gaps=%u", policy_name, c.count);
+            _micro_run(name, _micro_churn, &c);
+            for (unsigned slot = 0; slot < MICRO_CHURN_SLOTS; ++slot){
+                if (c.allocs[slot] != NULL){
+                    mem_del_alloc(c.pool, c.allocs[slot]);
+                }
+            }
+
+            _micro_unfragment(c.pool, keep, c.count);
+        }
+
+        for (unsigned f = 0; f < MICRO_NUM(MICRO_FILL_COUNTS) && MICRO_FILL_COUNTS[f] <= max_fill; ++f){
+            memset(&c, 0, sizeof(c));
+            c.count = MICRO_FILL_COUNTS[f];
+            c.pool = mem_pool_open(c.count * MICRO_FILL_SIZE, policy);
+            c.fill = malloc(c.count * sizeof(alloc_pt));
+            if (c.pool != NULL && c.fill != NULL){
+                snprintf(name, sizeof(name), "fill/%s/allocs=%u", policy_name, c.count);
+                _micro_run(name, _micro_fill, &c);
+            }
+            free(c.fill);
+            if (c.pool != NULL){
+                mem_pool_close(c.pool);
+            }
+        }
+
+        memset(&c, 0, sizeof(c));
+        c.policy = policy;
+        snprintf(name, sizeof(name), "open_close/%s", policy_name);
+        _micro_run(name, _micro_open_close, &c);
+    }
+    mem_free();
+
+    int status = 0;
+    if (save_path != NULL && !mem_bench_baseline_save(&micro_results, save_path)){
+        fprintf(stderr, "mem_microbench: cannot write the baseline %s\n", save_path);
+        status = 1;
+    }
+    if (micro_comparing){
+        printf("%u of %u benchmarks regressed\n", micro_regressions, micro_results.count);
+        status = (micro_regressions > 0) ? 1 : status;
+    }
+    mem_bench_baseline_free(&micro_results);
+    mem_bench_baseline_free(&micro_baseline);
+
+    return status;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _micro_fragment
+ * Passed Variables: alloc_policy policy, unsigned gaps, alloc_pt **keep
+ * Return Type: pool_pt
+ * Purpose: This function opens a pool with the passed number of gaps of
+ * MICRO_GAP_SIZE bytes between allocations of as many bytes, and
+ * MICRO_HEADROOM free bytes after them. The pool is filled best-fit,
+ * while its only gap is the end of the pool so that every allocation
+ * takes one step, every other allocation is freed, and the pool is then
+ * switched to the policy under test. The allocations left are passed
+ * back in keep. Returns NULL if out of memory.
+ */
+static pool_pt _micro_fragment(alloc_policy policy, unsigned gaps, alloc_pt **keep) {
+    pool_pt pool = mem_pool_open(2 * gaps * MICRO_GAP_SIZE + MICRO_HEADROOM, BEST_FIT);
+    alloc_pt *holes = malloc(gaps * sizeof(alloc_pt));
+    *keep = malloc(gaps * sizeof(alloc_pt));
+    if (pool == NULL || holes == NULL || *keep == NULL){
+        free(*keep);
+        free(holes);
+        if (pool != NULL){
+            mem_pool_close(pool);
+        }
+        return NULL;
+    }
+    for (unsigned i = 0; i < gaps; ++i){
+        holes[i] = mem_new_alloc(pool, MICRO_GAP_SIZE);
+        (*keep)[i] = mem_new_alloc(pool, MICRO_GAP_SIZE);
+        if (holes[i] == NULL || (*keep)[i] == NULL){
+            fprintf(stderr, "mem_microbench: out of memory\n");
+            exit(1);
+        }
+    }
+    for (unsigned i = 0; i < gaps; ++i){
+        mem_del_alloc(pool, holes[i]);
+    }
+    free(holes);
+    assert(pool->num_gaps == gaps + 1);
+    pool->policy = policy;
+    return pool;
+}
+
+/*
+ * Function Name: _micro_unfragment
+ * Passed Variables: pool_pt pool, alloc_pt *keep, unsigned gaps
+ * Return Type: void
+ * Purpose: This function frees the allocations of _micro_fragment and
+ * closes the pool.
+ */
+static void _micro_unfragment(pool_pt pool, alloc_pt *keep, unsigned gaps) {
+    for (unsigned i = 0; i < gaps; ++i){
+        mem_del_alloc(pool, keep[i]);
+    }
+    free(keep);
+    mem_pool_close(pool);
+}
+
+/*
+ * Function Name: _micro_run
+ * Passed Variables: const char *name, bench_fn fn, micro_case_pt c
+ * Return Type: void
+ * Purpose: This function measures a benchmark, unless it is filtered
+ * out, and prints its line, with the counters per operation if asked.
+ * The results are kept for the baseline, and compared with the loaded
+ * baseline if there is one.
+ */
+static void _micro_run(const char *name, bench_fn fn, micro_case_pt c) {
+    if (micro_filter != NULL && strstr(name, micro_filter) == NULL){
+        return;
+    }
+    bench_stats_t stats;
+    mem_bench_measure(fn, c, &micro_config, &stats);
+    printf("%-44s %12.1f %12.1f %8.1f %14.0f", name, stats.median_ns, stats.min_ns,
+           (stats.mean_ns == 0.0) ? 0.0 : 100.0 * stats.stddev_ns / stats.mean_ns,
+           (stats.median_ns == 0.0) ? 0.0 : 1e9 / stats.median_ns);
+    for (bench_counter e = 0; micro_config.counters && e < MEM_BENCH_NUM_COUNTERS; ++e){
+        if (stats.per_op[e] < 0.0){
+            printf(" %13s", "-");
+        } else {
+            printf(" %13.2f", stats.per_op[e]);
+        }
+    }
+
+    pool_stats_t pool_stats;
+    memset(&pool_stats, 0, sizeof(pool_stats));
+    if (c->pool != NULL){
+        mem_pool_stats(c->pool, &pool_stats);
+    }
+    if (!mem_bench_baseline_add(&micro_results, name, &stats, pool_stats.metadata_bytes,
+                                pool_stats.fragmentation)){
+        fprintf(stderr, "mem_microbench: out of memory\n");
+        exit(1);
+    }
+    if (micro_comparing){
+        const bench_record_t *base = mem_bench_baseline_find(&micro_baseline, name);
+        if (base == NULL){
+            printf(" %18s  %s", "", "new");
+        } else {
+            double change_pct, interval_pct;
+            const unsigned regressed = mem_bench_compare(base, &micro_results.records[micro_results.count - 1],
+                                                         &micro_thresholds, &change_pct, &interval_pct);
+            printf(" %+9.1f +-%6.1f  %s%s%s%s", change_pct, interval_pct, (regressed == 0) ? "ok" : "REGRESSED",
+                   (regressed & BENCH_REGRESSED_TIME) ? " time" : "",
+                   (regressed & BENCH_REGRESSED_MEMORY) ? " memory" : "",
+                   (regressed & BENCH_REGRESSED_FRAGMENTATION) ? " fragmentation" : "");
+            micro_regressions += (regressed != 0);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ * Function Name: _micro_pair
+ * Passed Variables: void *arg, unsigned long iterations
+ * Return Type: unsigned long
+ * Purpose: This function allocates and frees the case's size over and
+ * over, which leaves the pool as it was. An operation is a call.
+ */
+static unsigned long _micro_pair(void *arg, unsigned long iterations) {
+    micro_case_pt c = arg;
+    for (unsigned long i = 0; i < iterations; ++i){
+        alloc_pt alloc = mem_new_alloc(c->pool, c->size);
+        if (alloc == NULL){
+            fprintf(stderr, "mem_microbench: allocation of %zu failed\n", c->size);
+            exit(1);
+        }
+        mem_del_alloc(c->pool, alloc);
+    }
+    return 2 * iterations;
+}
+
+/*
+ * Function Name: _micro_churn
+ * Passed Variables: void *arg, unsigned long iterations
+ * Return Type: unsigned long
+ * Purpose: This function frees the allocation of a random slot, or fills
+ * the slot with a random size if it is empty. The slots carry over from
+ * one run to the next.
+ */
+static unsigned long _micro_churn(void *arg, unsigned long iterations) {
+    micro_case_pt c = arg;
+    for (unsigned long i = 0; i < iterations; ++i){
+        c->rng ^= c->rng << 13;
+        c->rng ^= c->rng >> 7;
+        c->rng ^= c->rng << 17;
+        const unsigned slot = (unsigned) (c->rng % MICRO_CHURN_SLOTS);
+        if (c->allocs[slot] != NULL){
+            mem_del_alloc(c->pool, c->allocs[slot]);
+            c->allocs[slot] = NULL;
+        } else {
+            c->allocs[slot] = mem_new_alloc(c->pool, 16 + (c->rng >> 32) % 1009);
+        }
+    }
+    return iterations;
+}
+
+/*
+ * Function Name: _micro_inspect
+ * Passed Variables: void *arg, unsigned long iterations
+ * Return Type: unsigned long
+ * Purpose: This function inspects the pool over and over.
+ */
+static unsigned long _micro_inspect(void *arg, unsigned long iterations) {
+    micro_case_pt c = arg;
+    for (unsigned long i = 0; i < iterations; ++i){
+        pool_segment_pt segments;
+        unsigned num_segments;
+        mem_inspect_pool(c->pool, &segments, &num_segments);
+        free(segments);
+    }
+    return iterations;
+}
+
+/*
+ * Function Name: _micro_fill
+ * Passed Variables: void *arg, unsigned long iterations
+ * Return Type: unsigned long
+ * Purpose: This function fills the pool with the case's count of
+ * allocations and frees them in the same order, over and over. An
+ * operation is a call.
+ */
+static unsigned long _micro_fill(void *arg, unsigned long iterations) {
+    micro_case_pt c = arg;
+    for (unsigned long i = 0; i < iterations; ++i){
+        for (unsigned a = 0; a < c->count; ++a){
+            c->fill[a] = mem_new_alloc(c->pool, MICRO_FILL_SIZE);
+        }
+        for (unsigned a = 0; a < c->count; ++a){
+            mem_del_alloc(c->pool, c->fill[a]);
+        }
+    }
+    return 2 * iterations * c->count;
+}
+
+/*
+ * Function Name: _micro_open_close
+ * Passed Variables: void *arg, unsigned long iterations
+ * Return Type: unsigned long
+ * Purpose: This function opens and closes a pool over and over. An
+ * operation is a cycle.
+ */
+static unsigned long _micro_open_close(void *arg, unsigned long iterations) {
+    micro_case_pt c = arg;
+    for (unsigned long i = 0; i < iterations; ++i){
+        pool_pt pool = mem_pool_open(MICRO_OPEN_SIZE, c->policy);
+        if (pool == NULL){
+            fprintf(stderr, "mem_microbench: cannot open a pool\n");
+            exit(1);
+        }
+        mem_pool_close(pool);
+    }
+    return iterations;
+}
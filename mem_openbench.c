@@ -0,0 +1,176 @@
+/*
+ * Benchmark of opening and closing many small pools at once, as a
+ * process that opens a pool per tenant at startup does.
+ *
+ * usage: mem_openbench [-n pools] [-s size] [-p policy] [-x flags] [-a allocs]
+ *
+ *   -n pools    the most pools to hold open (1000000); runs go from a
+ *               thousand up by powers of ten
+ *   -s size     bytes of every pool (4096)
+ *   -p policy   0 for first-fit, 1 for best-fit (0)
+ *   -x flags    mem_pool_open_ex flags of the pools (0)
+ *   -a allocs   64-byte allocations to make in every pool once it is open,
+ *               outside the timing (0)
+ *
+ * A run opens its pools one after the other, then closes them in the same
+ * order. For both it prints the latency percentiles of one call, which
+ * include the clock reads around it, and the mean. The metadata is the
+ * sum of the metadata bytes of mem_pool_stats over the open pools; the
+ * RSS is read from /proc/self/statm before the run, with the pools open
+ * and after closing them, and is per pool once they are open. Mind the
+ * memory: a million pools of 4 KiB hold about 9 GiB.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt()
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mem_pool.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const unsigned   OPEN_MIN_POOLS      = 1000;
+static const size_t     OPEN_ALLOC_SIZE     = 64;
+
+
+
+/* Forward declarations of static functions */
+static size_t _open_rss_bytes();
+static void _open_run(unsigned num_pools, size_t size, alloc_policy policy, unsigned flags, unsigned allocs);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    unsigned max_pools = 1000000;
+    size_t size = 4096;
+    alloc_policy policy = FIRST_FIT;
+    unsigned flags = POOL_DEFAULT;
+    unsigned allocs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:p:x:a:")) != -1){
+        switch (opt){
+            case 'n': max_pools = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 's': size = strtoull(optarg, NULL, 0); break;
+            case 'p': policy = (strtoul(optarg, NULL, 0) == 1) ? BEST_FIT : FIRST_FIT; break;
+            case 'x': flags = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'a': allocs = (unsigned) strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n pools] [-s size] [-p policy] [-x flags] [-a allocs]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (size < allocs * OPEN_ALLOC_SIZE){
+        fprintf(stderr, "mem_openbench: %u allocations do not fit in %zu bytes\n", allocs, size);
+        return 2;
+    }
+
+    printf("%9s %9s %9s %9s %9s %9s %9s %9s %14s %10s %12s %12s %12s %10s\n",
+           "pools", "open p50", "p99", "p99.9", "mean", "close p50", "p99", "mean",
+           "metadata", "meta/pool", "rss before", "rss open", "rss closed", "rss/pool");
+    for (unsigned n = OPEN_MIN_POOLS; n <= max_pools && n >= OPEN_MIN_POOLS; n *= 10){
+        _open_run(n, size, policy, flags, allocs);
+    }
+
+    return 0;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _open_rss_bytes
+ * Passed Variables: none
+ * Return Type: size_t
+ * Purpose: This function returns the resident set size of the process,
+ * 0 if /proc cannot tell.
+ */
+static size_t _open_rss_bytes() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0, resident = 0;
+    if (file == NULL){
+        return 0;
+    }
+    if (fscanf(file, "%lu %lu", &pages, &resident) != 2){
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Function Name: _open_run
+ * Passed Variables: unsigned num_pools, size_t size, alloc_policy policy, unsigned flags, unsigned allocs
+ * Return Type: void
+ * Purpose: This function opens and closes the passed number of pools in
+ * a fresh pool store and prints its line.
+ */
+static void _open_run(unsigned num_pools, size_t size, alloc_policy policy, unsigned flags, unsigned allocs) {
+    pool_pt *pools = malloc(num_pools * sizeof(pool_pt));
+    bench_latency_t *open_latency = calloc(1, sizeof(bench_latency_t));
+    bench_latency_t *close_latency = calloc(1, sizeof(bench_latency_t));
+    alloc_pt *held = malloc(((size_t) num_pools * allocs + 1) * sizeof(alloc_pt));
+    if (pools == NULL || open_latency == NULL || close_latency == NULL || held == NULL){
+        fprintf(stderr, "mem_openbench: out of memory\n");
+        exit(1);
+    }
+
+    mem_init();
+    const size_t rss_before = _open_rss_bytes();
+    for (unsigned i = 0; i < num_pools; ++i){
+        const uint64_t start = mem_bench_now_ns();
+        pools[i] = mem_pool_open_ex(size, policy, flags);
+        mem_bench_latency_add(open_latency, mem_bench_now_ns() - start);
+        if (pools[i] == NULL){
+            fprintf(stderr, "mem_openbench: cannot open pool %u\n", i);
+            exit(1);
+        }
+        for (unsigned a = 0; a < allocs; ++a){
+            held[(size_t) i * allocs + a] = mem_new_alloc(pools[i], OPEN_ALLOC_SIZE);
+        }
+    }
+
+    const size_t rss_open = _open_rss_bytes();
+    size_t metadata = 0;
+    for (unsigned i = 0; i < num_pools; ++i){
+        pool_stats_t stats;
+        if (mem_pool_stats(pools[i], &stats) == ALLOC_OK){
+            metadata += stats.metadata_bytes;
+        }
+    }
+
+    for (unsigned i = 0; i < num_pools; ++i){
+        for (unsigned a = 0; a < allocs; ++a){
+            if (held[(size_t) i * allocs + a] != NULL){
+                mem_del_alloc(pools[i], held[(size_t) i * allocs + a]);
+            }
+        }
+        const uint64_t start = mem_bench_now_ns();
+        mem_pool_close(pools[i]);
+        mem_bench_latency_add(close_latency, mem_bench_now_ns() - start);
+    }
+    mem_free();
+    const size_t rss_closed = _open_rss_bytes();
+
+    printf("%9u %9lu %9lu %9lu %9.1f %9lu %9lu %9.1f %14zu %10.1f %12zu %12zu %12zu %10.1f\n", num_pools,
+           (unsigned long) mem_bench_latency_percentile(open_latency, 50.0),
+           (unsigned long) mem_bench_latency_percentile(open_latency, 99.0),
+           (unsigned long) mem_bench_latency_percentile(open_latency, 99.9),
+           (double) open_latency->total_ns / open_latency->count,
+           (unsigned long) mem_bench_latency_percentile(close_latency, 50.0),
+           (unsigned long) mem_bench_latency_percentile(close_latency, 99.0),
+           (double) close_latency->total_ns / close_latency->count,
+           metadata, (double) metadata / num_pools, rss_before, rss_open, rss_closed,
+           (rss_open > rss_before) ? (double) (rss_open - rss_before) / num_pools : 0.0);
+    fflush(stdout);
+
+    free(held);
+    free(close_latency);
+    free(open_latency);
+    free(pools);
+}
@@ -2,19 +2,38 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _GNU_SOURCE // for memfd_create() and sched_getcpu()
+
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h> // for sched_getcpu()
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "mem_pool.h"
+#include "mem_trace.h"
 
 /* Constants */
 #define MEM_FILL_FACTOR 0.75;
 #define MEM_EXPAND_FACTOR 2;
+#define MEM_POOL_STORE_MAX_SEGMENTS 32
+#define MEM_NODE_HEAP_MAX_CHUNKS 32
+#define MEM_TCACHE_NUM_CLASSES 9
+#define MEM_TCACHE_BIN_CAPACITY 64
+#define MEM_SHARD_MAX_COUNT 64
+#define MEM_REGIONS_PER_CPU 4
+#define MEM_QUICK_NUM_BINS 32
 
 
 static const unsigned   MEM_POOL_STORE_INIT_CAPACITY    = 20;
-static const float      MEM_POOL_STORE_FILL_FACTOR      = MEM_FILL_FACTOR;
 static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = MEM_EXPAND_FACTOR;
 
 static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
@@ -25,6 +44,23 @@ static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
 static const float      MEM_GAP_IX_FILL_FACTOR          = MEM_FILL_FACTOR;
 static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = MEM_EXPAND_FACTOR;
 
+static const unsigned   MEM_LOCK_SPIN_COUNT             = 100;
+
+static const unsigned   MEM_POOL_FIXED                  = 0x80000000; // internal pool flags
+static const unsigned   MEM_POOL_SHARDED                = 0x40000000;
+static const unsigned   MEM_POOL_SHARD                  = 0x20000000;
+static const unsigned   MEM_POOL_PARTITIONED            = 0x10000000;
+static const unsigned   MEM_POOL_INLINE                 = 0x08000000; // first node chunk and gap index follow the manager
+
+static const size_t     MEM_SHARD_MIN_SIZE              = 4096;
+
+static const size_t     MEM_TCACHE_MIN_SIZE             = 16;
+static const unsigned   MEM_TCACHE_BATCH                = 16;
+
+static const unsigned   MEM_EPOCH_BATCH                 = 64;
+
+static const unsigned   MEM_QUICK_MAX_PARKED            = 256;
+
 
 
 /* Type declarations */
@@ -32,7 +68,14 @@ typedef struct _node {
     alloc_t alloc_record;
     unsigned used;
     unsigned allocated;
+    unsigned pinned;           // mem_pool_compact does not move pinned allocations
+    unsigned cached;           // 1 while the allocation sits in a thread cache
     struct _node *next, *prev; // doubly-linked list for gap deletion
+    struct _node *remote_next; // the pool's remote free queue, limbo list or quick list
+    uint64_t retire_epoch;     // the epoch the node went into limbo in
+    unsigned gap_slot;         // the node's place in the gap index while it is a gap
+    unsigned parked;           // 1 while the node is a gap on a quick list instead
+    uint64_t trace_handle;     // the allocation's handle in the trace, if its pool is traced
 } node_t, *node_pt;
 
 typedef struct _gap {
@@ -40,26 +83,182 @@ typedef struct _gap {
     node_pt node;
 } gap_t, *gap_pt;
 
+struct _tcache;
+struct _maint;
+
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
+    node_pt node_heap; // the first chunk of the node heap
+    node_pt node_list; // the first segment in address order
     unsigned total_nodes;
     unsigned used_nodes;
     gap_pt gap_ix;
     unsigned gap_ix_capacity;
     unsigned gap_ix_size;
+    unsigned flags;
+    int mem_fd;      // memfd backing pool.mem, -1 if the memory is malloc'ed
+    int mem_private; // 1 once pool.mem is a private (copy-on-write) view of mem_fd
+    node_pt node_chunks[MEM_NODE_HEAP_MAX_CHUNKS]; // nodes never move, so chunks are only added
+    unsigned num_node_chunks;
+    node_pt unused_nodes; // unused nodes, linked through next
+    unsigned fresh_nodes; // nodes at the end of the first chunk never used yet, not on the list
+    atomic_int lock;      // only taken for POOL_LOCKED pools
+    struct _tcache *tcaches; // the threads' caches of a POOL_THREAD_CACHE pool
+    unsigned store_slot;     // the pool's slot in the pool store
+    size_t fixed_block_size; // block size of a fixed-size pool
+    unsigned fixed_num_blocks;
+    _Atomic uint64_t fixed_free; // free block stack: tag << 32 | (1 + block)
+    struct _pool_mgr **shards; // the sub-pools of a sharded pool, in address order
+    unsigned num_shards;
+    size_t shard_size;         // size of every shard but the last
+    atomic_size_t largest_gap; // a region's largest gap, read without its lock
+    pthread_t owner;           // the thread that opened a POOL_REMOTE_FREE pool
+    _Atomic(node_pt) remote_frees; // allocations freed by other threads, newest first
+    _Atomic(node_pt) limbo;        // deferred deallocations waiting for readers
+    atomic_uint limbo_count;
+    node_pt compact_gap;           // where mem_pool_compact_step carries on, NULL to start over
+    size_t compact_moved_bytes;
+    unsigned compact_moved_allocs;
+    unsigned long changes;         // bumped by allocations, deallocations, merges and moves
+    struct _maint *maint;          // the background maintenance thread, if any
+    node_pt quick_bins[MEM_QUICK_NUM_BINS]; // parked gaps of a POOL_LAZY_COALESCE pool, by size
+    unsigned num_parked;
+    unsigned gap_hist[POOL_STATS_NUM_BUCKETS];           // gaps by size class, parked ones too
+    size_t gap_hist_max[POOL_STATS_NUM_BUCKETS];         // the largest gap of each class
+    unsigned gap_hist_max_count[POOL_STATS_NUM_BUCKETS]; // and how many gaps have that size
+    uint32_t gap_hist_used;  // the classes with gaps
+    uint32_t gap_hist_stale; // the classes whose largest gap went and must be looked up again
+    uint32_t trace_id;       // the pool's number in the trace, 0 if it is not traced
+    uint32_t trace_session;  // the trace session that number belongs to
 } pool_mgr_t, *pool_mgr_pt;
 
+typedef struct _pool_slot {
+    _Atomic(pool_mgr_pt) pool;
+    atomic_uint next_free; // 1 + the next slot on the free slot stack, 0 for none
+} pool_slot_t, *pool_slot_pt;
+
+/*
+ * A thread's cache of blocks of one pool. The blocks stay allocated in the
+ * pool while they are cached. The cache is referenced by its thread and by
+ * its pool, and is freed when both have let go of it. Lock order is always
+ * cache lock before pool lock.
+ */
+typedef struct _tcache {
+    pool_mgr_pt key;   // the pool the cache was made for, never changes
+    pool_mgr_pt pool;  // same as key while the pool is open, NULL after
+    atomic_int lock;   // taken by the owning thread and by mem_pool_close
+    atomic_int refs;
+    unsigned counts[MEM_TCACHE_NUM_CLASSES];
+    node_pt bins[MEM_TCACHE_NUM_CLASSES][MEM_TCACHE_BIN_CAPACITY];
+    struct _tcache *pool_next;   // the pool's list of caches
+    struct _tcache *thread_next; // the owning thread's list of caches
+} tcache_t, *tcache_pt;
+
+/*
+ * A pool's background maintenance thread. The stats are under the mutex,
+ * which the thread also sleeps on.
+ */
+typedef struct _maint {
+    pool_mgr_pt pool;
+    maintenance_config_t config;
+    maintenance_stats_t stats;
+    unsigned long purge_changes; // the pool's changes at the last purge
+    atomic_int stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} maint_t, *maint_pt;
+
+typedef enum _profile_counter {
+    PROFILE_SEARCHES,
+    PROFILE_SEARCH_STEPS,
+    PROFILE_SPLITS,
+    PROFILE_MERGES,
+    PROFILE_QUICK_HITS,
+    PROFILE_NODE_HEAP_RESIZES,
+    PROFILE_GAP_IX_RESIZES,
+    PROFILE_NUM_COUNTERS
+} profile_counter;
+
+/*
+ * A thread's profiling counters. Only the thread writes them, so they are
+ * bumped with a plain load and store, and mem_profile_read sums them up.
+ */
+typedef struct _profile_rec {
+    atomic_ulong calls[MEM_PROFILE_NUM_OPS];
+    atomic_ulong total_ns[MEM_PROFILE_NUM_OPS];
+    atomic_ulong latency_histogram[MEM_PROFILE_NUM_OPS][MEM_PROFILE_NUM_BUCKETS];
+    atomic_ulong counters[PROFILE_NUM_COUNTERS];
+    atomic_int in_use; // 0 once the thread has exited
+    struct _profile_rec *next;
+} profile_rec_t, *profile_rec_pt;
+
+/*
+ * A thread's epoch record. The epoch is the global epoch the thread saw
+ * when it entered its critical section, 0 outside of one.
+ */
+typedef struct _epoch_rec {
+    atomic_uint_fast64_t epoch;
+    atomic_int in_use; // 0 once the thread has exited
+    struct _epoch_rec *next;
+} epoch_rec_t, *epoch_rec_pt;
+
 
 /* Static global variables */
-static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
-static unsigned pool_store_size = 0;
-static unsigned pool_store_capacity = 0;
+static _Atomic(pool_slot_pt) pool_store[MEM_POOL_STORE_MAX_SEGMENTS]; // segments of slots, they never move
+static atomic_uint pool_store_size = 0;      // slots handed out so far
+static atomic_uint pool_store_capacity = 0;  // pools in the store
+static _Atomic uint64_t pool_store_free = 0; // free slot stack: tag << 32 | (1 + slot)
+static atomic_int pool_store_ready = 0;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local tcache_pt thread_tcaches = NULL;    // this thread's caches
+static _Thread_local tcache_pt thread_tcache_last = NULL; // the cache used last
+static _Thread_local unsigned thread_region_hint = 0;     // the region allocated from last
+
+static atomic_uint_fast64_t epoch_global = 1;
+static _Atomic(epoch_rec_pt) epoch_recs = NULL; // every thread's record, never freed
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local epoch_rec_pt thread_epoch_rec = NULL;
+static _Thread_local unsigned thread_epoch_depth = 0;
+
+static atomic_int profile_enabled = 0;
+static _Atomic(profile_rec_pt) profile_recs = NULL; // every thread's counters, never freed
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local profile_rec_pt thread_profile_rec = NULL;
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mem_profile_t profile_base; // the sums at the last mem_profile_reset
 
 
 /* Forward declarations of static functions */
-static alloc_status _mem_resize_pool_store();
+static pool_slot_pt _mem_pool_store_slot(unsigned slot, int create);
+static alloc_status _mem_add_to_pool_store(pool_mgr_pt pool_mgr);
+static void _mem_remove_from_pool_store(pool_mgr_pt pool_mgr);
+static void _mem_destroy_pool(pool_mgr_pt pool_mgr);
+static pool_mgr_pt _mem_new_pool_mgr();
+static gap_pt _mem_inline_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_init_pool_mgr(pool_mgr_pt manager);
+static pool_pt _mem_open_pool(size_t size, alloc_policy policy, unsigned flags);
+static pool_mgr_pt _mem_open_shards(size_t size, alloc_policy policy, unsigned num_shards,
+                                    unsigned shard_flags, unsigned flags);
+static pool_mgr_pt _mem_shard_of(pool_mgr_pt pool_mgr, const char *mem);
+static alloc_pt _mem_shard_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt _mem_region_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_region_free(pool_mgr_pt region, alloc_pt alloc);
+static size_t _mem_largest_gap(pool_mgr_pt pool_mgr);
+static unsigned _mem_stats_class(size_t size);
+static void _mem_stats_add_gap(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_stats_remove_gap(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_drain_remote_frees(pool_mgr_pt pool_mgr);
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
+static size_t _mem_node_chunk_size(unsigned chunk);
+static node_pt _mem_find_node(pool_mgr_pt pool_mgr, const void *ptr, size_t *index);
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, size_t index);
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr);
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node);
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
 static alloc_status
         _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
@@ -69,7 +268,53 @@ static alloc_status
         _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                                 size_t size,
                                 node_pt node);
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static unsigned _mem_quick_bin(size_t size);
+static void _mem_unlink_free_gap(pool_mgr_pt pool_mgr, node_pt node);
+static unsigned _mem_coalesce(pool_mgr_pt pool_mgr);
+static alloc_status _mem_map_pool_mem(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_unmap_pool_mem(pool_mgr_pt pool_mgr);
+static alloc_pt _mem_dispatch_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_dispatch_free(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_pt _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static void _mem_lock(atomic_int *lock);
+static int _mem_trylock(atomic_int *lock);
+static void _mem_unlock(atomic_int *lock);
+static inline void _mem_pool_lock(pool_mgr_pt pool_mgr);
+static inline void _mem_pool_unlock(pool_mgr_pt pool_mgr);
+static int _mem_tcache_class(size_t size);
+static tcache_pt _mem_tcache_acquire(pool_mgr_pt pool_mgr);
+static void _mem_tcache_flush(tcache_pt tcache, unsigned cls, unsigned count);
+static void _mem_tcache_release(tcache_pt tcache);
+static void _mem_tcache_drain(pool_mgr_pt pool_mgr, int flush);
+static alloc_status _mem_tcache_lock_all(pool_mgr_pt pool_mgr, tcache_pt **tcaches, unsigned *count);
+static void _mem_tcache_unlock_all(pool_mgr_pt pool_mgr, tcache_pt *tcaches, unsigned count);
+static void _mem_tcache_make_key();
+static void _mem_tcache_thread_exit(void *tcaches);
+static alloc_pt _mem_tcache_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_tcache_free(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static unsigned _mem_fixed_free_blocks(pool_mgr_pt pool_mgr, char *is_free);
+static epoch_rec_pt _mem_epoch_rec_acquire();
+static void _mem_epoch_make_key();
+static void _mem_epoch_thread_exit(void *rec);
+static uint64_t _mem_epoch_try_advance();
+static unsigned _mem_epoch_reclaim(pool_mgr_pt pool_mgr, int force);
+static alloc_status _mem_pin(pool_pt pool, alloc_pt alloc, int delta);
+static node_pt _mem_link_gap(pool_mgr_pt pool_mgr, node_pt prev, char *mem, size_t size);
+static void _mem_compact(pool_mgr_pt pool_mgr);
+static size_t _mem_compact_step(pool_mgr_pt pool_mgr, size_t budget);
+static void *_mem_maint_thread(void *arg);
+static void _mem_maint_stop(pool_mgr_pt pool_mgr);
+static size_t _mem_maint_purge(pool_mgr_pt pool_mgr, size_t min_bytes);
+static unsigned long _mem_maint_changes(pool_mgr_pt pool_mgr);
+static profile_rec_pt _mem_profile_rec_acquire();
+static void _mem_profile_make_key();
+static void _mem_profile_thread_exit(void *rec);
+static void _mem_profile_sum(mem_profile_pt profile);
+static inline void _mem_profile_add(atomic_ulong *counter, unsigned long n);
+static inline void _mem_profile_count(profile_counter counter, unsigned long n);
+static inline uint64_t _mem_profile_start();
+static void _mem_profile_stop(mem_op op, uint64_t start);
 
 
 /* Definitions of user-facing functions */
@@ -78,55 +323,60 @@ static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
 * Function Name: mem_init
 * Passed Variables: None
 * Return Type: alloc_status
-* Purpose: To intialize the pool store. The pool store is an array,
-* of all the pool managers being used within the program.
-* This array is the size of the variable MEM_POOL_STORE_INIT_CAPACITY
-* which is 20, giving us space for 20 pool_managers. In case this function
-* is called when the pool store has already been intialized, thre is a check to
-* not reintialize the pool_store. If the allocation fails then the function
-* returns ALLOC_FAIL.
+* Purpose: To intialize the pool store. The pool store holds all the pool
+* managers being used within the program, in segments of slots that are
+* allocated as they are needed and never move. The first segment has
+* MEM_POOL_STORE_INIT_CAPACITY slots and each further one is larger by
+* MEM_POOL_STORE_EXPAND_FACTOR. In case this function is called when the
+* pool store has already been intialized, thre is a check to not
+* reintialize the pool_store. Opening a pool initializes the store too.
 */
 alloc_status mem_init() {
 
 	//If the pool store already has been initialized
 	//Return the allocation status stating that it already has been initialized.
-	if (pool_store != NULL){
+	int ready = 0;
+	if (!atomic_compare_exchange_strong(&pool_store_ready, &ready, 1)){
 		return ALLOC_CALLED_AGAIN;
 	}
-	//Allocate room for the initial amount pool store capacity
-	pool_store = (pool_mgr_pt *)calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_t));
-	//If our allocation went correctly
-	if (pool_store != NULL){
-		//Set the size and capacity of the pool store
-		pool_store_size = MEM_POOL_STORE_INIT_CAPACITY;
-
-		return ALLOC_OK;
-	}
-    //If we get to this point then we know an allocation failed
-	return ALLOC_FAIL;
+
+	return ALLOC_OK;
 }
 
+/*
+ * Function Name: mem_free
+ * Passed Variables: None
+ * Return Type: alloc_status
+ * Purpose: To tear down the pool store. Every pool still in the store is
+ * released, whether or not it has allocations left, and then the store
+ * itself is freed. Returns ALLOC_CALLED_AGAIN if the store is not
+ * initialized. No other thread may use the pool store meanwhile.
+ */
 alloc_status mem_free() {
-    
+
 	/* If mem_init hasn't been called yell at things. */
-	if (pool_store == NULL){
+	int ready = 1;
+	if (!atomic_compare_exchange_strong(&pool_store_ready, &ready, 0)){
 		return ALLOC_CALLED_AGAIN;
 	}
 	/* for all initialized pool managers */
-	for (unsigned int i = 0; i < pool_store_capacity; ++i){
-		/* delete the memory of the poolmgr */
-		mem_pool_close(&pool_store[i]->pool);
+	const unsigned size = atomic_load(&pool_store_size);
+	for (unsigned int i = 0; i < size; ++i){
+		pool_slot_pt slot = _mem_pool_store_slot(i, 0);
+		if (slot != NULL && atomic_load(&slot->pool) != NULL){
+			/* delete the memory of the poolmgr */
+			_mem_destroy_pool(atomic_load(&slot->pool));
+		}
 	}
 	/* free the memory allocated */
-	free(pool_store);
-    pool_store = NULL;
-	if (pool_store != NULL){
-		/* If the deallocation failed return a failure */
-		return ALLOC_FAIL;
+	for (unsigned int s = 0; s < MEM_POOL_STORE_MAX_SEGMENTS; ++s){
+		free(atomic_exchange(&pool_store[s], NULL));
 	}
 	/* reset static variables */
-	pool_store_capacity = 0;
-	pool_store_size = 0;
+	atomic_store(&pool_store_size, 0);
+	atomic_store(&pool_store_capacity, 0);
+	atomic_store(&pool_store_free, 0);
+
 	return ALLOC_OK;
 }
 
@@ -134,85 +384,154 @@ alloc_status mem_free() {
  * Function Name: mem_pool_open
  * Passed Variables: size_t size, alloc_policy policy
  * Return Type: pool_pt
+ * Purpose: This function creates a new pool of memory of the passed size
+ * with the default flags. See mem_pool_open_ex.
+ */
+pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    return mem_pool_open_ex(size, policy, POOL_DEFAULT);
+}
+
+/*
+ * Function Name: mem_pool_open_ex
+ * Passed Variables: size_t size, alloc_policy policy, unsigned flags
+ * Return Type: pool_pt
  * Purpose: This function creates a new pool of memory of the passed size.
  * This is put into a new pool_mgr that has all of it's default values set.
  * The pool's default values are also set. These default values are set using
- * constant value specified at the start of the file.
+ * constant value specified at the start of the file. The flags are a mask
+ * of pool_flag values; POOL_CLONEABLE backs the pool memory with a memfd
+ * so that mem_pool_clone can share its pages instead of copying them,
+ * POOL_LOCKED makes the pool safe to share between threads,
+ * POOL_THREAD_CACHE puts per-thread caches in front of a locked pool,
+ * POOL_REMOTE_FREE queues the deallocations of threads other than the
+ * calling one, which becomes the pool's owner, and POOL_LAZY_COALESCE
+ * puts off merging the gaps, see mem_pool_coalesce. With profiling on,
+ * the call is timed as MEM_OP_POOL_OPEN. The pool is traced if it is
+ * opened while mem_trace_start is in effect.
  */
-pool_pt mem_pool_open(size_t size, alloc_policy policy) {
-    // If the array of pool stores hasn't been allocated then allocate it.
-	if (pool_store == NULL){
-		//if the memory fails to allocate then return NULL.
-		if (mem_init() == ALLOC_FAIL){
-			return NULL;
-		}
-	}
-    pool_store_capacity++;//Increase the amount of pools in the pool_store.
-	//CHeck to see if we have the maximum amount of pool_stores or not.
-	if (_mem_resize_pool_store() != ALLOC_OK){
-        pool_store_capacity--;
-		return NULL;//IF it fails then return NULL.
-	}
-
-    int bool = 0;
-    pool_mgr_pt manager = NULL;
-    /* Loop until allocation succeeds */
-    while(bool == 0){
-        manager = calloc(1, sizeof(pool_mgr_t));//Create a new pool.
-        if (manager != NULL){
-            /* If the allocation succeded escape the loop */
-            bool = 1;
-        }
+pool_pt mem_pool_open_ex(size_t size, alloc_policy policy, unsigned flags) {
+    const uint64_t start = _mem_profile_start();
+    pool_pt pool = _mem_open_pool(size, policy, flags);
+    _mem_profile_stop(MEM_OP_POOL_OPEN, start);
+    if (pool != NULL){
+        ((pool_mgr_pt) pool)->trace_id = mem_trace_log_open(size, policy, flags,
+                                                            &((pool_mgr_pt) pool)->trace_session);
     }
 
-	pool_store[pool_store_capacity - 1] = manager;//Place the new pool in the next open place of the pool_store array.
-	//Set pools values
-	(*manager).pool.policy = policy;
-	(*manager).pool.total_size = size;
-	(*manager).pool.mem = malloc(size);
+    return pool;
+}
 
-	if ((*manager).pool.mem == NULL){
-		free((*manager).pool.mem);//delete the memory allocation
-		free(manager);//delete the allocation of the pool store.
-		//Restore these states to their pre function states.
-		pool_store[pool_store_capacity - 1] = NULL;
-		pool_store_capacity--;
-		return NULL;
-	}
+/*
+ * Function Name: mem_pool_open_fixed
+ * Passed Variables: size_t block_size, unsigned num_blocks, unsigned flags
+ * Return Type: pool_pt
+ * Purpose: This function creates a pool of num_blocks blocks of the same
+ * size, served by mem_fixed_alloc and mem_fixed_free without any lock.
+ * The block size is rounded up to a multiple of 8. The free blocks form a
+ * stack threaded through the blocks themselves, so the pool needs no
+ * node heap or gap index. Returns NULL on failure.
+ */
+pool_pt mem_pool_open_fixed(size_t block_size, unsigned num_blocks, unsigned flags) {
+    block_size = (block_size < sizeof(uint64_t)) ? sizeof(uint64_t) :
+                 (block_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    if (num_blocks == 0 || num_blocks == UINT32_MAX){
+        return NULL;
+    }
 
-	//Allocate the node heap and gap index
-	(*manager).gap_ix = calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-	(*manager).node_heap = calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
-	if ((*manager).node_heap == NULL || (*manager).gap_ix == NULL){
-		//Free all allocated memory
-		free((*manager).node_heap);
-		free((*manager).gap_ix);
-		free((*manager).pool.mem);
-		free(manager);
-		//Restore these states to their pre function states.
-		pool_store[pool_store_capacity - 1] = NULL;
-		pool_store_capacity--;
-		return NULL;
-	}
-	//Initialize all gap and node members.
-	(*manager).total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-	(*manager).used_nodes = 1;
-    //call add to gap ix here once written for a gap the size of the pool
-    (*manager).gap_ix_size = MEM_GAP_IX_INIT_CAPACITY;
-    (*manager).node_heap[0].alloc_record.size = size;
-    (*manager).node_heap[0].allocated = 0;
-    (*manager).node_heap[0].used = 1;
-    (*manager).node_heap[0].prev = NULL;
-    (*manager).node_heap[0].next = NULL;
-    if(_mem_add_to_gap_ix(manager, size, &(*manager).node_heap[0]) == ALLOC_FAIL){
-        printf("Failed to add first node to gap index.");
-        exit(0);
+    pool_mgr_pt manager = calloc(1, sizeof(pool_mgr_t));
+    if (manager == NULL){
+        return NULL;
+    }
+    manager->pool.policy = FIRST_FIT;
+    manager->pool.total_size = block_size * num_blocks;
+    manager->pool.num_gaps = num_blocks;
+    manager->flags = (flags & ~(POOL_LOCKED | POOL_THREAD_CACHE | POOL_REMOTE_FREE | POOL_LAZY_COALESCE)) |
+                     MEM_POOL_FIXED;
+    manager->fixed_block_size = block_size;
+    manager->fixed_num_blocks = num_blocks;
+    atomic_init(&manager->lock, 0);
+    if (_mem_map_pool_mem(manager, manager->pool.total_size) != ALLOC_OK){
+        free(manager);
+        return NULL;
+    }
+
+    /* Every block links to the one after it, the last one to none */
+    for (unsigned i = 0; i < num_blocks; ++i){
+        atomic_init((atomic_uint *) (manager->pool.mem + (size_t) i * block_size),
+                    (i + 1 < num_blocks) ? i + 2 : 0);
     }
+    atomic_init(&manager->fixed_free, 1);
 
+    if (_mem_add_to_pool_store(manager) != ALLOC_OK){
+        _mem_destroy_pool(manager);
+        return NULL;
+    }
 
     return (pool_pt) manager;
 }
 
+/*
+ * Function Name: mem_pool_open_sharded
+ * Passed Variables: size_t size, alloc_policy policy, unsigned num_shards, unsigned flags
+ * Return Type: pool_pt
+ * Purpose: This function creates one pool whose memory is split into
+ * num_shards sub-pools, one per CPU if num_shards is 0, each with its own
+ * node heap, gap index and lock. An allocation is served by the shard of
+ * the CPU the calling thread runs on, and falls back to the sibling shards
+ * when that one cannot satisfy it, so an allocation can be no larger than
+ * a shard. A deallocation goes to the shard that owns the address. Gaps
+ * are never merged across shards. The flags are passed on to the shards,
+ * which are always locked; POOL_CLONEABLE is ignored. The pool's counters
+ * are brought up to date by mem_inspect_pool. Returns NULL on failure.
+ */
+pool_pt mem_pool_open_sharded(size_t size, alloc_policy policy, unsigned num_shards, unsigned flags) {
+    if (num_shards == 0){
+        const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        num_shards = (num_cpus > 0) ? (unsigned) num_cpus : 1;
+    }
+    if (num_shards > MEM_SHARD_MAX_COUNT){
+        num_shards = MEM_SHARD_MAX_COUNT;
+    }
+    while (num_shards > 1 && size / num_shards < MEM_SHARD_MIN_SIZE){
+        --num_shards;
+    }
+
+    return (pool_pt) _mem_open_shards(size, policy, num_shards,
+                                      (flags & (POOL_THREAD_CACHE | POOL_LAZY_COALESCE)) | POOL_LOCKED,
+                                      MEM_POOL_SHARDED);
+}
+
+/*
+ * Function Name: mem_pool_open_partitioned
+ * Passed Variables: size_t size, alloc_policy policy, unsigned num_regions
+ * Return Type: pool_pt
+ * Purpose: This function creates one pool for many threads whose address
+ * space is split into num_regions regions, MEM_REGIONS_PER_CPU per CPU if
+ * num_regions is 0. Every region is a sub-pool with its own node heap,
+ * gap index and lock, and publishes the size of its largest gap. An
+ * allocation goes to the first region with a large enough gap whose lock
+ * is free, starting from the region the thread allocated from last, and
+ * waits for a lock only if all such regions are busy. Deallocations in
+ * different regions proceed in parallel. Gaps are never merged across
+ * regions, so an allocation can be no larger than a region. Otherwise the
+ * pool behaves like a sharded pool. Returns NULL on failure.
+ */
+pool_pt mem_pool_open_partitioned(size_t size, alloc_policy policy, unsigned num_regions) {
+    if (num_regions == 0){
+        const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        num_regions = (num_cpus > 0) ? (unsigned) num_cpus * MEM_REGIONS_PER_CPU : MEM_REGIONS_PER_CPU;
+    }
+    if (num_regions > MEM_SHARD_MAX_COUNT){
+        num_regions = MEM_SHARD_MAX_COUNT;
+    }
+    while (num_regions > 1 && size / num_regions < MEM_SHARD_MIN_SIZE){
+        --num_regions;
+    }
+
+    return (pool_pt) _mem_open_shards(size, policy, num_regions, POOL_LOCKED,
+                                      MEM_POOL_SHARDED | MEM_POOL_PARTITIONED);
+}
+
 /*
  * Function Name: mem_pool_close
  * Passed Variables: pool_pt pool
@@ -221,7 +540,10 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
  * all allocated memory is deleted and the pool's manager is removed
  * from the pool store array. If the pool is not aember of any of the pool
  * managers then the function returns ALLOC_NOT_FREED telling the program that
- * the pool was not deallocated.
+ * the pool was not deallocated. No other thread may use the pool while it
+ * is being closed, nor read it any more. The blocks in the threads' caches,
+ * the remote free queue and the limbo list are returned first, and the
+ * parked blocks merged.
  */
 alloc_status mem_pool_close(pool_pt pool) {
 
@@ -230,460 +552,3302 @@ alloc_status mem_pool_close(pool_pt pool) {
 	if (manager == NULL) {
         return ALLOC_FAIL;
     }
-    if(manager->used_nodes > 1){
+    if (manager->flags & MEM_POOL_FIXED){
+        if (_mem_fixed_free_blocks(manager, NULL) != manager->fixed_num_blocks){
+            return ALLOC_NOT_FREED;
+        }
+        _mem_remove_from_pool_store(manager);
+        _mem_destroy_pool(manager);
+        return ALLOC_OK;
+    }
+    _mem_epoch_reclaim(manager, 1);
+    if (manager->flags & MEM_POOL_SHARDED){
+        for (unsigned i = 0; i < manager->num_shards; ++i){
+            pool_mgr_pt shard = manager->shards[i];
+            if (shard->flags & POOL_THREAD_CACHE){
+                _mem_tcache_drain(shard, 1);
+            }
+            _mem_pool_lock(shard);
+            _mem_coalesce(shard);
+            const unsigned used_nodes = shard->used_nodes;
+            _mem_pool_unlock(shard);
+            if (used_nodes > 1){
+                return ALLOC_NOT_FREED;
+            }
+        }
+        _mem_remove_from_pool_store(manager);
+        _mem_destroy_pool(manager);
+        return ALLOC_OK;
+    }
+    // cached and queued blocks go back to the pool first
+    if (manager->flags & POOL_THREAD_CACHE){
+        _mem_tcache_drain(manager, 1);
+    }
+    _mem_pool_lock(manager);
+    _mem_drain_remote_frees(manager);
+    _mem_coalesce(manager);
+    const unsigned used_nodes = manager->used_nodes;
+    _mem_pool_unlock(manager);
+    if(used_nodes > 1){
         return ALLOC_NOT_FREED;
     }
 	//free all allocated memory
-	free((*manager).pool.mem);
-	free((*manager).node_heap);
-	free((*manager).gap_ix);
-	free(manager);
-	pool_store_capacity--;
+	const uint32_t trace_id = manager->trace_id;
+	const uint32_t trace_session = manager->trace_session;
+	_mem_remove_from_pool_store(manager);
+	_mem_destroy_pool(manager);
+	mem_trace_log_close(trace_id, trace_session);
 
     return ALLOC_OK;
 }
 
-alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
+/*
+ * Function Name: mem_pool_clone
+ * Passed Variables: pool_pt pool
+ * Return Type: pool_pt
+ * Purpose: This function creates a logically independent copy of a pool.
+ * The node heap and gap index are copied and their pointers are rebased
+ * onto the copy. For a POOL_CLONEABLE pool the pool memory is not copied:
+ * the pool is remapped as a private view of its memfd and the clone maps
+ * the same memfd privately, so untouched pages stay shared until one side
+ * writes them. A pool that has already diverged from its memfd (it was
+ * cloned before) is copied once into a fresh memfd for the clone, and a
+ * pool without a memfd is copied with memcpy. Blocks in the threads'
+ * caches, on the remote free queue and in limbo are free in the clone.
+ * Returns NULL on failure. Fixed-size and sharded pools cannot be cloned.
+ */
+pool_pt mem_pool_clone(pool_pt pool) {
+    const pool_mgr_pt source = (pool_mgr_pt) pool;
+    if (source == NULL || (source->flags & (MEM_POOL_FIXED | MEM_POOL_SHARDED))){
+        return NULL;
+    }
 
-    /* Upcast the pool to access the manager */
-    size_t remainSpace = 0;
-    const pool_mgr_pt manager = (pool_mgr_pt) pool;
-    /* If any of these cases are true then exit */
-    if((*manager).gap_ix_capacity == 0 || _mem_resize_node_heap(manager) == ALLOC_FAIL ||
-       (*manager).total_nodes <= (*manager).used_nodes){
-        exit(0);
+    pool_mgr_pt clone = calloc(1, sizeof(pool_mgr_t));
+    if (clone == NULL){
+        return NULL;
     }
-    node_pt newNode = NULL;
-    unsigned best_Position = 0;
-    if(manager->pool.policy == BEST_FIT) {
-        /*These values represent the location of the location of the current best gap
-         * and it's size. They are set to the first gap (0) because the gap index is sorted
-         * and that gap is going to have the largest amount of memory possible.*/
-        size_t current_Best = (*manager).gap_ix[0].size;
-        for (unsigned i = 0; i < (*manager).gap_ix_capacity; ++i) {
-            /*Loop throught the array until we find a gap that is a better fit than the current one*/
-            if ((*manager).gap_ix[i].size >= size && (*manager).gap_ix[i].size <= current_Best) {
-                best_Position = i;
-                newNode = (*manager).gap_ix[i].node;
-                current_Best = (*manager).gap_ix[i].size;
-                /*If the gaps size is the exact size of the requested size then break
-                 * since there is no possible way to get a better gap.*/
-                if ((*manager).gap_ix[i].size == size) {
-                    break;
-                }
-            }
-            if (i == (*manager).gap_ix_capacity - 1) {
-                //If we did not find an optimal gap
-                if (newNode == NULL) {
-                    printf("No gap that has enough memory for allocation");
-                    return NULL;
-                }
-                //Calculate the remaining gap space
-                remainSpace = newNode->alloc_record.size - size;
-            }
+    /* Blocks in the threads' caches are allocated in the node heap, so the caches are held still */
+    tcache_pt *tcaches = NULL;
+    unsigned num_tcaches = 0;
+    if (!(source->flags & POOL_THREAD_CACHE)){
+        _mem_pool_lock(source);
+    } else if (_mem_tcache_lock_all(source, &tcaches, &num_tcaches) != ALLOC_OK){
+        free(clone);
+        return NULL;
+    }
+    if (pthread_equal(source->owner, pthread_self())){
+        _mem_drain_remote_frees(source);
+    }
+    /* Only the owner takes the queue, so what is on it now stays there while the pool is locked */
+    node_pt remote = atomic_load_explicit(&source->remote_frees, memory_order_acquire);
+    /* Other threads take the lock and push frees meanwhile, so from the lock to the limbo list is not copied */
+    memcpy(clone, source, offsetof(pool_mgr_t, lock));
+    memcpy((char *) clone + offsetof(pool_mgr_t, compact_gap), (char *) source + offsetof(pool_mgr_t, compact_gap),
+           sizeof(pool_mgr_t) - offsetof(pool_mgr_t, compact_gap));
+    atomic_init(&clone->lock, 0);
+    clone->tcaches = NULL;
+    clone->owner = pthread_self();
+    clone->compact_gap = NULL;
+    clone->maint = NULL;
+    clone->trace_id = 0;
+    clone->flags &= ~MEM_POOL_INLINE;
+    atomic_init(&clone->remote_frees, NULL);
+    atomic_init(&clone->limbo, NULL);
+    atomic_init(&clone->limbo_count, 0);
+    clone->mem_fd = -1;
+    clone->mem_private = 0;
+    clone->pool.mem = NULL;
+    clone->node_heap = NULL;
+    clone->gap_ix = calloc(source->gap_ix_size, sizeof(gap_t));
+    for (unsigned c = 0; c < source->num_node_chunks; ++c){
+        clone->node_chunks[c] = calloc(_mem_node_chunk_size(c), sizeof(node_t));
+        if (clone->node_chunks[c] == NULL){
+            clone->num_node_chunks = c;
+            break;
         }
     }
-
-
-    /* First Fit allocation */
-    if(manager->pool.policy == FIRST_FIT){
-        for (unsigned int i = 0; i<(*manager).total_nodes; ++i){
-            /* Find the first empty node in the array. Needs to be able to fit the size we're allocating */
-            if((*manager).node_heap[i].allocated == 0 && manager->node_heap[i].used == 1 && (*manager).node_heap[i].alloc_record.size >= size){
-                newNode = &(*manager).node_heap[i];//Set the new node to the found gap.
-                remainSpace = newNode->alloc_record.size - size;//Place the remaining amount of memory into a holder for later
-                (*manager).node_heap[i] = *newNode;
-                best_Position = i;
-                break;
+    if (clone->num_node_chunks != source->num_node_chunks || clone->gap_ix == NULL){
+        _mem_tcache_unlock_all(source, tcaches, num_tcaches);
+        free(tcaches);
+        _mem_destroy_pool(clone);
+        return NULL;
+    }
+    clone->node_heap = clone->node_chunks[0];
+
+    const size_t size = source->pool.total_size;
+    char *mem = MAP_FAILED;
+    if (source->mem_fd >= 0 && !source->mem_private){
+        /* Freeze the memfd: from now on the source writes to private pages */
+        clone->mem_fd = dup(source->mem_fd);
+        if (clone->mem_fd >= 0 &&
+            mmap(source->pool.mem, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, source->mem_fd, 0) != MAP_FAILED){
+            source->mem_private = 1;
+            clone->mem_private = 1;
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, clone->mem_fd, 0);
+        }
+    } else if (source->mem_fd >= 0){
+        /* The source has diverged, so its current contents go into a new memfd */
+        clone->mem_fd = memfd_create("mem_pool", MFD_CLOEXEC);
+        if (clone->mem_fd >= 0 && ftruncate(clone->mem_fd, size) == 0){
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, clone->mem_fd, 0);
+            if (mem != MAP_FAILED){
+                memcpy(mem, source->pool.mem, size);
             }
         }
+    } else {
+        char *copy = malloc(size);
+        if (copy != NULL){
+            memcpy(copy, source->pool.mem, size);
+            mem = copy;
+        }
     }
-    /* if the node couldn't be allocated return null */
-    if(newNode == NULL){
+    if (mem == MAP_FAILED){
+        _mem_tcache_unlock_all(source, tcaches, num_tcaches);
+        free(tcaches);
+        if (clone->mem_fd >= 0){
+            close(clone->mem_fd);
+            clone->mem_fd = -1;
+        }
+        _mem_destroy_pool(clone);
         return NULL;
     }
-    /* remove the node from the gap index */
-    if(_mem_remove_from_gap_ix(manager,size,newNode) != ALLOC_OK){
-        return NULL;
+    clone->pool.mem = mem;
+
+    /* Copy the node heap and gap index, rebasing every pointer onto the clone */
+    size_t index = 0;
+    for (unsigned c = 0; c < clone->num_node_chunks; ++c){
+        const size_t chunk_size = _mem_node_chunk_size(c);
+        memcpy(clone->node_chunks[c], source->node_chunks[c], chunk_size * sizeof(node_t));
+        for (unsigned i = 0; i < chunk_size; ++i){
+            node_pt node = &clone->node_chunks[c][i];
+            if (node->used){
+                node->alloc_record.mem = mem + (node->alloc_record.mem - source->pool.mem);
+            }
+            if (node->next != NULL && _mem_find_node(source, node->next, &index)){
+                node->next = _mem_node_at(clone, index);
+            }
+            if (node->prev != NULL && _mem_find_node(source, node->prev, &index)){
+                node->prev = _mem_node_at(clone, index);
+            }
+            if (node->parked && node->remote_next != NULL && _mem_find_node(source, node->remote_next, &index)){
+                node->remote_next = _mem_node_at(clone, index);
+            }
+        }
     }
-    manager->pool.num_allocs++;//Change the amount of allocations to the pool
-    manager->pool.alloc_size += size;
-    /* Alter the nodes values */
-    newNode->used = 1;
-    newNode->allocated = 1;
-    newNode->alloc_record.size = size;
-    newNode->alloc_record.mem = malloc(size);
-    node_pt gap_Node = NULL; // Create a new node to hold the node that's going to become the gap.
-    /* Check if we need a new node for the next gap or if we don't need a new gap. */
-    if(_mem_resize_node_heap(manager)== ALLOC_FAIL && remainSpace != 0){
-        exit(0);
+    for (unsigned b = 0; b < MEM_QUICK_NUM_BINS; ++b){
+        if (source->quick_bins[b] != NULL && _mem_find_node(source, source->quick_bins[b], &index)){
+            clone->quick_bins[b] = _mem_node_at(clone, index);
+        }
     }
-    if(remainSpace != 0) {
-        for (unsigned i = best_Position; i < (*manager).total_nodes; ++i) {
-            /*Find an unused node */
-            if ((*manager).node_heap[i].used == 0) {
-                gap_Node = &(*manager).node_heap[i];
-                /* add this node to the gap index with the leftover size from the alloc. */
-                if (_mem_add_to_gap_ix(manager, remainSpace, gap_Node) == ALLOC_FAIL) {
-                    exit(0);
-                }
-                break;
+    if (source->unused_nodes != NULL && _mem_find_node(source, source->unused_nodes, &index)){
+        clone->unused_nodes = _mem_node_at(clone, index);
+    }
+    _mem_find_node(source, source->node_list, &index);
+    clone->node_list = _mem_node_at(clone, index);
+    memcpy(clone->gap_ix, source->gap_ix, source->gap_ix_capacity * sizeof(gap_t));
+    for (unsigned i = 0; i < clone->gap_ix_capacity; ++i){
+        _mem_find_node(source, source->gap_ix[i].node, &index);
+        clone->gap_ix[i].node = _mem_node_at(clone, index);
+    }
+
+    /* What sits in the caches, on the remote free queue or in limbo is free, so it is freed in the clone */
+    for (unsigned c = 0; c < clone->num_node_chunks; ++c){
+        for (unsigned i = 0; i < _mem_node_chunk_size(c); ++i){
+            node_pt node = &clone->node_chunks[c][i];
+            if (node->used && node->allocated && node->retire_epoch != 0){
+                node->remote_next = NULL;
+                _mem_del_alloc(clone, (alloc_pt) node);
             }
         }
-        /* Increase the used nodes and have the nodes start to point to one another */
-        manager->used_nodes++;
-        if (newNode->next != NULL) {
-            node_pt next = newNode->next;
-            gap_Node->next = next;
-            next->prev = gap_Node;
-        }
-        else {
-            gap_Node->next = NULL;
+    }
+    for (node_pt node = remote; node != NULL; node = node->remote_next){
+        _mem_find_node(source, node, &index);
+        node_pt copy = _mem_node_at(clone, index);
+        copy->remote_next = NULL;
+        _mem_del_alloc(clone, (alloc_pt) copy);
+    }
+    for (unsigned t = 0; t < num_tcaches; ++t){
+        for (unsigned cls = 0; cls < MEM_TCACHE_NUM_CLASSES; ++cls){
+            for (unsigned i = 0; i < tcaches[t]->counts[cls]; ++i){
+                _mem_find_node(source, tcaches[t]->bins[cls][i], &index);
+                node_pt copy = _mem_node_at(clone, index);
+                copy->cached = 0;
+                _mem_del_alloc(clone, (alloc_pt) copy);
+            }
         }
+    }
+    _mem_tcache_unlock_all(source, tcaches, num_tcaches);
+    free(tcaches);
 
-        newNode->next = gap_Node;
-        gap_Node->prev = newNode;
+    if (_mem_add_to_pool_store(clone) != ALLOC_OK){
+        _mem_destroy_pool(clone);
+        return NULL;
     }
-    newNode->allocated = 1;
 
-    return (alloc_pt) newNode;
+    return (pool_pt) clone;
 }
 
-alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt mgr = (pool_mgr_pt) pool;
-
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt node = (node_pt) alloc;
+/*
+ * Function Name: mem_pool_clone_alloc
+ * Passed Variables: pool_pt clone, pool_pt pool, alloc_pt alloc
+ * Return Type: alloc_pt
+ * Purpose: This function translates an allocation of a pool into the
+ * matching allocation of a clone made from that pool with mem_pool_clone.
+ * Returns NULL if the allocation does not exist in the clone.
+ */
+alloc_pt mem_pool_clone_alloc(pool_pt clone, pool_pt pool, alloc_pt alloc) {
+    const pool_mgr_pt clone_mgr = (pool_mgr_pt) clone;
+    const pool_mgr_pt source = (pool_mgr_pt) pool;
+    size_t index = 0;
 
-    node_pt del_node = NULL;
-    // find the node in the node heap
-    for(int i = 0; i< mgr->total_nodes; ++i){
-        if(node == &mgr->node_heap[i]){
-            del_node = &mgr->node_heap[i];
-            break;
-        }
+    if (clone_mgr == NULL || source == NULL || _mem_find_node(source, alloc, &index) == NULL){
+        return NULL;
     }
-    // this is node-to-delete
-    // make sure it's found
-    if(del_node == NULL){
-        return ALLOC_FAIL;
+    node_pt node = _mem_node_at(clone_mgr, index);
+    if (node == NULL || !node->allocated){
+        return NULL;
     }
 
-    // convert to gap node
-    del_node->allocated = 0;
-
-    // update metadata (num_allocs, alloc_size)
-    mgr->pool.num_allocs--;
-    mgr->pool.alloc_size -= del_node->alloc_record.size;
-
-
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if(del_node->next != NULL && del_node->next->allocated == 0) {
-        node_pt next = del_node->next;
-        //   remove the next node from gap index
-        if(_mem_remove_from_gap_ix(mgr, 0, next) == ALLOC_FAIL)
-            return ALLOC_FAIL;
+    return (alloc_pt) node;
+}
 
-        //   add the size to the node-to-delete
-        del_node->alloc_record.size += next->alloc_record.size;
-        //   update node as unused
-        next->used = 0;
-        //   update metadata (used nodes)
-        mgr->used_nodes--;
-        //   update linked list:
-        if (next->next) {
-            next->next->prev = del_node;
-            del_node->next = next->next;
-        } else {
-            del_node->next = NULL;
+/*
+ * Function Name: mem_new_alloc
+ * Passed Variables: pool_pt pool, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function allocates size bytes from the pool according to
+ * the pool's policy. Returns NULL if no gap is large enough. For a
+ * POOL_THREAD_CACHE pool small sizes are rounded up to a size class and
+ * served from the calling thread's cache. Fixed-size pools are served by
+ * mem_fixed_alloc instead. The owner of a POOL_REMOTE_FREE pool first
+ * takes back the allocations other threads have freed. With profiling
+ * on, the call is timed as MEM_OP_NEW_ALLOC.
+ */
+alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
+    const uint64_t start = _mem_profile_start();
+    alloc_pt alloc = _mem_dispatch_alloc((pool_mgr_pt) pool, size);
+    _mem_profile_stop(MEM_OP_NEW_ALLOC, start);
+    const uint32_t trace_id = ((pool_mgr_pt) pool)->trace_id;
+    if (trace_id != 0){
+        const uint64_t handle = mem_trace_log_alloc(trace_id, ((pool_mgr_pt) pool)->trace_session,
+                                                    size, alloc != NULL);
+        if (alloc != NULL){
+            ((node_pt) alloc)->trace_handle = handle;
         }
-        next->next = NULL;
-        next->prev = NULL;
     }
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    if(del_node->prev!= NULL && del_node->prev->allocated == 0) {
-        //   remove the previous node from gap index
-        node_pt previous = del_node->prev;
-        if(_mem_remove_from_gap_ix(mgr, 0, previous) == ALLOC_FAIL)
-            return ALLOC_FAIL;
 
-        //   add the size of node-to-delete to the previous
-        previous->alloc_record.size += del_node->alloc_record.size;
-        //   update node-to-delete as unused
-        del_node->used = 0;
-        //   update metadata (used_nodes)
-        mgr->used_nodes--;
-        //   update linked list
-        if (del_node->next) {
-            previous->next = del_node->next;
-            del_node->next->prev = previous;
-        } else {
-            previous->next = NULL;
-        }
-        del_node->next = NULL;
-        del_node->prev = NULL;
+    return alloc;
+}
 
-        //   change the node to add to the previous node!
-        del_node = previous;
+/*
+ * Function Name: mem_del_alloc
+ * Passed Variables: pool_pt pool, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function returns an allocation to the pool, merging it
+ * with the neighbouring gaps, or parking it for later reuse in a
+ * POOL_LAZY_COALESCE pool. Returns ALLOC_FAIL if the allocation does
+ * not belong to the pool. For a POOL_THREAD_CACHE pool blocks of a size
+ * class go into the calling thread's cache instead and are not checked.
+ * For a sharded or partitioned pool the shard or region owning the
+ * address takes the allocation.
+ * A thread other than the owner of a POOL_REMOTE_FREE pool only pushes the
+ * allocation on the pool's remote free queue, without checking it or
+ * touching the node heap and gap index; the owner takes it back later.
+ * With profiling on, the call is timed as MEM_OP_DEL_ALLOC.
+ */
+alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
+    const uint64_t start = _mem_profile_start();
+    /* the handle goes with the node, which may be reused once it is freed */
+    const uint32_t trace_id = ((pool_mgr_pt) pool)->trace_id;
+    const uint64_t handle = (trace_id != 0 && alloc != NULL) ? ((node_pt) alloc)->trace_handle : 0;
+    alloc_status status = _mem_dispatch_free((pool_mgr_pt) pool, alloc);
+    _mem_profile_stop(MEM_OP_DEL_ALLOC, start);
+    if (handle != 0 && status == ALLOC_OK){
+        mem_trace_log_free(trace_id, ((pool_mgr_pt) pool)->trace_session, handle);
     }
-    // add the resulting node to the gap index
-    // check success
-    if(_mem_add_to_gap_ix(mgr, del_node->alloc_record.size,del_node ) != ALLOC_OK)
-        return ALLOC_FAIL;
 
-    return ALLOC_OK;
+    return status;
 }
 
 /*
- * Function Name: mem_inspect_pool
- * Passed Variables: pool_pt pool, pool_segment_pt *segments, unsigned *num_segments
- * Return Type: void
- * Purpose: This function is called within main so the contents of the pool
- * may be displayed in the console. Segments and num_segments are used in
- * main and are passed back by reference. Segments is an array of all used 
- * nodes, while num_segments is the amount of used nodes.
+ * Function Name: mem_fixed_alloc
+ * Passed Variables: pool_pt pool
+ * Return Type: char *
+ * Purpose: This function pops a block off the free block stack of a
+ * fixed-size pool with a single compare-and-swap. The stack head packs a
+ * tag, bumped on every pop, with the index of the top block, so a pop
+ * that raced with another pop and a push of the same block fails and
+ * retries instead of installing a stale next link (the ABA problem).
+ * The next link read may come from a block another thread has popped and
+ * is writing to; that value is never used, as the tag has moved on, and
+ * the block stays mapped while the pool is open.
+ * Returns NULL if the pool has no free block.
  */
-void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments) {
+char *mem_fixed_alloc(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || !(manager->flags & MEM_POOL_FIXED)){
+        return NULL;
+    }
 
-    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    uint64_t head = atomic_load_explicit(&manager->fixed_free, memory_order_acquire);
+    while ((uint32_t) head != 0){
+        char *block = manager->pool.mem + (size_t) ((uint32_t) head - 1) * manager->fixed_block_size;
+        const uint32_t next = atomic_load_explicit((atomic_uint *) block, memory_order_relaxed);
+        const uint64_t popped = (((head >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_weak_explicit(&manager->fixed_free, &head, popped,
+                                                  memory_order_acquire, memory_order_acquire)){
+            return block;
+        }
+    }
+    return NULL;
+}
 
-    // allocate the segments array with size == used_nodes
-    pool_segment_pt segs = (pool_segment_pt) calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+/*
+ * Function Name: mem_fixed_free
+ * Passed Variables: pool_pt pool, char *block
+ * Return Type: alloc_status
+ * Purpose: This function pushes a block back on the free block stack of
+ * a fixed-size pool. Returns ALLOC_FAIL if the pointer is not a block of
+ * the pool. Freeing a block twice is not detected.
+ */
+alloc_status mem_fixed_free(pool_pt pool, char *block) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || !(manager->flags & MEM_POOL_FIXED) ||
+        block < manager->pool.mem || block >= manager->pool.mem + manager->pool.total_size ||
+        (block - manager->pool.mem) % manager->fixed_block_size != 0){
+        return ALLOC_FAIL;
+    }
 
-    // check successful
-    assert(segs);
-    node_pt current = pool_mgr->node_heap;
+    const uint64_t index = (block - manager->pool.mem) / manager->fixed_block_size;
+    uint64_t head = atomic_load_explicit(&manager->fixed_free, memory_order_relaxed);
+    uint64_t pushed;
+    do {
+        atomic_store_explicit((atomic_uint *) block, (uint32_t) head, memory_order_relaxed);
+        pushed = (head & 0xffffffff00000000ull) | (index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&manager->fixed_free, &head, pushed,
+                                                    memory_order_release, memory_order_relaxed));
 
-    // loop through the node heap and the segments array
-    for(int i = 0; i < pool_mgr->used_nodes; ++i){
-        //    for each node, write the size and allocated in the segment
-        segs[i].size = current->alloc_record.size;
-        segs[i].allocated = current->allocated;
-        if(current->next != NULL) {
-            current = current->next;
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_pool_flush_thread_cache
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: This function returns all blocks in the calling thread's cache
+ * of a POOL_THREAD_CACHE pool to the pool. Threads flush their caches
+ * when they exit; this is for threads that stay around.
+ */
+alloc_status mem_pool_flush_thread_cache(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager != NULL && (manager->flags & MEM_POOL_SHARDED)){
+        alloc_status status = ALLOC_OK;
+        for (unsigned i = 0; i < manager->num_shards; ++i){
+            if (mem_pool_flush_thread_cache((pool_pt) manager->shards[i]) != ALLOC_OK){
+                status = ALLOC_FAIL;
+            }
         }
+        return status;
     }
+    if (manager == NULL || !(manager->flags & POOL_THREAD_CACHE)){
+        return ALLOC_FAIL;
+    }
+    tcache_pt tcache = _mem_tcache_acquire(manager);
+    if (tcache == NULL){
+        return ALLOC_FAIL;
+    }
+    for (unsigned cls = 0; cls < MEM_TCACHE_NUM_CLASSES; ++cls){
+        _mem_tcache_flush(tcache, cls, tcache->counts[cls]);
+    }
+    _mem_unlock(&tcache->lock);
 
-    // "return" the values:
-    *segments = segs;
-    *num_segments = pool_mgr->used_nodes;
-    /*pass these values back */
-
-    return;
-    
+    return ALLOC_OK;
 }
 
+/*
+ * Function Name: mem_pool_lock
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: This function takes the lock of a POOL_LOCKED pool, or of
+ * every shard of a sharded pool, and holds it until mem_pool_unlock.
+ * Other threads calling into the pool wait for it meanwhile, though
+ * blocks in their thread caches are still served. It is for making a
+ * fork safe: with the lock held around it, no thread can be halfway
+ * through changing the pool the child inherits. The calling thread must
+ * not use the pool until it unlocks it. It does nothing for pools
+ * without a lock.
+ */
+alloc_status mem_pool_lock(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL){
+        return ALLOC_FAIL;
+    }
+    if (manager->flags & MEM_POOL_SHARDED){
+        for (unsigned i = 0; i < manager->num_shards; ++i){
+            _mem_pool_lock(manager->shards[i]);
+        }
+        return ALLOC_OK;
+    }
+    _mem_pool_lock(manager);
 
-/* Definitions of static functions */
+    return ALLOC_OK;
+}
 
 /*
- * Function Name: _mem_resize_pool_store
- * Passed Variables: none
+ * Function Name: mem_pool_unlock
+ * Passed Variables: pool_pt pool
  * Return Type: alloc_status
- * Purpose: This function takes the current pool store array and determines
- * whether or not the pool store needs more pool managers. It resizes
- * this by using the realloc function to reallocate the amount of pool mangers
- * in the pool store. If this reallocation fails thn we return ALLOC_FAIL.
- */
-static alloc_status _mem_resize_pool_store() {
-    /* Check to see if we have too many pools. */
-    if (((float) pool_store_capacity / pool_store_size)> MEM_POOL_STORE_FILL_FACTOR){
-        /* Create a new pool manager that is a reallocated 'pool_store' */
-        pool_mgr_pt* reallocated_store = (pool_mgr_pt *) realloc(pool_store, pool_store_capacity* MEM_POOL_STORE_EXPAND_FACTOR * sizeof(pool_mgr_pt));
-        if(reallocated_store == NULL){
-            /* If the allocation failed then we return a fail state. */
-            return ALLOC_FAIL;
-        }
-        else{
-            /* Set the pool_store to the newly allocated pool_store 'reallocated_store*/
-            pool_store = reallocated_store;
+ * Purpose: This function releases the lock taken with mem_pool_lock. In
+ * the child of a fork it releases the lock the parent's thread took.
+ */
+alloc_status mem_pool_unlock(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL){
+        return ALLOC_FAIL;
+    }
+    if (manager->flags & MEM_POOL_SHARDED){
+        for (unsigned i = manager->num_shards; i > 0; --i){
+            _mem_pool_unlock(manager->shards[i - 1]);
         }
         return ALLOC_OK;
     }
-    /* If we don't have too many pools then we can return that everything is okay */
-    else{
-        return ALLOC_OK;
+    _mem_pool_unlock(manager);
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_epoch_enter
+ * Passed Variables: None
+ * Return Type: void
+ * Purpose: This function starts a read-side critical section of the
+ * calling thread. Allocations deferred with mem_del_alloc_deferred are not
+ * released while a thread that might have seen them is still inside its
+ * critical section. Critical sections nest. The thread publishes the
+ * current epoch and does nothing else, so readers never contend.
+ */
+void mem_epoch_enter() {
+    if (thread_epoch_depth++ > 0){
+        return;
     }
+    if (thread_epoch_rec == NULL){
+        thread_epoch_rec = _mem_epoch_rec_acquire();
+    }
+    atomic_store(&thread_epoch_rec->epoch, atomic_load(&epoch_global));
+    atomic_thread_fence(memory_order_seq_cst);
 }
 
 /*
- * Function Name: _mem_resize_node_heap
- * Passed Variables: pool_mgr_pt pool_mgr
+ * Function Name: mem_epoch_exit
+ * Passed Variables: None
+ * Return Type: void
+ * Purpose: This function ends a read-side critical section of the calling
+ * thread started with mem_epoch_enter.
+ */
+void mem_epoch_exit() {
+    assert(thread_epoch_depth > 0);
+    if (--thread_epoch_depth > 0){
+        return;
+    }
+    atomic_store_explicit(&thread_epoch_rec->epoch, 0, memory_order_release);
+}
+
+/*
+ * Function Name: mem_del_alloc_deferred
+ * Passed Variables: pool_pt pool, alloc_pt alloc
  * Return Type: alloc_status
- * Purpose: This function works similarly to the function 
- * _mem_resize_pool_store. The ultimate difference comes from the fact
- * that the pool_store is not being resized but instead the node heap is being 
- * resized.
+ * Purpose: This function retires an allocation that readers may still be
+ * using. The allocation goes on the pool's limbo list, stamped with the
+ * current epoch. Once every thread that was inside a critical section at
+ * the time has left it, the allocation is passed to mem_del_alloc by
+ * whichever thread reclaims it, so it is traced and profiled there. The
+ * limbo list is reclaimed every MEM_EPOCH_BATCH retirements, by
+ * mem_pool_reclaim and by mem_pool_close. The allocation is not checked.
  */
+alloc_status mem_del_alloc_deferred(pool_pt pool, alloc_pt alloc) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || alloc == NULL || (manager->flags & MEM_POOL_FIXED)){
+        return ALLOC_FAIL;
+    }
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+    /* Pinned, the epoch cannot move on by two before the node is in limbo */
+    mem_epoch_enter();
+    node_pt node = (node_pt) alloc;
+    node->retire_epoch = atomic_load(&epoch_global);
+    node->remote_next = atomic_load_explicit(&manager->limbo, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&manager->limbo, &node->remote_next, node,
+                                                  memory_order_release, memory_order_relaxed)){
+    }
+    mem_epoch_exit();
 
-    /* Check to see if we have too many nodes */
-    if((*pool_mgr).used_nodes > (*pool_mgr).total_nodes * MEM_NODE_HEAP_FILL_FACTOR){
-        /* Create a new node_pt that is a reallocated node heap. */
-        /* We use the expand factor to increase the size. This is simply multiplying by 2. */
-        node_pt reallocated_node = (node_pt) realloc((*pool_mgr).node_heap, (*pool_mgr).total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR * sizeof(node_pt));
-        if(reallocated_node == NULL){
-            /* If the allocation failed then return ALLOC_FAIL. */
-            return ALLOC_FAIL;
-        }
-        else{
-            /* Set the node heap to the newly allocated 'reallocated_node' */
-            (*pool_mgr).node_heap = reallocated_node;
-            (*pool_mgr).total_nodes *= MEM_NODE_HEAP_EXPAND_FACTOR;
-            return ALLOC_OK;
-        }
+    if (atomic_fetch_add_explicit(&manager->limbo_count, 1, memory_order_relaxed) + 1 >= MEM_EPOCH_BATCH){
+        _mem_epoch_reclaim(manager, 0);
     }
-    /* If we are okay on nodes then return okay. */
-    else{
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_pool_reclaim
+ * Passed Variables: pool_pt pool
+ * Return Type: unsigned
+ * Purpose: This function tries to move the epoch on and returns the
+ * allocations on the pool's limbo list that no reader can be using any
+ * more to the pool. Returns the number of allocations returned. The
+ * calling thread must not be inside a critical section.
+ */
+unsigned mem_pool_reclaim(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL){
+        return 0;
+    }
+    return _mem_epoch_reclaim(manager, 0);
+}
+
+/*
+ * Function Name: mem_pool_coalesce
+ * Passed Variables: pool_pt pool
+ * Return Type: unsigned
+ * Purpose: This function merges the blocks parked by the deallocations of
+ * a POOL_LAZY_COALESCE pool, or of each of its shards, into the gaps
+ * around them, so that the pool has no two gaps side by side again.
+ * Returns the number of parked blocks merged.
+ */
+unsigned mem_pool_coalesce(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || (manager->flags & MEM_POOL_FIXED)){
+        return 0;
+    }
+    pool_mgr_pt single[1] = {manager};
+    pool_mgr_pt *parts = (manager->flags & MEM_POOL_SHARDED) ? manager->shards : single;
+    const unsigned num_parts = (manager->flags & MEM_POOL_SHARDED) ? manager->num_shards : 1;
+    unsigned merged = 0;
+    for (unsigned i = 0; i < num_parts; ++i){
+        _mem_pool_lock(parts[i]);
+        merged += _mem_coalesce(parts[i]);
+        _mem_pool_unlock(parts[i]);
+    }
+
+    return merged;
+}
+
+/*
+ * Function Name: mem_pin_alloc
+ * Passed Variables: pool_pt pool, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function pins an allocation so that mem_pool_compact does
+ * not move it, for as long as its memory is in use through alloc->mem.
+ * Pins nest. Returns ALLOC_FAIL if the allocation does not belong to the
+ * pool.
+ */
+alloc_status mem_pin_alloc(pool_pt pool, alloc_pt alloc) {
+    return _mem_pin(pool, alloc, 1);
+}
+
+/*
+ * Function Name: mem_unpin_alloc
+ * Passed Variables: pool_pt pool, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function undoes one mem_pin_alloc. Returns ALLOC_FAIL if
+ * the allocation does not belong to the pool or is not pinned.
+ */
+alloc_status mem_unpin_alloc(pool_pt pool, alloc_pt alloc) {
+    return _mem_pin(pool, alloc, -1);
+}
+
+/*
+ * Function Name: mem_pool_compact
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: This function defragments a pool. The allocations slide down
+ * to the start of the pool in address order, and their alloc->mem is
+ * rewritten to the new place, so all the free space ends up in one gap at
+ * the end. Pinned allocations, and allocations waiting for readers after
+ * mem_del_alloc_deferred, stay where they are, with a gap before them if
+ * there is room. The allocation handles stay valid, but any alloc->mem a
+ * thread kept of an unpinned allocation is stale afterwards. The shards of
+ * a sharded or partitioned pool are compacted one by one. Returns
+ * ALLOC_FAIL for a fixed-size pool.
+ */
+alloc_status mem_pool_compact(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || (manager->flags & MEM_POOL_FIXED)){
+        return ALLOC_FAIL;
+    }
+    if (manager->flags & MEM_POOL_SHARDED){
+        for (unsigned i = 0; i < manager->num_shards; ++i){
+            pool_mgr_pt shard = manager->shards[i];
+            _mem_pool_lock(shard);
+            _mem_compact(shard);
+            atomic_store_explicit(&shard->largest_gap, _mem_largest_gap(shard), memory_order_relaxed);
+            _mem_pool_unlock(shard);
+        }
         return ALLOC_OK;
     }
+    _mem_pool_lock(manager);
+    _mem_compact(manager);
+    _mem_pool_unlock(manager);
+
+    return ALLOC_OK;
 }
 
 /*
- * Function Name: _mem_resize_gap_ix
- * Passed Variables: pool_mgr_pt pool_mgr
+ * Function Name: mem_pool_compact_step
+ * Passed Variables: pool_pt pool, size_t budget, compact_progress_pt progress
  * Return Type: alloc_status
- * Purpose: This function works similarly to the function
- * _mem_resize_pool_store. The ultimate difference comes from the fact
- * that the pool_store is not being resized but instead the gap index
- * is being resized.
+ * Purpose: This function compacts a pool a bit at a time. Every call
+ * moves allocations down into the gap before them, one after the other,
+ * until at least budget bytes have been moved or the gaps have all been
+ * pushed to the end, and the next call carries on from there. So a step
+ * holds the pool lock for about the time it takes to copy budget bytes,
+ * and it can run from an idle loop or a background thread. Pinned
+ * allocations are skipped as in mem_pool_compact. If progress is not NULL,
+ * it is filled in with the bytes moved by the step and so far, and with
+ * the free space that is left and how fragmented it is. Once a pass is
+ * done, the next call starts over from the start of the pool. Returns
+ * ALLOC_FAIL for a fixed-size pool.
  */
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
+alloc_status mem_pool_compact_step(pool_pt pool, size_t budget, compact_progress_pt progress) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || (manager->flags & MEM_POOL_FIXED)){
+        return ALLOC_FAIL;
+    }
 
-    if((*pool_mgr).used_nodes > (*pool_mgr).total_nodes * MEM_NODE_HEAP_FILL_FACTOR){
-        /* Create a new node_pt that is a reallocated gap index. */
-        /* We use the expand factor to increase the size. This is simply multiplying by 2. */
-        gap_pt reallocated_gap = (gap_pt) realloc((*pool_mgr).gap_ix, (*pool_mgr).gap_ix_size * MEM_GAP_IX_EXPAND_FACTOR * sizeof(gap_pt));
-        if(reallocated_gap == NULL){
-            /* If the allocation failed then return ALLOC_FAIL. */
-            return ALLOC_FAIL;
+    compact_progress_t sum = {0, 0, 0, 0, 0, 1};
+    pool_mgr_pt single[1] = {manager};
+    pool_mgr_pt *parts = (manager->flags & MEM_POOL_SHARDED) ? manager->shards : single;
+    const unsigned num_parts = (manager->flags & MEM_POOL_SHARDED) ? manager->num_shards : 1;
+    for (unsigned i = 0; i < num_parts; ++i){
+        pool_mgr_pt part = parts[i];
+        _mem_pool_lock(part);
+        const size_t moved = (sum.step_bytes < budget) ? _mem_compact_step(part, budget - sum.step_bytes) : 0;
+        const size_t largest_gap = _mem_largest_gap(part);
+        atomic_store_explicit(&part->largest_gap, largest_gap, memory_order_relaxed);
+        sum.step_bytes += moved;
+        sum.total_bytes += part->compact_moved_bytes;
+        sum.free_bytes += part->pool.total_size - part->pool.alloc_size;
+        sum.num_gaps += part->pool.num_gaps;
+        if (largest_gap > sum.largest_gap){
+            sum.largest_gap = largest_gap;
         }
-        else{
-            /* Set the node heap to the newly allocated 'reallocated_gap' */
-            (*pool_mgr).gap_ix = reallocated_gap;
-            (*pool_mgr).gap_ix_capacity *= MEM_GAP_IX_EXPAND_FACTOR;
-            return ALLOC_OK;
+        if (part->compact_gap != NULL){
+            sum.done = 0;
         }
+        _mem_pool_unlock(part);
     }
-    /* If we are okay on gaps then return okay. */
-    else{
-        return ALLOC_OK;
+    if (progress != NULL){
+        *progress = sum;
     }
+
+    return ALLOC_OK;
 }
 
 /*
- * Function Name: _mem_add_to_gap_ix
- * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
+ * Function Name: mem_pool_start_maintenance
+ * Passed Variables: pool_pt pool, const maintenance_config_t *config
  * Return Type: alloc_status
- * Purpose: The purpose of this function is to add anew gap to the gap index.
- * This gap is a passed as a node from the node index. The first step of the 
- * function is to check to make sure that we have enough size in the gap index.
- * Once that is done we place the gap at the fiirst unused position of the 
- * gap index (gap_ix_capacity). Then any neccesary data members of the gap, node
- * and pool manager are set. The gap index is then sorted so the biggest gap is at
- * the top of the index.
+ * Purpose: This function starts a background thread that looks after a
+ * pool every config->interval_ms milliseconds, off the allocation path:
+ * it releases the deferred deallocations that readers are done with,
+ * merges the blocks parked by the deallocations of a POOL_LAZY_COALESCE
+ * pool, runs compaction steps of config->compact_budget bytes while the pool
+ * has more than config->max_gaps gaps or its largest gap is less than
+ * config->min_gap_ratio of its free space, and hands the whole pages in
+ * gaps of at least config->purge_min_bytes back to the kernel with
+ * madvise. A limit of 0 turns its task off. The pool must be POOL_LOCKED
+ * or sharded, since the thread works on it alongside the others. The
+ * thread stops when the pool is closed. Returns ALLOC_CALLED_AGAIN if the
+ * pool already has a thread.
+ * With a compact_budget the thread moves unpinned allocations at any
+ * time, so a thread that reads or writes alloc->mem while the pool is
+ * maintained must have the allocation pinned with mem_pin_alloc for as
+ * long as it does, and read alloc->mem again after unpinning it.
  */
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
-                                       size_t size,
-                                       node_pt node) {
-    /* Check to see if we need to resize */
-    if(pool_mgr->gap_ix_capacity != 0 || pool_mgr->gap_ix_capacity / pool_mgr->gap_ix_size > MEM_GAP_IX_FILL_FACTOR){
-        if(_mem_resize_gap_ix(pool_mgr) == ALLOC_FAIL){
-            return ALLOC_FAIL;
-        }
+alloc_status mem_pool_start_maintenance(pool_pt pool, const maintenance_config_t *config) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || config == NULL || config->interval_ms == 0 ||
+        !(manager->flags & (POOL_LOCKED | MEM_POOL_SHARDED))){
+        return ALLOC_FAIL;
     }
-    /* Set the nodes values */
-    (*node).allocated = 0;
-    (*node).used = 1;
-    /* Add the gap to the index and node heap */
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node = node;
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node->alloc_record.size = size;
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].size = size;
-    /*Increase the amount of gaps */
-    (*pool_mgr).gap_ix_capacity++;
-    (*pool_mgr).pool.num_gaps++;
-    /* Sort the index */
-    return _mem_sort_gap_ix(pool_mgr);
+    if (manager->maint != NULL){
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    maint_pt maint = calloc(1, sizeof(maint_t));
+    if (maint == NULL){
+        return ALLOC_FAIL;
+    }
+    maint->pool = manager;
+    maint->config = *config;
+    atomic_init(&maint->stop, 0);
+    pthread_mutex_init(&maint->mutex, NULL);
+    pthread_cond_init(&maint->cond, NULL);
+    if (pthread_create(&maint->thread, NULL, _mem_maint_thread, maint) != 0){
+        pthread_cond_destroy(&maint->cond);
+        pthread_mutex_destroy(&maint->mutex);
+        free(maint);
+        return ALLOC_FAIL;
+    }
+    manager->maint = maint;
 
+    return ALLOC_OK;
 }
 
 /*
- * Function Name: _mem_remove_from_gap_ix
- * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
+ * Function Name: mem_pool_stop_maintenance
+ * Passed Variables: pool_pt pool
  * Return Type: alloc_status
- * Purpose: This function removes a gap from the index, which is done
- * when a node needs to have memory allocated. To find the gap that we
- * are attempting to remove we use a node pointer and compare it to the
- * node thta the gap is pointing to. Once this gap is found, we swap it 
- * with the gap at the bottom of the index, overwrite it's data and then
- * resort the gap; ending with the gap capacity being decremented.
+ * Purpose: This function stops the background thread of a pool and waits
+ * for it to finish the task it is on. Returns ALLOC_FAIL if the pool has
+ * no thread.
  */
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
-                                            size_t size,
-                                            node_pt node) {
-    int gap_Location = -1;
-    /* Loop throught the gap index until we find the gap that is that node. */
-    for(unsigned i = 0; i< pool_mgr->gap_ix_capacity; ++i){
-        /*Once the node is found set the index number to Gap location and break. */
-        if(pool_mgr->gap_ix[i].node == node){
-            gap_Location = i;
-            break;
-        }
+alloc_status mem_pool_stop_maintenance(pool_pt pool) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || manager->maint == NULL){
+        return ALLOC_FAIL;
     }
-    /* If the node wasn't found return ALLOC_FAIL */
-    if(gap_Location == -1){
+    _mem_maint_stop(manager);
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_pool_maintenance_stats
+ * Passed Variables: pool_pt pool, maintenance_stats_pt stats
+ * Return Type: alloc_status
+ * Purpose: This function copies out what the background thread of a pool
+ * has done so far. Returns ALLOC_FAIL if the pool has no thread.
+ */
+alloc_status mem_pool_maintenance_stats(pool_pt pool, maintenance_stats_pt stats) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || manager->maint == NULL || stats == NULL){
         return ALLOC_FAIL;
     }
-    /* Swap the node to be removed with the last filled gap in the index */
-    pool_mgr->gap_ix[gap_Location] = pool_mgr->gap_ix[pool_mgr->gap_ix_capacity -1];
-    /* Delete the node that is now in the last spot of the "filled index. */
-    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].node = NULL;
-    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].size = 0;
-    /* Decrement the amount of used gaps */
-    --pool_mgr->gap_ix_capacity;
-    --pool_mgr->pool.num_gaps;
+    pthread_mutex_lock(&manager->maint->mutex);
+    *stats = manager->maint->stats;
+    pthread_mutex_unlock(&manager->maint->mutex);
 
-    return _mem_sort_gap_ix(pool_mgr);
+    return ALLOC_OK;
 }
 
 /*
- * Function Name: _mem_sort_gap_ix
- * Passed Variables: pool_mgr_pt pool_mgr
+ * Function Name: mem_pool_stats
+ * Passed Variables: pool_pt pool, pool_stats_pt stats
  * Return Type: alloc_status
- * Purpose: This function performs a bubble sort on the gap index
- * sorting the index based on each gap's size. If the amount of gaps is
- * smaller than 2 then there is no need to sort the memory and just returns
- * ALLOC_OK.
- */
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
-    /* This is just a bubble sort that sorts the gaps based on their size. */
-    if(((*pool_mgr).gap_ix_capacity <=1)){
-        return ALLOC_OK;
+ * Purpose: This function fills in the capacity and fragmentation figures
+ * of a pool without walking its segments: they are kept up to date by
+ * every allocation and deallocation, so the cost does not grow with the
+ * pool. The sizes of all the gaps are counted in gap_histogram by power of
+ * two. Blocks parked by a POOL_LAZY_COALESCE pool count as gaps; blocks in
+ * the threads' caches, on the remote free queue or waiting for readers
+ * still count as allocated. The metadata is what the pool has allocated
+ * besides its memory: the manager, node heap and gap index, with their
+ * spare capacity. A sharded pool sums up its shards. Returns ALLOC_FAIL
+ * for a fixed-size pool.
+ */
+alloc_status mem_pool_stats(pool_pt pool, pool_stats_pt stats) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    if (manager == NULL || stats == NULL || (manager->flags & MEM_POOL_FIXED)){
+        return ALLOC_FAIL;
     }
-    for(unsigned int i =0; i < (*pool_mgr).gap_ix_capacity-1; ++i){
-        for(unsigned int j = 1; j < (*pool_mgr).gap_ix_capacity-2;++j){
-            /* If the sizes are unordered. */
-            if((*pool_mgr).gap_ix[j].size < (*pool_mgr).gap_ix[j+1].size){
-                /* Swap them :D */
-                gap_t swapper = (*pool_mgr).gap_ix[j];
-                (*pool_mgr).gap_ix[j] = (*pool_mgr).gap_ix[i];
-                (*pool_mgr).gap_ix[i] = swapper;
-            }
-            if(pool_mgr->gap_ix[i].size == pool_mgr->gap_ix[j].size){
-                if(pool_mgr->gap_ix[i].node < pool_mgr->gap_ix[j].node){
-                    gap_t swapper = (*pool_mgr).gap_ix[j];
-                    (*pool_mgr).gap_ix[j] = (*pool_mgr).gap_ix[i];
-                    (*pool_mgr).gap_ix[i] = swapper;
-                }
-            }
+
+    memset(stats, 0, sizeof(pool_stats_t));
+    pool_mgr_pt single[1] = {manager};
+    pool_mgr_pt *parts = (manager->flags & MEM_POOL_SHARDED) ? manager->shards : single;
+    const unsigned num_parts = (manager->flags & MEM_POOL_SHARDED) ? manager->num_shards : 1;
+    for (unsigned i = 0; i < num_parts; ++i){
+        pool_mgr_pt part = parts[i];
+        _mem_pool_lock(part);
+        const size_t largest_gap = _mem_largest_gap(part);
+        stats->total_size += part->pool.total_size;
+        stats->alloc_size += part->pool.alloc_size;
+        stats->num_allocs += part->pool.num_allocs;
+        stats->num_gaps += part->pool.num_gaps;
+        stats->metadata_bytes += sizeof(pool_mgr_t) + part->total_nodes * sizeof(node_t) +
+                                 part->gap_ix_size * sizeof(gap_t);
+        if ((part->flags & MEM_POOL_INLINE) && part->gap_ix != _mem_inline_gap_ix(part)){
+            // the gap index has outgrown its place behind the manager, which stays
+            stats->metadata_bytes += MEM_GAP_IX_INIT_CAPACITY * sizeof(gap_t);
         }
+        if (largest_gap > stats->largest_gap){
+            stats->largest_gap = largest_gap;
+        }
+        for (unsigned b = 0; b < POOL_STATS_NUM_BUCKETS; ++b){
+            stats->gap_histogram[b] += part->gap_hist[b];
+        }
+        _mem_pool_unlock(part);
+    }
+    if (manager->flags & MEM_POOL_SHARDED){
+        stats->metadata_bytes += sizeof(pool_mgr_t) + num_parts * sizeof(pool_mgr_pt);
+    }
+    stats->free_bytes = stats->total_size - stats->alloc_size;
+    if (stats->free_bytes > 0){
+        stats->fragmentation = 1.0 - (double) stats->largest_gap / stats->free_bytes;
     }
 
     return ALLOC_OK;
 }
 
+/*
+ * Function Name: mem_profile_enable
+ * Passed Variables: int enable
+ * Return Type: void
+ * Purpose: This function turns profiling of all pools on or off. While it
+ * is on, every thread counts its calls of mem_new_alloc, mem_del_alloc and
+ * mem_pool_open with their latency, and what the allocator did for them:
+ * the gaps or segments searched, splits, merges and metadata resizes.
+ * While it is off, each of those costs one load of the switch.
+ */
+void mem_profile_enable(int enable) {
+    atomic_store_explicit(&profile_enabled, enable != 0, memory_order_relaxed);
+}
+
+/*
+ * Function Name: mem_profile_read
+ * Passed Variables: mem_profile_pt profile
+ * Return Type: void
+ * Purpose: This function sums up the profiling counters of all the
+ * threads, exited ones included, since the last mem_profile_reset. Counts
+ * being made meanwhile may or may not be in.
+ */
+void mem_profile_read(mem_profile_pt profile) {
+    mem_profile_t sum;
+    pthread_mutex_lock(&profile_mutex);
+    _mem_profile_sum(&sum);
+    /* the profile is nothing but unsigned longs */
+    const unsigned long *base = (const unsigned long *) &profile_base;
+    unsigned long *out = (unsigned long *) &sum;
+    for (size_t i = 0; i < sizeof(mem_profile_t) / sizeof(unsigned long); ++i){
+        out[i] -= base[i];
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    *profile = sum;
+}
+
+/*
+ * Function Name: mem_profile_reset
+ * Passed Variables: None
+ * Return Type: void
+ * Purpose: This function starts the profiling counters over from zero.
+ * The threads' counters are left alone, as only their threads write them;
+ * their current sums are remembered and taken off later reads instead.
+ */
+void mem_profile_reset() {
+    pthread_mutex_lock(&profile_mutex);
+    _mem_profile_sum(&profile_base);
+    pthread_mutex_unlock(&profile_mutex);
+}
 
+/*
+ * Function Name: mem_inspect_pool
+ * Passed Variables: pool_pt pool, pool_segment_pt *segments, unsigned *num_segments
+ * Return Type: void
+ * Purpose: This function is called within main so the contents of the pool
+ * may be displayed in the console. Segments and num_segments are used in
+ * main and are passed back by reference. Segments is an array of all used
+ * nodes, while num_segments is the amount of used nodes. For a fixed-size
+ * pool there is a segment per block, and the pool's counters are brought
+ * up to date; no thread may allocate from the pool meanwhile. A sharded
+ * pool lists the segments of its shards in address order and sums their
+ * counters into its own. Called by the owner of a POOL_REMOTE_FREE pool,
+ * the remote free queue is taken back first.
+ */
+void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments) {
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr->flags & MEM_POOL_FIXED){
+        // one segment per block
+        char *is_free = calloc(pool_mgr->fixed_num_blocks, 1);
+        pool_segment_pt segs = (pool_segment_pt) calloc(pool_mgr->fixed_num_blocks, sizeof(pool_segment_t));
+        assert(is_free && segs);
+        const unsigned free_blocks = _mem_fixed_free_blocks(pool_mgr, is_free);
+        for (unsigned i = 0; i < pool_mgr->fixed_num_blocks; ++i){
+            segs[i].size = pool_mgr->fixed_block_size;
+            segs[i].allocated = !is_free[i];
+        }
+        free(is_free);
+        pool_mgr->pool.num_allocs = pool_mgr->fixed_num_blocks - free_blocks;
+        pool_mgr->pool.alloc_size = pool_mgr->pool.num_allocs * pool_mgr->fixed_block_size;
+        pool_mgr->pool.num_gaps = free_blocks;
+        *segments = segs;
+        *num_segments = pool_mgr->fixed_num_blocks;
+        return;
+    }
+    if (pool_mgr->flags & MEM_POOL_SHARDED){
+        // the shards' segments one after the other
+        pool_segment_pt segs = NULL;
+        unsigned num_segs = 0;
+        pool_mgr->pool.alloc_size = 0;
+        pool_mgr->pool.num_allocs = 0;
+        pool_mgr->pool.num_gaps = 0;
+        for (unsigned i = 0; i < pool_mgr->num_shards; ++i){
+            pool_mgr_pt shard = pool_mgr->shards[i];
+            pool_segment_pt shard_segs;
+            unsigned num_shard_segs;
+            mem_inspect_pool((pool_pt) shard, &shard_segs, &num_shard_segs);
+            segs = realloc(segs, (num_segs + num_shard_segs) * sizeof(pool_segment_t));
+            assert(segs);
+            memcpy(segs + num_segs, shard_segs, num_shard_segs * sizeof(pool_segment_t));
+            num_segs += num_shard_segs;
+            free(shard_segs);
+            _mem_pool_lock(shard);
+            pool_mgr->pool.alloc_size += shard->pool.alloc_size;
+            pool_mgr->pool.num_allocs += shard->pool.num_allocs;
+            pool_mgr->pool.num_gaps += shard->pool.num_gaps;
+            _mem_pool_unlock(shard);
+        }
+        *segments = segs;
+        *num_segments = num_segs;
+        return;
+    }
+    _mem_pool_lock(pool_mgr);
+    if (pthread_equal(pool_mgr->owner, pthread_self())){
+        _mem_drain_remote_frees(pool_mgr);
+    }
+    // allocate the segments array with size == used_nodes
+    pool_segment_pt segs = (pool_segment_pt) calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+
+    // check successful
+    assert(segs);
+    node_pt current = pool_mgr->node_list;
+
+    // loop through the node heap and the segments array
+    for(int i = 0; i < pool_mgr->used_nodes; ++i){
+        //    for each node, write the size and allocated in the segment
+        segs[i].size = current->alloc_record.size;
+        segs[i].allocated = current->allocated;
+        if(current->next != NULL) {
+            current = current->next;
+        }
+    }
+
+    // "return" the values:
+    *segments = segs;
+    *num_segments = pool_mgr->used_nodes;
+    _mem_pool_unlock(pool_mgr);
+    /*pass these values back */
+
+    return;
+
+}
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _mem_dispatch_alloc
+ * Passed Variables: pool_mgr_pt manager, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function does the work of mem_new_alloc, handing the
+ * allocation to the code for the kind of pool.
+ */
+static alloc_pt _mem_dispatch_alloc(pool_mgr_pt manager, size_t size) {
+    if (manager->flags & MEM_POOL_FIXED){
+        return NULL;
+    }
+    if (manager->flags & MEM_POOL_PARTITIONED){
+        return _mem_region_alloc(manager, size);
+    }
+    if (manager->flags & MEM_POOL_SHARDED){
+        return _mem_shard_alloc(manager, size);
+    }
+    if ((manager->flags & POOL_REMOTE_FREE) && atomic_load_explicit(&manager->remote_frees, memory_order_relaxed) != NULL &&
+        pthread_equal(manager->owner, pthread_self())){
+        _mem_pool_lock(manager);
+        _mem_drain_remote_frees(manager);
+        _mem_pool_unlock(manager);
+    }
+    if (manager->flags & POOL_THREAD_CACHE){
+        return _mem_tcache_alloc(manager, size);
+    }
+    _mem_pool_lock(manager);
+    alloc_pt alloc = _mem_new_alloc(manager, size);
+    _mem_pool_unlock(manager);
+
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_dispatch_free
+ * Passed Variables: pool_mgr_pt mgr, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function does the work of mem_del_alloc, handing the
+ * deallocation to the code for the kind of pool.
+ */
+static alloc_status _mem_dispatch_free(pool_mgr_pt mgr, alloc_pt alloc) {
+    if (mgr->flags & MEM_POOL_FIXED){
+        return ALLOC_FAIL;
+    }
+    if (mgr->flags & MEM_POOL_SHARDED){
+        pool_mgr_pt shard = (alloc == NULL) ? NULL : _mem_shard_of(mgr, alloc->mem);
+        if (shard == NULL){
+            return ALLOC_FAIL;
+        }
+        return (mgr->flags & MEM_POOL_PARTITIONED) ? _mem_region_free(shard, alloc) :
+                                                     _mem_dispatch_free(shard, alloc);
+    }
+    if ((mgr->flags & POOL_REMOTE_FREE) && !pthread_equal(mgr->owner, pthread_self())){
+        if (alloc == NULL){
+            return ALLOC_FAIL;
+        }
+        node_pt node = (node_pt) alloc;
+        node->remote_next = atomic_load_explicit(&mgr->remote_frees, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&mgr->remote_frees, &node->remote_next, node,
+                                                      memory_order_release, memory_order_relaxed)){
+        }
+        return ALLOC_OK;
+    }
+    if (mgr->flags & POOL_THREAD_CACHE){
+        return _mem_tcache_free(mgr, alloc);
+    }
+    _mem_pool_lock(mgr);
+    alloc_status status = _mem_del_alloc(mgr, alloc);
+    _mem_pool_unlock(mgr);
+
+    return status;
+}
+
+/*
+ * Function Name: _mem_new_alloc
+ * Passed Variables: pool_mgr_pt manager, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function does the work of mem_new_alloc with the pool
+ * lock (if any) held. First fit takes the lowest gap in the pool that is
+ * large enough, best fit the smallest such gap, the lowest one on ties.
+ * A POOL_LAZY_COALESCE pool first reuses a parked block of exactly the
+ * size, wherever it is, and merges its parked blocks into the gaps before
+ * giving up on an allocation.
+ */
+static alloc_pt _mem_new_alloc(pool_mgr_pt manager, size_t size) {
+
+    size_t remainSpace = 0;
+    if (manager->num_parked > 0){
+        node_pt *link = &manager->quick_bins[_mem_quick_bin(size)];
+        while (*link != NULL && (*link)->alloc_record.size != size){
+            link = &(*link)->remote_next;
+        }
+        if (*link != NULL){
+            node_pt node = *link;
+            *link = node->remote_next;
+            node->remote_next = NULL;
+            node->parked = 0;
+            node->allocated = 1;
+            manager->num_parked--;
+            manager->pool.num_gaps--;
+            _mem_stats_remove_gap(manager, size);
+            _mem_profile_count(PROFILE_QUICK_HITS, 1);
+            manager->pool.num_allocs++;
+            manager->pool.alloc_size += size;
+            manager->changes++;
+            return (alloc_pt) node;
+        }
+        if (manager->gap_ix_capacity == 0){
+            _mem_coalesce(manager);
+        }
+    }
+    /* If there are no gaps or the node heap cannot grow then the allocation fails */
+    if((*manager).gap_ix_capacity == 0 || _mem_resize_node_heap(manager) == ALLOC_FAIL){
+        return NULL;
+    }
+    node_pt newNode = NULL;
+    unsigned long steps = 0;
+    if(manager->pool.policy == BEST_FIT) {
+        steps = (*manager).gap_ix_capacity;
+        for (unsigned i = 0; i < (*manager).gap_ix_capacity; ++i) {
+            const gap_pt gap = &(*manager).gap_ix[i];
+            /*Loop throught the array until we find a gap that is a better fit than the current one*/
+            if (gap->size < size) {
+                continue;
+            }
+            if (newNode == NULL || gap->size < newNode->alloc_record.size ||
+                (gap->size == newNode->alloc_record.size &&
+                 gap->node->alloc_record.mem < newNode->alloc_record.mem)) {
+                newNode = gap->node;
+            }
+        }
+    }
+
+
+    /* First Fit allocation */
+    if(manager->pool.policy == FIRST_FIT){
+        /* Walk the segments in address order and take the first gap that fits */
+        for (node_pt node = (*manager).node_list; node != NULL; node = node->next){
+            ++steps;
+            if(node->allocated == 0 && !node->parked && node->alloc_record.size >= size){
+                newNode = node;
+                break;
+            }
+        }
+    }
+    _mem_profile_count(PROFILE_SEARCHES, 1);
+    _mem_profile_count(PROFILE_SEARCH_STEPS, steps);
+    /* if the node couldn't be allocated return null, unless merging the parked blocks helps */
+    if(newNode == NULL){
+        if (manager->num_parked > 0){
+            _mem_coalesce(manager);
+            return _mem_new_alloc(manager, size);
+        }
+        return NULL;
+    }
+    //Calculate the remaining gap space
+    remainSpace = newNode->alloc_record.size - size;
+    /* Get the node for the leftover gap before anything is changed */
+    node_pt gap_Node = NULL; // Create a new node to hold the node that's going to become the gap.
+    if(remainSpace != 0) {
+        gap_Node = _mem_get_unused_node(manager);
+        if (gap_Node == NULL){
+            return NULL;
+        }
+    }
+    /* remove the node from the gap index */
+    if(_mem_remove_from_gap_ix(manager,size,newNode) != ALLOC_OK){
+        if (gap_Node != NULL){
+            _mem_release_node(manager, gap_Node);
+        }
+        return NULL;
+    }
+    manager->pool.num_allocs++;//Change the amount of allocations to the pool
+    manager->pool.alloc_size += size;
+    /* Alter the nodes values */
+    newNode->used = 1;
+    newNode->allocated = 1;
+    newNode->alloc_record.size = size;
+    if(remainSpace != 0) {
+        _mem_profile_count(PROFILE_SPLITS, 1);
+        /* the leftover gap starts right after the new allocation */
+        gap_Node->alloc_record.mem = newNode->alloc_record.mem + size;
+        /* add this node to the gap index with the leftover size from the alloc. */
+        if (_mem_add_to_gap_ix(manager, remainSpace, gap_Node) == ALLOC_FAIL) {
+            exit(0);
+        }
+        /* Increase the used nodes and have the nodes start to point to one another */
+        manager->used_nodes++;
+        if (newNode->next != NULL) {
+            node_pt next = newNode->next;
+            gap_Node->next = next;
+            next->prev = gap_Node;
+        }
+        else {
+            gap_Node->next = NULL;
+        }
+
+        newNode->next = gap_Node;
+        gap_Node->prev = newNode;
+    }
+    newNode->allocated = 1;
+    manager->changes++;
+
+    return (alloc_pt) newNode;
+}
+
+/*
+ * Function Name: _mem_del_alloc
+ * Passed Variables: pool_mgr_pt mgr, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function does the work of mem_del_alloc with the pool
+ * lock (if any) held. A POOL_LAZY_COALESCE pool parks the block on the
+ * quick list of its size, as a gap of its own, and merges the parked
+ * blocks only once MEM_QUICK_MAX_PARKED of them have piled up.
+ */
+static alloc_status _mem_del_alloc(pool_mgr_pt mgr, alloc_pt alloc) {
+
+    // find the node in the node heap
+    node_pt del_node = _mem_find_node(mgr, alloc, NULL);
+    // this is node-to-delete
+    // make sure it's found
+    if(del_node == NULL || del_node->used == 0 || del_node->allocated == 0){
+        return ALLOC_FAIL;
+    }
+
+    // convert to gap node
+    del_node->allocated = 0;
+    mgr->changes++;
+    del_node->pinned = 0;
+    del_node->retire_epoch = 0;
+
+    // update metadata (num_allocs, alloc_size)
+    mgr->pool.num_allocs--;
+    mgr->pool.alloc_size -= del_node->alloc_record.size;
+
+    if (mgr->flags & POOL_LAZY_COALESCE){
+        node_pt *bin = &mgr->quick_bins[_mem_quick_bin(del_node->alloc_record.size)];
+        del_node->parked = 1;
+        del_node->remote_next = *bin;
+        *bin = del_node;
+        mgr->num_parked++;
+        mgr->pool.num_gaps++;
+        _mem_stats_add_gap(mgr, del_node->alloc_record.size);
+        if (mgr->num_parked >= MEM_QUICK_MAX_PARKED){
+            _mem_coalesce(mgr);
+        }
+        return ALLOC_OK;
+    }
+
+    // if the next node in the list is also a gap, merge into node-to-delete
+    if(del_node->next != NULL && del_node->next->allocated == 0) {
+        node_pt next = del_node->next;
+        //   remove the next node from gap index
+        if(_mem_remove_from_gap_ix(mgr, 0, next) == ALLOC_FAIL)
+            return ALLOC_FAIL;
+
+        //   add the size to the node-to-delete
+        del_node->alloc_record.size += next->alloc_record.size;
+        _mem_profile_count(PROFILE_MERGES, 1);
+        //   update metadata (used nodes)
+        mgr->used_nodes--;
+        //   update linked list:
+        if (next->next) {
+            next->next->prev = del_node;
+            del_node->next = next->next;
+        } else {
+            del_node->next = NULL;
+        }
+        //   update node as unused
+        _mem_release_node(mgr, next);
+    }
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    if(del_node->prev!= NULL && del_node->prev->allocated == 0) {
+        //   remove the previous node from gap index
+        node_pt previous = del_node->prev;
+        if(_mem_remove_from_gap_ix(mgr, 0, previous) == ALLOC_FAIL)
+            return ALLOC_FAIL;
+
+        //   add the size of node-to-delete to the previous
+        previous->alloc_record.size += del_node->alloc_record.size;
+        _mem_profile_count(PROFILE_MERGES, 1);
+        //   update metadata (used_nodes)
+        mgr->used_nodes--;
+        //   update linked list
+        if (del_node->next) {
+            previous->next = del_node->next;
+            del_node->next->prev = previous;
+        } else {
+            previous->next = NULL;
+        }
+        //   update node-to-delete as unused
+        _mem_release_node(mgr, del_node);
+
+        //   change the node to add to the previous node!
+        del_node = previous;
+    }
+    // add the resulting node to the gap index
+    // check success
+    if(_mem_add_to_gap_ix(mgr, del_node->alloc_record.size,del_node ) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_pool_store_slot
+ * Passed Variables: unsigned slot, int create
+ * Return Type: pool_slot_pt
+ * Purpose: This function finds a slot of the pool store. If the segment
+ * holding the slot does not exist yet and create is set, the segment is
+ * allocated and published with a compare-and-swap; a thread that loses
+ * the race frees its copy. Returns NULL if the slot does not exist.
+ */
+static pool_slot_pt _mem_pool_store_slot(unsigned slot, int create) {
+    size_t segment_size = MEM_POOL_STORE_INIT_CAPACITY;
+    for (unsigned s = 0; s < MEM_POOL_STORE_MAX_SEGMENTS; ++s){
+        if (slot < segment_size){
+            pool_slot_pt segment = atomic_load(&pool_store[s]);
+            if (segment == NULL && create){
+                pool_slot_pt fresh = calloc(segment_size, sizeof(pool_slot_t));
+                if (fresh == NULL){
+                    return NULL;
+                }
+                if (atomic_compare_exchange_strong(&pool_store[s], &segment, fresh)){
+                    segment = fresh;
+                } else {
+                    free(fresh);
+                }
+            }
+            return (segment == NULL) ? NULL : &segment[slot];
+        }
+        slot -= segment_size;
+        segment_size *= MEM_POOL_STORE_EXPAND_FACTOR;
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_add_to_pool_store
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: alloc_status
+ * Purpose: This function places a pool manager in a slot of the pool
+ * store, initializing the store first if needed. Slots of closed pools
+ * are reused first. They are kept on a stack whose head carries a tag
+ * that changes on every pop, so a pop cannot succeed on a head that was
+ * popped and pushed back in the meantime. Otherwise a new slot is claimed
+ * with an atomic increment. No lock is taken.
+ */
+static alloc_status _mem_add_to_pool_store(pool_mgr_pt pool_mgr) {
+    // If the pool store hasn't been initialized then initialize it.
+    if (!atomic_load(&pool_store_ready)){
+        mem_init();
+    }
+
+    unsigned index = 0;
+    pool_slot_pt slot = NULL;
+    uint64_t head = atomic_load(&pool_store_free);
+    while ((uint32_t) head != 0){
+        index = (uint32_t) head - 1;
+        slot = _mem_pool_store_slot(index, 0);
+        const uint64_t next = (((head >> 32) + 1) << 32) | atomic_load(&slot->next_free);
+        if (atomic_compare_exchange_weak(&pool_store_free, &head, next)){
+            break;
+        }
+        slot = NULL;
+    }
+    if (slot == NULL){
+        index = atomic_fetch_add(&pool_store_size, 1);
+        slot = _mem_pool_store_slot(index, 1);
+        if (slot == NULL){
+            return ALLOC_FAIL;
+        }
+    }
+    pool_mgr->store_slot = index;
+    atomic_store(&slot->pool, pool_mgr);
+    atomic_fetch_add(&pool_store_capacity, 1);
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_remove_from_pool_store
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function takes a pool manager out of the pool store and
+ * pushes its slot on the free slot stack for reuse.
+ */
+static void _mem_remove_from_pool_store(pool_mgr_pt pool_mgr) {
+    pool_slot_pt slot = _mem_pool_store_slot(pool_mgr->store_slot, 0);
+    if (slot == NULL || atomic_load(&slot->pool) != pool_mgr){
+        return;
+    }
+    atomic_store(&slot->pool, NULL);
+    atomic_fetch_sub(&pool_store_capacity, 1);
+
+    uint64_t head = atomic_load(&pool_store_free);
+    uint64_t next;
+    do {
+        atomic_store(&slot->next_free, (uint32_t) head);
+        next = (head & 0xffffffff00000000ull) | (pool_mgr->store_slot + 1);
+    } while (!atomic_compare_exchange_weak(&pool_store_free, &head, next));
+}
+
+/*
+ * Function Name: _mem_destroy_pool
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function frees a pool manager and everything it owns,
+ * including the shards of a sharded pool. The parts of the node heap and
+ * gap index that share the manager's allocation go with it.
+ */
+static void _mem_destroy_pool(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->maint != NULL){
+        _mem_maint_stop(pool_mgr);
+    }
+    if (pool_mgr->flags & POOL_THREAD_CACHE){
+        _mem_tcache_drain(pool_mgr, 0);
+    }
+    for (unsigned i = 0; i < pool_mgr->num_shards; ++i){
+        _mem_destroy_pool(pool_mgr->shards[i]);
+    }
+    free(pool_mgr->shards);
+    // a shard's memory belongs to its sharded pool
+    if (pool_mgr->pool.mem != NULL && !(pool_mgr->flags & MEM_POOL_SHARD)){
+        _mem_unmap_pool_mem(pool_mgr);
+    }
+    for (unsigned c = (pool_mgr->flags & MEM_POOL_INLINE) ? 1 : 0; c < pool_mgr->num_node_chunks; ++c){
+        free(pool_mgr->node_chunks[c]);
+    }
+    if (pool_mgr->gap_ix != _mem_inline_gap_ix(pool_mgr)){
+        free(pool_mgr->gap_ix);
+    }
+    free(pool_mgr);
+}
+
+/*
+ * Function Name: _mem_new_pool_mgr
+ * Passed Variables: none
+ * Return Type: pool_mgr_pt
+ * Purpose: This function allocates a zeroed pool manager for a pool with
+ * a node heap and gap index. The first chunk of the node heap and the
+ * initial gap index come in the same allocation, right after the manager,
+ * so opening a pool takes one allocation for its metadata instead of
+ * three. The manager is MEM_POOL_INLINE until it is given its other
+ * flags. Returns NULL if out of memory.
+ */
+static pool_mgr_pt _mem_new_pool_mgr() {
+    pool_mgr_pt manager = calloc(1, sizeof(pool_mgr_t) + MEM_NODE_HEAP_INIT_CAPACITY * sizeof(node_t) +
+                                    MEM_GAP_IX_INIT_CAPACITY * sizeof(gap_t));
+    if (manager != NULL){
+        manager->flags = MEM_POOL_INLINE;
+        manager->node_heap = (node_pt) (manager + 1);
+        manager->gap_ix = (gap_pt) (manager->node_heap + MEM_NODE_HEAP_INIT_CAPACITY);
+    }
+    return manager;
+}
+
+/*
+ * Function Name: _mem_inline_gap_ix
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: gap_pt
+ * Purpose: This function returns where the initial gap index of a
+ * MEM_POOL_INLINE manager is, or NULL for any other manager. The gap
+ * index is only there until it first grows.
+ */
+static gap_pt _mem_inline_gap_ix(pool_mgr_pt pool_mgr) {
+    if (!(pool_mgr->flags & MEM_POOL_INLINE)){
+        return NULL;
+    }
+    return (gap_pt) (pool_mgr->node_chunks[0] + MEM_NODE_HEAP_INIT_CAPACITY);
+}
+
+/*
+ * Function Name: _mem_init_pool_mgr
+ * Passed Variables: pool_mgr_pt manager
+ * Return Type: alloc_status
+ * Purpose: This function sets up the node heap and gap index of a pool
+ * manager from _mem_new_pool_mgr whose memory is in place, with the
+ * whole pool as one gap.
+ */
+static alloc_status _mem_init_pool_mgr(pool_mgr_pt manager) {
+
+	//Initialize all gap and node members.
+	(*manager).node_chunks[0] = (*manager).node_heap;
+	(*manager).num_node_chunks = 1;
+	(*manager).total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+	(*manager).used_nodes = 1;
+	//Every node but the first starts out unused, and zeroed: they are
+	//handed out in order when needed, so opening a pool does not touch them
+	(*manager).fresh_nodes = MEM_NODE_HEAP_INIT_CAPACITY - 1;
+    //call add to gap ix here once written for a gap the size of the pool
+    (*manager).gap_ix_size = MEM_GAP_IX_INIT_CAPACITY;
+    (*manager).node_heap[0].alloc_record.size = (*manager).pool.total_size;
+    (*manager).node_heap[0].alloc_record.mem = (*manager).pool.mem;
+    (*manager).node_heap[0].allocated = 0;
+    (*manager).node_heap[0].used = 1;
+    (*manager).node_heap[0].prev = NULL;
+    (*manager).node_heap[0].next = NULL;
+    (*manager).node_list = &(*manager).node_heap[0];
+    if(_mem_add_to_gap_ix(manager, (*manager).pool.total_size, &(*manager).node_heap[0]) == ALLOC_FAIL){
+        printf("Failed to add first node to gap index.");
+        exit(0);
+    }
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_open_pool
+ * Passed Variables: size_t size, alloc_policy policy, unsigned flags
+ * Return Type: pool_pt
+ * Purpose: This function does the work of mem_pool_open_ex.
+ */
+static pool_pt _mem_open_pool(size_t size, alloc_policy policy, unsigned flags) {
+
+    pool_mgr_pt manager = _mem_new_pool_mgr();//Create a new pool.
+    if (manager == NULL){
+        return NULL;
+    }
+	//Set pools values
+	(*manager).pool.policy = policy;
+	(*manager).pool.total_size = size;
+	(*manager).flags |= flags;
+	if (flags & POOL_THREAD_CACHE){
+		(*manager).flags |= POOL_LOCKED;
+	}
+    atomic_init(&(*manager).lock, 0);
+    (*manager).owner = pthread_self();
+    atomic_init(&(*manager).remote_frees, NULL);
+
+	if (_mem_map_pool_mem(manager, size) != ALLOC_OK){
+		free(manager);//delete the allocation of the pool store.
+		return NULL;
+	}
+	if (_mem_init_pool_mgr(manager) != ALLOC_OK){
+		_mem_unmap_pool_mem(manager);
+		free(manager);
+		return NULL;
+	}
+
+    //Place the new pool in the pool store
+    if (_mem_add_to_pool_store(manager) != ALLOC_OK){
+        _mem_destroy_pool(manager);
+        return NULL;
+    }
+
+    return (pool_pt) manager;
+}
+
+/*
+ * Function Name: _mem_open_shards
+ * Passed Variables: size_t size, alloc_policy policy, unsigned num_shards, unsigned shard_flags, unsigned flags
+ * Return Type: pool_mgr_pt
+ * Purpose: This function creates a pool with the passed flags whose
+ * memory is split into num_shards sub-pools with the passed flags, in
+ * address order, and puts it in the pool store. Shards are whole words,
+ * so a pool with less than a word per shard is not opened. Returns NULL
+ * on failure.
+ */
+static pool_mgr_pt _mem_open_shards(size_t size, alloc_policy policy, unsigned num_shards,
+                                    unsigned shard_flags, unsigned flags) {
+    if (size / num_shards < sizeof(uint64_t)){
+        return NULL;
+    }
+
+    pool_mgr_pt manager = calloc(1, sizeof(pool_mgr_t));
+    if (manager == NULL){
+        return NULL;
+    }
+    manager->pool.policy = policy;
+    manager->pool.total_size = size;
+    manager->pool.num_gaps = num_shards;
+    manager->flags = flags;
+    atomic_init(&manager->lock, 0);
+    manager->shard_size = (size / num_shards) & ~(sizeof(uint64_t) - 1);
+    manager->shards = calloc(num_shards, sizeof(pool_mgr_pt));
+    if (manager->shards == NULL || _mem_map_pool_mem(manager, size) != ALLOC_OK){
+        free(manager->shards);
+        free(manager);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < num_shards; ++i){
+        pool_mgr_pt shard = _mem_new_pool_mgr();
+        if (shard == NULL){
+            _mem_destroy_pool(manager);
+            return NULL;
+        }
+        shard->pool.policy = policy;
+        shard->pool.mem = manager->pool.mem + i * manager->shard_size;
+        shard->pool.total_size = (i + 1 < num_shards) ? manager->shard_size :
+                                 size - i * manager->shard_size;
+        shard->flags |= shard_flags | MEM_POOL_SHARD;
+        shard->mem_fd = -1;
+        atomic_init(&shard->lock, 0);
+        atomic_init(&shard->largest_gap, shard->pool.total_size);
+        if (_mem_init_pool_mgr(shard) != ALLOC_OK){
+            free(shard);
+            _mem_destroy_pool(manager);
+            return NULL;
+        }
+        manager->shards[manager->num_shards++] = shard;
+    }
+
+    if (_mem_add_to_pool_store(manager) != ALLOC_OK){
+        _mem_destroy_pool(manager);
+        return NULL;
+    }
+
+    return manager;
+}
+
+/*
+ * Function Name: _mem_resize_node_heap
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: alloc_status
+ * Purpose: This function grows the node heap once more than
+ * MEM_NODE_HEAP_FILL_FACTOR of its nodes are used. The nodes are handed
+ * out to the user as allocations, so they must never move: instead of
+ * reallocating, the heap grows by a new chunk as large as the whole heap
+ * so far.
+ */
+
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+
+    /* Check to see if we have too many nodes */
+    if((*pool_mgr).used_nodes > (*pool_mgr).total_nodes * MEM_NODE_HEAP_FILL_FACTOR){
+        if ((*pool_mgr).num_node_chunks == MEM_NODE_HEAP_MAX_CHUNKS){
+            return ALLOC_FAIL;
+        }
+        const unsigned chunk = (*pool_mgr).num_node_chunks;
+        const size_t chunk_size = _mem_node_chunk_size(chunk);
+        node_pt nodes = (node_pt) calloc(chunk_size, sizeof(node_t));
+        if(nodes == NULL){
+            /* If the allocation failed then return ALLOC_FAIL. */
+            return ALLOC_FAIL;
+        }
+        (*pool_mgr).node_chunks[chunk] = nodes;
+        (*pool_mgr).num_node_chunks++;
+        (*pool_mgr).total_nodes *= MEM_NODE_HEAP_EXPAND_FACTOR;
+        _mem_profile_count(PROFILE_NODE_HEAP_RESIZES, 1);
+        for (size_t i = chunk_size; i > 0; --i){
+            _mem_release_node(pool_mgr, &nodes[i - 1]);
+        }
+        return ALLOC_OK;
+    }
+    /* If we are okay on nodes then return okay. */
+    else{
+        return ALLOC_OK;
+    }
+}
+
+/*
+ * Function Name: _mem_node_chunk_size
+ * Passed Variables: unsigned chunk
+ * Return Type: size_t
+ * Purpose: This function returns the number of nodes in a chunk of the
+ * node heap. Every chunk after the first one doubles the heap.
+ */
+static size_t _mem_node_chunk_size(unsigned chunk) {
+    size_t total = MEM_NODE_HEAP_INIT_CAPACITY;
+    if (chunk == 0){
+        return total;
+    }
+    for (unsigned c = 1; c < chunk; ++c){
+        total *= MEM_NODE_HEAP_EXPAND_FACTOR;
+    }
+    return total * (MEM_NODE_HEAP_EXPAND_FACTOR - 1);
+}
+
+/*
+ * Function Name: _mem_find_node
+ * Passed Variables: pool_mgr_pt pool_mgr, const void *ptr, size_t *index
+ * Return Type: node_pt
+ * Purpose: This function checks whether a pointer is a node of the pool's
+ * node heap. If it is, the node is returned and its position in the heap
+ * is passed back through index (if not NULL). Otherwise returns NULL.
+ */
+static node_pt _mem_find_node(pool_mgr_pt pool_mgr, const void *ptr, size_t *index) {
+    size_t base = 0;
+    for (unsigned c = 0; c < pool_mgr->num_node_chunks; ++c){
+        const size_t chunk_size = _mem_node_chunk_size(c);
+        const uintptr_t first = (uintptr_t) pool_mgr->node_chunks[c];
+        const uintptr_t addr = (uintptr_t) ptr;
+        if (addr >= first && addr < first + chunk_size * sizeof(node_t)){
+            if ((addr - first) % sizeof(node_t) != 0){
+                return NULL;
+            }
+            if (index != NULL){
+                *index = base + (addr - first) / sizeof(node_t);
+            }
+            return (node_pt) ptr;
+        }
+        base += chunk_size;
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_node_at
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t index
+ * Return Type: node_pt
+ * Purpose: This function returns the node at a position of the node heap,
+ * or NULL if the heap is not that large.
+ */
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, size_t index) {
+    for (unsigned c = 0; c < pool_mgr->num_node_chunks; ++c){
+        const size_t chunk_size = _mem_node_chunk_size(c);
+        if (index < chunk_size){
+            return &pool_mgr->node_chunks[c][index];
+        }
+        index -= chunk_size;
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_get_unused_node
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: node_pt
+ * Purpose: This function takes a node off the list of unused nodes, or
+ * the next node of the first chunk that was never used, growing the node
+ * heap if there is neither. Returns NULL if the heap cannot grow.
+ */
+static node_pt _mem_get_unused_node(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->unused_nodes == NULL && pool_mgr->fresh_nodes > 0){
+        return &pool_mgr->node_chunks[0][MEM_NODE_HEAP_INIT_CAPACITY - pool_mgr->fresh_nodes--];
+    }
+    if (pool_mgr->unused_nodes == NULL){
+        /* force the heap to grow */
+        const unsigned used_nodes = pool_mgr->used_nodes;
+        pool_mgr->used_nodes = pool_mgr->total_nodes;
+        alloc_status status = _mem_resize_node_heap(pool_mgr);
+        pool_mgr->used_nodes = used_nodes;
+        if (status != ALLOC_OK){
+            return NULL;
+        }
+    }
+    node_pt node = pool_mgr->unused_nodes;
+    pool_mgr->unused_nodes = node->next;
+    node->next = NULL;
+    node->prev = NULL;
+
+    return node;
+}
+
+/*
+ * Function Name: _mem_release_node
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: This function marks a node as unused and puts it on the list
+ * of unused nodes.
+ */
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node) {
+    node->used = 0;
+    node->allocated = 0;
+    node->pinned = 0;
+    node->parked = 0;
+    node->alloc_record.size = 0;
+    node->alloc_record.mem = NULL;
+    node->prev = NULL;
+    node->next = pool_mgr->unused_nodes;
+    pool_mgr->unused_nodes = node;
+}
+
+/*
+ * Function Name: _mem_resize_gap_ix
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: alloc_status
+ * Purpose: This function grows the gap index by reallocating it once
+ * it is more than MEM_GAP_IX_FILL_FACTOR full. The initial gap index of
+ * a MEM_POOL_INLINE manager cannot be reallocated, so it is copied out.
+ */
+static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
+
+    if((*pool_mgr).gap_ix_capacity + 1 > (*pool_mgr).gap_ix_size * MEM_GAP_IX_FILL_FACTOR){
+        /* Create a new node_pt that is a reallocated gap index. */
+        /* We use the expand factor to increase the size. This is simply multiplying by 2. */
+        const size_t new_size = (*pool_mgr).gap_ix_size * MEM_GAP_IX_EXPAND_FACTOR;
+        const int is_inline = (*pool_mgr).gap_ix == _mem_inline_gap_ix(pool_mgr);
+        gap_pt reallocated_gap = (gap_pt) (is_inline ? malloc(new_size * sizeof(gap_t)) :
+                                           realloc((*pool_mgr).gap_ix, new_size * sizeof(gap_t)));
+        if(reallocated_gap == NULL){
+            /* If the allocation failed then return ALLOC_FAIL. */
+            return ALLOC_FAIL;
+        }
+        else{
+            if (is_inline){
+                memcpy(reallocated_gap, (*pool_mgr).gap_ix, (*pool_mgr).gap_ix_size * sizeof(gap_t));
+            }
+            /* Set the node heap to the newly allocated 'reallocated_gap' */
+            (*pool_mgr).gap_ix = reallocated_gap;
+            (*pool_mgr).gap_ix_size *= MEM_GAP_IX_EXPAND_FACTOR;
+            _mem_profile_count(PROFILE_GAP_IX_RESIZES, 1);
+            return ALLOC_OK;
+        }
+    }
+    /* If we are okay on gaps then return okay. */
+    else{
+        return ALLOC_OK;
+    }
+}
+
+/*
+ * Function Name: _mem_add_to_gap_ix
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
+ * Return Type: alloc_status
+ * Purpose: The purpose of this function is to add anew gap to the gap index.
+ * This gap is a passed as a node from the node index. The first step of the
+ * function is to check to make sure that we have enough size in the gap index.
+ * Once that is done we place the gap at the fiirst unused position of the
+ * gap index (gap_ix_capacity). Then any neccesary data members of the gap, node
+ * and pool manager are set. The index is not kept in any order: best fit
+ * looks at every gap and first fit walks the segments, so the node only
+ * remembers its slot to be taken out again in constant time.
+ */
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
+                                       size_t size,
+                                       node_pt node) {
+    /* Check to see if we need to resize */
+    if(_mem_resize_gap_ix(pool_mgr) == ALLOC_FAIL){
+        return ALLOC_FAIL;
+    }
+    /* Set the nodes values */
+    (*node).allocated = 0;
+    (*node).used = 1;
+    (*node).gap_slot = pool_mgr->gap_ix_capacity;
+    _mem_stats_add_gap(pool_mgr, size);
+    /* Add the gap to the index and node heap */
+    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node = node;
+    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node->alloc_record.size = size;
+    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].size = size;
+    /*Increase the amount of gaps */
+    (*pool_mgr).gap_ix_capacity++;
+    (*pool_mgr).pool.num_gaps++;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_remove_from_gap_ix
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
+ * Return Type: alloc_status
+ * Purpose: This function removes a gap from the index, which is done
+ * when a node needs to have memory allocated. The gap is found through
+ * the slot its node remembers, and the gap at the bottom of the index is
+ * moved into that slot; ending with the gap capacity being decremented.
+ */
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
+                                            size_t size,
+                                            node_pt node) {
+    const unsigned gap_Location = node->gap_slot;
+    /* If the node isn't in the index return ALLOC_FAIL */
+    if(gap_Location >= pool_mgr->gap_ix_capacity || pool_mgr->gap_ix[gap_Location].node != node){
+        return ALLOC_FAIL;
+    }
+    _mem_stats_remove_gap(pool_mgr, pool_mgr->gap_ix[gap_Location].size);
+    /* Move the last filled gap in the index into the freed slot */
+    pool_mgr->gap_ix[gap_Location] = pool_mgr->gap_ix[pool_mgr->gap_ix_capacity -1];
+    pool_mgr->gap_ix[gap_Location].node->gap_slot = gap_Location;
+    /* Delete the node that is now in the last spot of the "filled index. */
+    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].node = NULL;
+    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].size = 0;
+    /* Decrement the amount of used gaps */
+    --pool_mgr->gap_ix_capacity;
+    --pool_mgr->pool.num_gaps;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_map_pool_mem
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: alloc_status
+ * Purpose: This function allocates the memory of a pool. A POOL_CLONEABLE
+ * pool gets a shared mapping of a fresh memfd, so that mem_pool_clone can
+ * map the same pages copy-on-write. If the memfd cannot be created, or the
+ * pool is not cloneable, the memory comes from malloc.
+ */
+static alloc_status _mem_map_pool_mem(pool_mgr_pt pool_mgr, size_t size) {
+    pool_mgr->mem_fd = -1;
+    pool_mgr->mem_private = 0;
+    pool_mgr->pool.mem = NULL;
+
+    if (pool_mgr->flags & POOL_CLONEABLE){
+        int fd = memfd_create("mem_pool", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, size) == 0){
+            char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED){
+                pool_mgr->mem_fd = fd;
+                pool_mgr->pool.mem = mem;
+                return ALLOC_OK;
+            }
+        }
+        if (fd >= 0){
+            close(fd);
+        }
+    }
+    pool_mgr->pool.mem = malloc(size);
+
+    return (pool_mgr->pool.mem != NULL) ? ALLOC_OK : ALLOC_FAIL;
+}
+
+/*
+ * Function Name: _mem_unmap_pool_mem
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function releases the memory of a pool, undoing
+ * _mem_map_pool_mem.
+ */
+static void _mem_unmap_pool_mem(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->mem_fd >= 0){
+        munmap(pool_mgr->pool.mem, pool_mgr->pool.total_size);
+        close(pool_mgr->mem_fd);
+        pool_mgr->mem_fd = -1;
+    } else {
+        free(pool_mgr->pool.mem);
+    }
+    pool_mgr->pool.mem = NULL;
+}
+
+/*
+ * Function Name: _mem_lock
+ * Passed Variables: atomic_int *lock
+ * Return Type: void
+ * Purpose: This function takes an adaptive lock. The lock word is 0 when
+ * free, 1 when held and 2 when held with waiters. The caller spins for a
+ * short while, since pool operations are short, and then parks on a futex
+ * until the holder wakes it up.
+ */
+static void _mem_lock(atomic_int *lock) {
+    for (unsigned spin = 0; spin < MEM_LOCK_SPIN_COUNT; ++spin){
+        int expected = 0;
+        if (atomic_load_explicit(lock, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(lock, &expected, 1,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed)){
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    /* Announce a waiter and sleep until the lock is released */
+    while (atomic_exchange_explicit(lock, 2, memory_order_acquire) != 0){
+        syscall(SYS_futex, (int *) lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Function Name: _mem_trylock
+ * Passed Variables: atomic_int *lock
+ * Return Type: int
+ * Purpose: This function takes an adaptive lock if it is free, without
+ * waiting. Returns 1 if the lock was taken.
+ */
+static int _mem_trylock(atomic_int *lock) {
+    int expected = 0;
+    return atomic_compare_exchange_strong_explicit(lock, &expected, 1,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed);
+}
+
+/*
+ * Function Name: _mem_unlock
+ * Passed Variables: atomic_int *lock
+ * Return Type: void
+ * Purpose: This function releases a lock taken with _mem_lock, waking up
+ * one parked waiter if there is any.
+ */
+static void _mem_unlock(atomic_int *lock) {
+    if (atomic_exchange_explicit(lock, 0, memory_order_release) == 2){
+        syscall(SYS_futex, (int *) lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Function Name: _mem_pool_lock
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function takes the lock of a POOL_LOCKED pool. Pools
+ * opened without the flag are not locked at all.
+ */
+static inline void _mem_pool_lock(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->flags & POOL_LOCKED){
+        _mem_lock(&pool_mgr->lock);
+    }
+}
+
+/*
+ * Function Name: _mem_pool_unlock
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function releases the lock taken with _mem_pool_lock.
+ */
+static inline void _mem_pool_unlock(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->flags & POOL_LOCKED){
+        _mem_unlock(&pool_mgr->lock);
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_class
+ * Passed Variables: size_t size
+ * Return Type: int
+ * Purpose: This function returns the size class of a thread cache that
+ * holds blocks of the passed size. The classes are the powers of two from
+ * MEM_TCACHE_MIN_SIZE up. Returns -1 if the size is too large to cache.
+ */
+static int _mem_tcache_class(size_t size) {
+    size_t class_size = MEM_TCACHE_MIN_SIZE;
+    for (int cls = 0; cls < MEM_TCACHE_NUM_CLASSES; ++cls, class_size <<= 1){
+        if (size <= class_size){
+            return cls;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function Name: _mem_tcache_acquire
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: tcache_pt
+ * Purpose: This function finds the calling thread's cache of a pool,
+ * creating it on first use, and returns it locked. Caches of pools that
+ * have been closed are dropped along the way. Returns NULL if a cache
+ * cannot be created.
+ */
+static tcache_pt _mem_tcache_acquire(pool_mgr_pt pool_mgr) {
+    tcache_pt tcache = thread_tcache_last;
+    if (tcache == NULL || tcache->key != pool_mgr){
+        for (tcache = thread_tcaches; tcache != NULL; tcache = tcache->thread_next){
+            if (tcache->key == pool_mgr){
+                break;
+            }
+        }
+    }
+    if (tcache != NULL){
+        _mem_lock(&tcache->lock);
+        if (tcache->pool == pool_mgr){
+            thread_tcache_last = tcache;
+            return tcache;
+        }
+        _mem_unlock(&tcache->lock);
+    }
+
+    /* Sweep the caches of closed pools off this thread's list */
+    tcache_pt *link = &thread_tcaches;
+    while (*link != NULL){
+        tcache_pt current = *link;
+        _mem_lock(&current->lock);
+        const int closed = (current->pool == NULL);
+        _mem_unlock(&current->lock);
+        if (closed){
+            *link = current->thread_next;
+            _mem_tcache_release(current);
+        } else {
+            link = &current->thread_next;
+        }
+    }
+    thread_tcache_last = NULL;
+
+    pthread_once(&tcache_key_once, _mem_tcache_make_key);
+    tcache = calloc(1, sizeof(tcache_t));
+    if (tcache == NULL){
+        pthread_setspecific(tcache_key, thread_tcaches);
+        return NULL;
+    }
+    tcache->key = pool_mgr;
+    tcache->pool = pool_mgr;
+    atomic_init(&tcache->lock, 0);
+    atomic_init(&tcache->refs, 2);
+
+    _mem_pool_lock(pool_mgr);
+    tcache->pool_next = pool_mgr->tcaches;
+    pool_mgr->tcaches = tcache;
+    _mem_pool_unlock(pool_mgr);
+
+    tcache->thread_next = thread_tcaches;
+    thread_tcaches = tcache;
+    pthread_setspecific(tcache_key, thread_tcaches);
+
+    _mem_lock(&tcache->lock);
+    thread_tcache_last = tcache;
+
+    return tcache;
+}
+
+/*
+ * Function Name: _mem_tcache_flush
+ * Passed Variables: tcache_pt tcache, unsigned cls, unsigned count
+ * Return Type: void
+ * Purpose: This function returns the count oldest blocks of a size class
+ * of a locked cache to its pool, in one pass under the pool lock.
+ */
+static void _mem_tcache_flush(tcache_pt tcache, unsigned cls, unsigned count) {
+    if (count == 0){
+        return;
+    }
+    _mem_pool_lock(tcache->pool);
+    for (unsigned i = 0; i < count; ++i){
+        tcache->bins[cls][i]->cached = 0;
+        _mem_del_alloc(tcache->pool, (alloc_pt) tcache->bins[cls][i]);
+    }
+    _mem_pool_unlock(tcache->pool);
+    tcache->counts[cls] -= count;
+    memmove(tcache->bins[cls], tcache->bins[cls] + count, tcache->counts[cls] * sizeof(node_pt));
+}
+
+/*
+ * Function Name: _mem_tcache_release
+ * Passed Variables: tcache_pt tcache
+ * Return Type: void
+ * Purpose: This function drops a reference to a cache, freeing the cache
+ * when both its thread and its pool are done with it.
+ */
+static void _mem_tcache_release(tcache_pt tcache) {
+    if (atomic_fetch_sub_explicit(&tcache->refs, 1, memory_order_acq_rel) == 1){
+        free(tcache);
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_drain
+ * Passed Variables: pool_mgr_pt pool_mgr, int flush
+ * Return Type: void
+ * Purpose: This function detaches all the threads' caches from a pool
+ * that is being closed. If flush is set, the cached blocks are returned
+ * to the pool first. The threads drop their caches the next time they
+ * look for them, or when they exit.
+ */
+static void _mem_tcache_drain(pool_mgr_pt pool_mgr, int flush) {
+    _mem_pool_lock(pool_mgr);
+    tcache_pt tcache = pool_mgr->tcaches;
+    pool_mgr->tcaches = NULL;
+    _mem_pool_unlock(pool_mgr);
+
+    while (tcache != NULL){
+        tcache_pt next = tcache->pool_next;
+        _mem_lock(&tcache->lock);
+        for (unsigned cls = 0; flush && cls < MEM_TCACHE_NUM_CLASSES; ++cls){
+            _mem_tcache_flush(tcache, cls, tcache->counts[cls]);
+        }
+        tcache->pool = NULL;
+        _mem_unlock(&tcache->lock);
+        _mem_tcache_release(tcache);
+        tcache = next;
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_lock_all
+ * Passed Variables: pool_mgr_pt pool_mgr, tcache_pt **tcaches, unsigned *count
+ * Return Type: alloc_status
+ * Purpose: This function locks all the threads' caches of a pool and then
+ * the pool, keeping to the lock order, so the cached blocks can be read.
+ * The caches are taken off the pool's list with a reference each while
+ * the pool is locked, so a thread exiting in the meantime cannot free
+ * them, and passed back in a new array. Caches are only ever added at the
+ * head of the list, so it is taken again if its head changed before the
+ * pool was locked again. Returns ALLOC_FAIL, with nothing locked, if out
+ * of memory.
+ */
+static alloc_status _mem_tcache_lock_all(pool_mgr_pt pool_mgr, tcache_pt **tcaches, unsigned *count) {
+    unsigned capacity = 0;
+    *tcaches = NULL;
+    for (;;){
+        _mem_pool_lock(pool_mgr);
+        unsigned num_tcaches = 0;
+        for (tcache_pt tcache = pool_mgr->tcaches; tcache != NULL; tcache = tcache->pool_next){
+            ++num_tcaches;
+        }
+        if (num_tcaches > capacity){
+            _mem_pool_unlock(pool_mgr);
+            free(*tcaches);
+            capacity = 2 * num_tcaches;
+            *tcaches = malloc(capacity * sizeof(tcache_pt));
+            if (*tcaches == NULL){
+                return ALLOC_FAIL;
+            }
+            continue;
+        }
+        *count = 0;
+        for (tcache_pt tcache = pool_mgr->tcaches; tcache != NULL; tcache = tcache->pool_next){
+            atomic_fetch_add_explicit(&tcache->refs, 1, memory_order_relaxed);
+            (*tcaches)[(*count)++] = tcache;
+        }
+        _mem_pool_unlock(pool_mgr);
+
+        for (unsigned i = 0; i < *count; ++i){
+            _mem_lock(&(*tcaches)[i]->lock);
+        }
+        _mem_pool_lock(pool_mgr);
+        if (pool_mgr->tcaches == ((*count > 0) ? (*tcaches)[0] : NULL)){
+            return ALLOC_OK;
+        }
+        _mem_tcache_unlock_all(pool_mgr, *tcaches, *count);
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_unlock_all
+ * Passed Variables: pool_mgr_pt pool_mgr, tcache_pt *tcaches, unsigned count
+ * Return Type: void
+ * Purpose: This function unlocks a pool and the caches locked by
+ * _mem_tcache_lock_all, and drops their references. The array is left
+ * to the caller.
+ */
+static void _mem_tcache_unlock_all(pool_mgr_pt pool_mgr, tcache_pt *tcaches, unsigned count) {
+    _mem_pool_unlock(pool_mgr);
+    for (unsigned i = 0; i < count; ++i){
+        _mem_unlock(&tcaches[i]->lock);
+        _mem_tcache_release(tcaches[i]);
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_make_key
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function creates the thread-specific key whose destructor
+ * flushes a thread's caches when the thread exits.
+ */
+static void _mem_tcache_make_key() {
+    pthread_key_create(&tcache_key, _mem_tcache_thread_exit);
+}
+
+/*
+ * Function Name: _mem_tcache_thread_exit
+ * Passed Variables: void *tcaches
+ * Return Type: void
+ * Purpose: This function runs when a thread with caches exits. Every
+ * cache of a pool that is still open is flushed and taken off the pool.
+ */
+static void _mem_tcache_thread_exit(void *tcaches) {
+    tcache_pt tcache = tcaches;
+    while (tcache != NULL){
+        tcache_pt next = tcache->thread_next;
+        int unlinked = 0;
+        _mem_lock(&tcache->lock);
+        pool_mgr_pt pool_mgr = tcache->pool;
+        if (pool_mgr != NULL){
+            for (unsigned cls = 0; cls < MEM_TCACHE_NUM_CLASSES; ++cls){
+                _mem_tcache_flush(tcache, cls, tcache->counts[cls]);
+            }
+            _mem_pool_lock(pool_mgr);
+            for (tcache_pt *link = &pool_mgr->tcaches; *link != NULL; link = &(*link)->pool_next){
+                if (*link == tcache){
+                    *link = tcache->pool_next;
+                    unlinked = 1;
+                    break;
+                }
+            }
+            _mem_pool_unlock(pool_mgr);
+            tcache->pool = NULL;
+        }
+        _mem_unlock(&tcache->lock);
+        if (unlinked){
+            _mem_tcache_release(tcache);
+        }
+        _mem_tcache_release(tcache);
+        tcache = next;
+    }
+    thread_tcaches = NULL;
+    thread_tcache_last = NULL;
+}
+
+/*
+ * Function Name: _mem_tcache_alloc
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function serves an allocation of a POOL_THREAD_CACHE
+ * pool. Sizes of a size class come from the calling thread's cache, which
+ * is refilled from the pool MEM_TCACHE_BATCH blocks at a time. Larger
+ * sizes go to the pool directly.
+ */
+static alloc_pt _mem_tcache_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    const int cls = _mem_tcache_class(size);
+    tcache_pt tcache = (cls < 0) ? NULL : _mem_tcache_acquire(pool_mgr);
+    if (tcache == NULL){
+        _mem_pool_lock(pool_mgr);
+        alloc_pt alloc = _mem_new_alloc(pool_mgr, size);
+        _mem_pool_unlock(pool_mgr);
+        return alloc;
+    }
+
+    if (tcache->counts[cls] == 0){
+        const size_t class_size = MEM_TCACHE_MIN_SIZE << cls;
+        _mem_pool_lock(pool_mgr);
+        for (unsigned i = 0; i < MEM_TCACHE_BATCH; ++i){
+            node_pt node = (node_pt) _mem_new_alloc(pool_mgr, class_size);
+            if (node == NULL){
+                break;
+            }
+            /* hand the lowest blocks out first */
+            node->cached = 1;
+            tcache->bins[cls][MEM_TCACHE_BATCH - 1 - i] = node;
+            tcache->counts[cls]++;
+        }
+        _mem_pool_unlock(pool_mgr);
+        if (tcache->counts[cls] < MEM_TCACHE_BATCH){
+            memmove(tcache->bins[cls], tcache->bins[cls] + MEM_TCACHE_BATCH - tcache->counts[cls],
+                    tcache->counts[cls] * sizeof(node_pt));
+        }
+    }
+    alloc_pt alloc = NULL;
+    if (tcache->counts[cls] > 0){
+        alloc = (alloc_pt) tcache->bins[cls][--tcache->counts[cls]];
+        ((node_pt) alloc)->cached = 0;
+    }
+    _mem_unlock(&tcache->lock);
+
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_tcache_free
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function takes back an allocation of a POOL_THREAD_CACHE
+ * pool. Blocks of a size class go into the calling thread's cache; when
+ * the bin is full its oldest MEM_TCACHE_BATCH blocks go back to the pool.
+ * A block that is already cached or free is turned away with ALLOC_FAIL,
+ * as the pool would.
+ */
+static alloc_status _mem_tcache_free(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    const int cls = (alloc == NULL) ? -1 : _mem_tcache_class(alloc->size);
+    tcache_pt tcache = (cls < 0 || alloc->size != MEM_TCACHE_MIN_SIZE << cls) ?
+                       NULL : _mem_tcache_acquire(pool_mgr);
+    if (tcache == NULL){
+        _mem_pool_lock(pool_mgr);
+        alloc_status status = _mem_del_alloc(pool_mgr, alloc);
+        _mem_pool_unlock(pool_mgr);
+        return status;
+    }
+
+    node_pt node = (node_pt) alloc;
+    if (node->cached || !node->allocated){
+        _mem_unlock(&tcache->lock);
+        return ALLOC_FAIL;
+    }
+    if (tcache->counts[cls] == MEM_TCACHE_BIN_CAPACITY){
+        _mem_tcache_flush(tcache, cls, MEM_TCACHE_BATCH);
+    }
+    node->cached = 1;
+    tcache->bins[cls][tcache->counts[cls]++] = node;
+    _mem_unlock(&tcache->lock);
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_fixed_free_blocks
+ * Passed Variables: pool_mgr_pt pool_mgr, char *is_free
+ * Return Type: unsigned
+ * Purpose: This function walks the free block stack of a fixed-size pool
+ * and returns the number of free blocks. If is_free is not NULL, the
+ * entry of every free block is set. No thread may allocate from the pool
+ * meanwhile.
+ */
+static unsigned _mem_fixed_free_blocks(pool_mgr_pt pool_mgr, char *is_free) {
+    unsigned count = 0;
+    uint32_t next = (uint32_t) atomic_load(&pool_mgr->fixed_free);
+    while (next != 0 && count < pool_mgr->fixed_num_blocks){
+        if (is_free != NULL){
+            is_free[next - 1] = 1;
+        }
+        ++count;
+        next = atomic_load_explicit((atomic_uint *) (pool_mgr->pool.mem + (size_t) (next - 1) * pool_mgr->fixed_block_size),
+                                    memory_order_relaxed);
+    }
+    return count;
+}
+
+/*
+ * Function Name: _mem_shard_of
+ * Passed Variables: pool_mgr_pt pool_mgr, const char *mem
+ * Return Type: pool_mgr_pt
+ * Purpose: This function returns the shard of a sharded pool that owns
+ * the passed address, or NULL if the address is not in the pool.
+ */
+static pool_mgr_pt _mem_shard_of(pool_mgr_pt pool_mgr, const char *mem) {
+    if (mem < pool_mgr->pool.mem || mem >= pool_mgr->pool.mem + pool_mgr->pool.total_size){
+        return NULL;
+    }
+    size_t shard = (mem - pool_mgr->pool.mem) / pool_mgr->shard_size;
+    if (shard >= pool_mgr->num_shards){
+        shard = pool_mgr->num_shards - 1; // the last shard takes the remainder
+    }
+    return pool_mgr->shards[shard];
+}
+
+/*
+ * Function Name: _mem_shard_alloc
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function serves an allocation of a sharded pool from the
+ * shard of the calling thread's CPU, or else from the first sibling shard,
+ * going round from there, that has room.
+ */
+static alloc_pt _mem_shard_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    const int cpu = sched_getcpu();
+    const unsigned home = (cpu > 0) ? (unsigned) cpu % pool_mgr->num_shards : 0;
+
+    for (unsigned i = 0; i < pool_mgr->num_shards; ++i){
+        alloc_pt alloc = _mem_dispatch_alloc(pool_mgr->shards[(home + i) % pool_mgr->num_shards], size);
+        if (alloc != NULL){
+            return alloc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_drain_remote_frees
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function takes the whole remote free queue of a pool in
+ * one exchange and deallocates its allocations, oldest first. Only the
+ * owner of the pool, or a thread with the pool to itself, may call it,
+ * with the pool lock (if any) held.
+ */
+static void _mem_drain_remote_frees(pool_mgr_pt pool_mgr) {
+    node_pt node = atomic_exchange_explicit(&pool_mgr->remote_frees, NULL, memory_order_acquire);
+
+    /* The queue is newest first; reversing it frees in the order of the pushes */
+    node_pt oldest = NULL;
+    while (node != NULL){
+        node_pt next = node->remote_next;
+        node->remote_next = oldest;
+        oldest = node;
+        node = next;
+    }
+    while (oldest != NULL){
+        node_pt next = oldest->remote_next;
+        oldest->remote_next = NULL;
+        _mem_del_alloc(pool_mgr, (alloc_pt) oldest);
+        oldest = next;
+    }
+}
+
+/*
+ * Function Name: _mem_largest_gap
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: size_t
+ * Purpose: This function returns the size of the largest gap of a pool,
+ * with the pool lock (if any) held. It is the largest gap of the highest
+ * size class with gaps, which is kept up to date as gaps come and go. Only
+ * if that gap has gone since, the gaps of the class are looked up again.
+ */
+static size_t _mem_largest_gap(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->gap_hist_used == 0){
+        return 0;
+    }
+    const unsigned cls = 31 - __builtin_clz(pool_mgr->gap_hist_used);
+    const uint32_t bit = (uint32_t) 1 << cls;
+    if (pool_mgr->gap_hist_stale & bit){
+        size_t largest = 0;
+        unsigned count = 0;
+        for (unsigned i = 0; i < pool_mgr->gap_ix_capacity; ++i){
+            const size_t size = pool_mgr->gap_ix[i].size;
+            if (_mem_stats_class(size) == cls){
+                count = (size > largest) ? 1 : count + (size == largest);
+                largest = (size > largest) ? size : largest;
+            }
+        }
+        for (unsigned b = 0; pool_mgr->num_parked > 0 && b < MEM_QUICK_NUM_BINS; ++b){
+            for (node_pt node = pool_mgr->quick_bins[b]; node != NULL; node = node->remote_next){
+                const size_t size = node->alloc_record.size;
+                if (_mem_stats_class(size) == cls){
+                    count = (size > largest) ? 1 : count + (size == largest);
+                    largest = (size > largest) ? size : largest;
+                }
+            }
+        }
+        pool_mgr->gap_hist_max[cls] = largest;
+        pool_mgr->gap_hist_max_count[cls] = count;
+        pool_mgr->gap_hist_stale &= ~bit;
+    }
+    return pool_mgr->gap_hist_max[cls];
+}
+
+/*
+ * Function Name: _mem_stats_class
+ * Passed Variables: size_t size
+ * Return Type: unsigned
+ * Purpose: This function returns the size class of a gap in the pool
+ * statistics: class i holds the gaps of 2^i to 2^(i+1)-1 bytes, and the
+ * last class all the larger ones.
+ */
+static unsigned _mem_stats_class(size_t size) {
+    if (size <= 1){
+        return 0;
+    }
+    const unsigned cls = 63 - __builtin_clzll((unsigned long long) size);
+    return (cls < POOL_STATS_NUM_BUCKETS) ? cls : POOL_STATS_NUM_BUCKETS - 1;
+}
+
+/*
+ * Function Name: _mem_stats_add_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void
+ * Purpose: This function counts a new gap of the passed size in the pool
+ * statistics.
+ */
+static void _mem_stats_add_gap(pool_mgr_pt pool_mgr, size_t size) {
+    const unsigned cls = _mem_stats_class(size);
+    const uint32_t bit = (uint32_t) 1 << cls;
+    pool_mgr->gap_hist[cls]++;
+    pool_mgr->gap_hist_used |= bit;
+    if (size > pool_mgr->gap_hist_max[cls]){
+        /* also right if the largest gap went, as the others are smaller */
+        pool_mgr->gap_hist_max[cls] = size;
+        pool_mgr->gap_hist_max_count[cls] = 1;
+        pool_mgr->gap_hist_stale &= ~bit;
+    } else if (size == pool_mgr->gap_hist_max[cls] && !(pool_mgr->gap_hist_stale & bit)){
+        pool_mgr->gap_hist_max_count[cls]++;
+    }
+}
+
+/*
+ * Function Name: _mem_stats_remove_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void
+ * Purpose: This function takes a gap of the passed size out of the pool
+ * statistics. If it was the last of the largest gaps of its class, the
+ * class is marked stale for _mem_largest_gap.
+ */
+static void _mem_stats_remove_gap(pool_mgr_pt pool_mgr, size_t size) {
+    const unsigned cls = _mem_stats_class(size);
+    const uint32_t bit = (uint32_t) 1 << cls;
+    if (--pool_mgr->gap_hist[cls] == 0){
+        pool_mgr->gap_hist_used &= ~bit;
+        pool_mgr->gap_hist_stale &= ~bit;
+        pool_mgr->gap_hist_max[cls] = 0;
+        pool_mgr->gap_hist_max_count[cls] = 0;
+    } else if (size == pool_mgr->gap_hist_max[cls] && !(pool_mgr->gap_hist_stale & bit) &&
+               --pool_mgr->gap_hist_max_count[cls] == 0){
+        pool_mgr->gap_hist_stale |= bit;
+    }
+}
+
+/*
+ * Function Name: _mem_region_alloc
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: alloc_pt
+ * Purpose: This function serves an allocation of a partitioned pool. The
+ * first pass only takes regions whose lock is free, the second waits.
+ */
+static alloc_pt _mem_region_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    const unsigned num_regions = pool_mgr->num_shards;
+    const unsigned start = thread_region_hint % num_regions;
+
+    for (int wait = 0; wait < 2; ++wait){
+        for (unsigned i = 0; i < num_regions; ++i){
+            const unsigned r = (start + i) % num_regions;
+            pool_mgr_pt region = pool_mgr->shards[r];
+            if (atomic_load_explicit(&region->largest_gap, memory_order_relaxed) < size){
+                continue;
+            }
+            if (wait){
+                _mem_lock(&region->lock);
+            } else if (!_mem_trylock(&region->lock)){
+                continue;
+            }
+            node_pt node = (node_pt) _mem_new_alloc(region, size);
+            if (node != NULL){
+                atomic_store_explicit(&region->largest_gap, _mem_largest_gap(region), memory_order_relaxed);
+            }
+            _mem_unlock(&region->lock);
+            if (node != NULL){
+                thread_region_hint = r;
+                return (alloc_pt) node;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_region_free
+ * Passed Variables: pool_mgr_pt region, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: This function returns an allocation to a region of a
+ * partitioned pool and publishes the region's new largest gap.
+ */
+static alloc_status _mem_region_free(pool_mgr_pt region, alloc_pt alloc) {
+    _mem_lock(&region->lock);
+    const alloc_status status = _mem_del_alloc(region, alloc);
+    if (status == ALLOC_OK){
+        atomic_store_explicit(&region->largest_gap, _mem_largest_gap(region), memory_order_relaxed);
+    }
+    _mem_unlock(&region->lock);
+
+    return status;
+}
+
+/*
+ * Function Name: _mem_epoch_rec_acquire
+ * Passed Variables: None
+ * Return Type: epoch_rec_pt
+ * Purpose: This function gives the calling thread an epoch record, taking
+ * one that an exited thread left behind if there is one. Records are never
+ * freed, so the list can be walked without a lock.
+ */
+static epoch_rec_pt _mem_epoch_rec_acquire() {
+    pthread_once(&epoch_key_once, _mem_epoch_make_key);
+    epoch_rec_pt rec;
+    for (rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next){
+        int free_rec = 0;
+        if (atomic_load_explicit(&rec->in_use, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&rec->in_use, &free_rec, 1)){
+            break;
+        }
+    }
+    if (rec == NULL){
+        rec = calloc(1, sizeof(epoch_rec_t));
+        assert(rec);
+        atomic_init(&rec->epoch, 0);
+        atomic_init(&rec->in_use, 1);
+        rec->next = atomic_load(&epoch_recs);
+        while (!atomic_compare_exchange_weak(&epoch_recs, &rec->next, rec)){
+        }
+    }
+    pthread_setspecific(epoch_key, rec);
+    return rec;
+}
+
+/*
+ * Function Name: _mem_epoch_make_key
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function creates the thread-specific key whose destructor
+ * hands a thread's epoch record back when the thread exits.
+ */
+static void _mem_epoch_make_key() {
+    pthread_key_create(&epoch_key, _mem_epoch_thread_exit);
+}
+
+/*
+ * Function Name: _mem_epoch_thread_exit
+ * Passed Variables: void *rec
+ * Return Type: void
+ * Purpose: This function runs when a thread with an epoch record exits.
+ * The record is marked free for the next thread to take.
+ */
+static void _mem_epoch_thread_exit(void *rec) {
+    epoch_rec_pt epoch_rec = rec;
+    atomic_store(&epoch_rec->epoch, 0);
+    atomic_store(&epoch_rec->in_use, 0);
+    thread_epoch_rec = NULL;
+    thread_epoch_depth = 0;
+}
+
+/*
+ * Function Name: _mem_epoch_try_advance
+ * Passed Variables: None
+ * Return Type: uint64_t
+ * Purpose: This function moves the global epoch on by one if every thread
+ * inside a critical section has seen the current one, and returns the
+ * global epoch.
+ */
+static uint64_t _mem_epoch_try_advance() {
+    uint64_t epoch = atomic_load(&epoch_global);
+    for (epoch_rec_pt rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next){
+        const uint64_t seen = atomic_load(&rec->epoch);
+        if (seen != 0 && seen != epoch){
+            return epoch;
+        }
+    }
+    if (atomic_compare_exchange_strong(&epoch_global, &epoch, epoch + 1)){
+        return epoch + 1;
+    }
+    return epoch; // somebody else moved it on
+}
+
+/*
+ * Function Name: _mem_epoch_reclaim
+ * Passed Variables: pool_mgr_pt pool_mgr, int force
+ * Return Type: unsigned
+ * Purpose: This function takes the limbo list of a pool and returns every
+ * allocation retired at least two epochs ago to the pool with
+ * mem_del_alloc, or every one if force is set; the rest go back on the
+ * list. Returns the number of allocations returned.
+ */
+static unsigned _mem_epoch_reclaim(pool_mgr_pt pool_mgr, int force) {
+    const uint64_t epoch = _mem_epoch_try_advance();
+    node_pt node = atomic_exchange_explicit(&pool_mgr->limbo, NULL, memory_order_acquire);
+    node_pt keep = NULL, keep_last = NULL;
+    unsigned freed = 0;
+
+    while (node != NULL){
+        node_pt next = node->remote_next;
+        if (force || node->retire_epoch + 2 <= epoch){
+            node->remote_next = NULL;
+            node->retire_epoch = 0; // out of limbo, even if a cache takes it
+            mem_del_alloc((pool_pt) pool_mgr, (alloc_pt) node);
+            ++freed;
+        } else {
+            node->remote_next = keep;
+            if (keep == NULL){
+                keep_last = node;
+            }
+            keep = node;
+        }
+        node = next;
+    }
+    if (keep != NULL){
+        keep_last->remote_next = atomic_load_explicit(&pool_mgr->limbo, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&pool_mgr->limbo, &keep_last->remote_next, keep,
+                                                      memory_order_release, memory_order_relaxed)){
+        }
+    }
+    atomic_fetch_sub_explicit(&pool_mgr->limbo_count, freed, memory_order_relaxed);
+
+    return freed;
+}
+
+/*
+ * Function Name: _mem_pin
+ * Passed Variables: pool_pt pool, alloc_pt alloc, int delta
+ * Return Type: alloc_status
+ * Purpose: This function adds delta to the pin count of an allocation,
+ * under the lock of the pool or of the shard that owns it.
+ */
+static alloc_status _mem_pin(pool_pt pool, alloc_pt alloc, int delta) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    if (pool_mgr == NULL || alloc == NULL || (pool_mgr->flags & MEM_POOL_FIXED)){
+        return ALLOC_FAIL;
+    }
+    if (pool_mgr->flags & MEM_POOL_SHARDED){
+        pool_mgr = _mem_shard_of(pool_mgr, alloc->mem);
+        if (pool_mgr == NULL){
+            return ALLOC_FAIL;
+        }
+    }
+
+    alloc_status status = ALLOC_FAIL;
+    _mem_pool_lock(pool_mgr);
+    node_pt node = _mem_find_node(pool_mgr, alloc, NULL);
+    if (node != NULL && node->used && node->allocated && (delta > 0 || node->pinned > 0)){
+        node->pinned += delta;
+        status = ALLOC_OK;
+    }
+    _mem_pool_unlock(pool_mgr);
+
+    return status;
+}
+
+/*
+ * Function Name: _mem_link_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt prev, char *mem, size_t size
+ * Return Type: node_pt
+ * Purpose: This function puts a new gap of the passed place and size into
+ * the segment list right after prev, or at its head if prev is NULL, and
+ * into the gap index.
+ */
+static node_pt _mem_link_gap(pool_mgr_pt pool_mgr, node_pt prev, char *mem, size_t size) {
+    node_pt gap = _mem_get_unused_node(pool_mgr);
+    assert(gap);
+    gap->alloc_record.mem = mem;
+    gap->prev = prev;
+    gap->next = (prev != NULL) ? prev->next : pool_mgr->node_list;
+    if (gap->next != NULL){
+        gap->next->prev = gap;
+    }
+    if (prev != NULL){
+        prev->next = gap;
+    } else {
+        pool_mgr->node_list = gap;
+    }
+    pool_mgr->used_nodes++;
+    if (_mem_add_to_gap_ix(pool_mgr, size, gap) != ALLOC_OK){
+        exit(0);
+    }
+    return gap;
+}
+
+/*
+ * Function Name: _mem_compact
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function does the work of mem_pool_compact with the pool
+ * lock (if any) held. The parked blocks are merged, and then all the
+ * gaps are dropped, so the gap index is
+ * simply emptied, and are then laid down again where the pinned
+ * allocations leave holes. There are never more new gaps than old ones,
+ * so the released nodes are enough.
+ */
+static void _mem_compact(pool_mgr_pt pool_mgr) {
+    _mem_coalesce(pool_mgr);
+    pool_mgr->changes++;
+    /* Drop the gaps, leaving the allocations linked in address order */
+    node_pt first = NULL, last = NULL;
+    node_pt node = pool_mgr->node_list;
+    while (node != NULL){
+        node_pt next = node->next;
+        if (node->allocated){
+            node->prev = last;
+            node->next = NULL;
+            if (last != NULL){
+                last->next = node;
+            } else {
+                first = node;
+            }
+            last = node;
+        } else {
+            _mem_release_node(pool_mgr, node);
+            pool_mgr->used_nodes--;
+        }
+        node = next;
+    }
+    memset(pool_mgr->gap_ix, 0, pool_mgr->gap_ix_capacity * sizeof(gap_t));
+    pool_mgr->gap_ix_capacity = 0;
+    pool_mgr->pool.num_gaps = 0;
+    memset(pool_mgr->gap_hist, 0, sizeof(pool_mgr->gap_hist));
+    memset(pool_mgr->gap_hist_max, 0, sizeof(pool_mgr->gap_hist_max));
+    memset(pool_mgr->gap_hist_max_count, 0, sizeof(pool_mgr->gap_hist_max_count));
+    pool_mgr->gap_hist_used = 0;
+    pool_mgr->gap_hist_stale = 0;
+    pool_mgr->node_list = first;
+    pool_mgr->compact_gap = NULL;
+
+    /* Slide the allocations down, around the pinned ones */
+    char *cursor = pool_mgr->pool.mem;
+    for (node = first; node != NULL; node = node->next){
+        char *mem = node->alloc_record.mem;
+        if (node->pinned > 0 || node->retire_epoch != 0){
+            if (cursor < mem){
+                _mem_link_gap(pool_mgr, node->prev, cursor, mem - cursor);
+            }
+            cursor = mem + node->alloc_record.size;
+        } else {
+            if (mem != cursor){
+                memmove(cursor, mem, node->alloc_record.size);
+                node->alloc_record.mem = cursor;
+                pool_mgr->compact_moved_bytes += node->alloc_record.size;
+                pool_mgr->compact_moved_allocs++;
+            }
+            cursor += node->alloc_record.size;
+        }
+    }
+    char *end = pool_mgr->pool.mem + pool_mgr->pool.total_size;
+    if (cursor < end){
+        _mem_link_gap(pool_mgr, last, cursor, end - cursor);
+    }
+}
+
+/*
+ * Function Name: _mem_compact_step
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t budget
+ * Return Type: size_t
+ * Purpose: This function does the work of mem_pool_compact_step on one
+ * pool with the pool lock (if any) held, and returns the bytes it moved.
+ * The allocation after the current gap is copied down into it, and the
+ * gap, now after the allocation, swallows the gap that follows, if any.
+ * The current gap is kept across calls while it is still a gap; the scan
+ * starts over from the first segment otherwise. The parked blocks are
+ * merged first.
+ */
+static size_t _mem_compact_step(pool_mgr_pt pool_mgr, size_t budget) {
+    _mem_coalesce(pool_mgr);
+    node_pt gap = pool_mgr->compact_gap;
+    if (gap == NULL || !gap->used || gap->allocated){
+        for (gap = pool_mgr->node_list; gap != NULL && gap->allocated; gap = gap->next){
+        }
+    }
+
+    size_t moved = 0;
+    while (gap != NULL){
+        node_pt next = gap->next;
+        if (next == NULL){
+            gap = NULL; // the gaps are all at the end
+            break;
+        }
+        if (moved >= budget){
+            break;
+        }
+        if (next->pinned > 0 || next->retire_epoch != 0){
+            /* leave the gap before a pinned allocation, go on with the next one */
+            for (gap = next->next; gap != NULL && gap->allocated; gap = gap->next){
+            }
+            continue;
+        }
+
+        /* Move the allocation down and swap it with the gap in the list */
+        const size_t size = next->alloc_record.size;
+        memmove(gap->alloc_record.mem, next->alloc_record.mem, size);
+        next->alloc_record.mem = gap->alloc_record.mem;
+        gap->alloc_record.mem += size;
+        next->prev = gap->prev;
+        if (gap->prev != NULL){
+            gap->prev->next = next;
+        } else {
+            pool_mgr->node_list = next;
+        }
+        gap->next = next->next;
+        if (gap->next != NULL){
+            gap->next->prev = gap;
+        }
+        next->next = gap;
+        gap->prev = next;
+        moved += size;
+        pool_mgr->compact_moved_allocs++;
+
+        /* Swallow the gap that now follows */
+        node_pt after = gap->next;
+        if (after != NULL && !after->allocated){
+            const size_t merged = gap->alloc_record.size + after->alloc_record.size;
+            _mem_profile_count(PROFILE_MERGES, 1);
+            _mem_remove_from_gap_ix(pool_mgr, 0, after);
+            _mem_remove_from_gap_ix(pool_mgr, 0, gap);
+            gap->next = after->next;
+            if (gap->next != NULL){
+                gap->next->prev = gap;
+            }
+            _mem_release_node(pool_mgr, after);
+            pool_mgr->used_nodes--;
+            if (_mem_add_to_gap_ix(pool_mgr, merged, gap) != ALLOC_OK){
+                exit(0);
+            }
+        }
+    }
+    pool_mgr->compact_gap = gap;
+    pool_mgr->compact_moved_bytes += moved;
+    if (moved > 0){
+        pool_mgr->changes++;
+    }
+
+    return moved;
+}
+
+/*
+ * Function Name: _mem_maint_thread
+ * Passed Variables: void *arg
+ * Return Type: void *
+ * Purpose: This function is the body of a pool's background thread. It
+ * sleeps for the configured interval, or until it is told to stop, and
+ * then does one round of housekeeping.
+ */
+static void *_mem_maint_thread(void *arg) {
+    maint_pt maint = arg;
+    const pool_pt pool = (pool_pt) maint->pool;
+    const maintenance_config_t *config = &maint->config;
+
+    pthread_mutex_lock(&maint->mutex);
+    while (!atomic_load(&maint->stop)){
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += config->interval_ms / 1000;
+        wake.tv_nsec += (long) (config->interval_ms % 1000) * 1000000;
+        if (wake.tv_nsec >= 1000000000){
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&maint->cond, &maint->mutex, &wake);
+        if (atomic_load(&maint->stop)){
+            break;
+        }
+        pthread_mutex_unlock(&maint->mutex);
+
+        maintenance_stats_t done = {1, 0, 0, 0, 0, 0};
+        done.reclaimed = mem_pool_reclaim(pool);
+        done.coalesced = mem_pool_coalesce(pool);
+
+        compact_progress_t progress;
+        mem_pool_compact_step(pool, 0, &progress);
+        while (!atomic_load(&maint->stop) && config->compact_budget > 0 &&
+               ((config->max_gaps > 0 && progress.num_gaps > config->max_gaps) ||
+                (config->min_gap_ratio > 0 && progress.free_bytes > 0 &&
+                 (double) progress.largest_gap / progress.free_bytes < config->min_gap_ratio))){
+            mem_pool_compact_step(pool, config->compact_budget, &progress);
+            done.compact_steps++;
+            done.compacted_bytes += progress.step_bytes;
+            if (progress.done){
+                break;
+            }
+        }
+
+        /* Purge only if the pool has changed since the last round */
+        const unsigned long changes = (config->purge_min_bytes > 0) ? _mem_maint_changes(maint->pool) : 0;
+        if (config->purge_min_bytes > 0 && changes != maint->purge_changes){
+            maint->purge_changes = changes;
+            done.purged_bytes = _mem_maint_purge(maint->pool, config->purge_min_bytes);
+        }
+
+        pthread_mutex_lock(&maint->mutex);
+        maint->stats.wakeups += done.wakeups;
+        maint->stats.compact_steps += done.compact_steps;
+        maint->stats.compacted_bytes += done.compacted_bytes;
+        maint->stats.purged_bytes += done.purged_bytes;
+        maint->stats.reclaimed += done.reclaimed;
+        maint->stats.coalesced += done.coalesced;
+    }
+    pthread_mutex_unlock(&maint->mutex);
+
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_maint_stop
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: This function stops the background thread of a pool, waits
+ * for it and frees it.
+ */
+static void _mem_maint_stop(pool_mgr_pt pool_mgr) {
+    maint_pt maint = pool_mgr->maint;
+    pthread_mutex_lock(&maint->mutex);
+    atomic_store(&maint->stop, 1);
+    pthread_cond_signal(&maint->cond);
+    pthread_mutex_unlock(&maint->mutex);
+    pthread_join(maint->thread, NULL);
+
+    pthread_cond_destroy(&maint->cond);
+    pthread_mutex_destroy(&maint->mutex);
+    free(maint);
+    pool_mgr->maint = NULL;
+}
+
+/*
+ * Function Name: _mem_maint_purge
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t min_bytes
+ * Return Type: size_t
+ * Purpose: This function hands the whole pages inside the gaps of a pool,
+ * or of each of its shards, back to the kernel, for gaps with at least
+ * min_bytes of them. The pages read as zeros, or as the memfd contents,
+ * when they are next used. Returns the bytes purged.
+ */
+static size_t _mem_maint_purge(pool_mgr_pt pool_mgr, size_t min_bytes) {
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    /* A shared memfd keeps its pages unless they are removed from the file */
+    const int advice = (pool_mgr->mem_fd >= 0 && !pool_mgr->mem_private) ? MADV_REMOVE : MADV_DONTNEED;
+    pool_mgr_pt single[1] = {pool_mgr};
+    pool_mgr_pt *parts = (pool_mgr->flags & MEM_POOL_SHARDED) ? pool_mgr->shards : single;
+    const unsigned num_parts = (pool_mgr->flags & MEM_POOL_SHARDED) ? pool_mgr->num_shards : 1;
+    size_t purged = 0;
+
+    for (unsigned p = 0; p < num_parts; ++p){
+        pool_mgr_pt part = parts[p];
+        _mem_pool_lock(part);
+        for (unsigned i = 0; i < part->gap_ix_capacity; ++i){
+            const uintptr_t mem = (uintptr_t) part->gap_ix[i].node->alloc_record.mem;
+            const uintptr_t start = (mem + page - 1) & ~(page - 1);
+            const uintptr_t end = (mem + part->gap_ix[i].size) & ~(page - 1);
+            if (end > start && end - start >= min_bytes &&
+                madvise((void *) start, end - start, advice) == 0){
+                purged += end - start;
+            }
+        }
+        _mem_pool_unlock(part);
+    }
+
+    return purged;
+}
+
+/*
+ * Function Name: _mem_maint_changes
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: unsigned long
+ * Purpose: This function returns how many times a pool, or the shards of
+ * a sharded pool together, have changed their segments so far.
+ */
+static unsigned long _mem_maint_changes(pool_mgr_pt pool_mgr) {
+    pool_mgr_pt single[1] = {pool_mgr};
+    pool_mgr_pt *parts = (pool_mgr->flags & MEM_POOL_SHARDED) ? pool_mgr->shards : single;
+    const unsigned num_parts = (pool_mgr->flags & MEM_POOL_SHARDED) ? pool_mgr->num_shards : 1;
+    unsigned long changes = 0;
+
+    for (unsigned p = 0; p < num_parts; ++p){
+        _mem_pool_lock(parts[p]);
+        changes += parts[p]->changes;
+        _mem_pool_unlock(parts[p]);
+    }
+
+    return changes;
+}
+
+/*
+ * Function Name: _mem_quick_bin
+ * Passed Variables: size_t size
+ * Return Type: unsigned
+ * Purpose: This function returns the quick list that parked blocks of the
+ * passed size go on. Sizes are hashed, so that the usual multiples of
+ * powers of two spread over all the lists.
+ */
+static unsigned _mem_quick_bin(size_t size) {
+    return (unsigned) ((size * 2654435761u) >> 16) % MEM_QUICK_NUM_BINS;
+}
+
+/*
+ * Function Name: _mem_unlink_free_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: This function takes a gap out of the gap index, or, if it is a
+ * parked block, just out of the gap count. The quick lists are dropped as
+ * a whole by _mem_coalesce.
+ */
+static void _mem_unlink_free_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    if (node->parked){
+        node->parked = 0;
+        node->remote_next = NULL;
+        pool_mgr->pool.num_gaps--;
+        _mem_stats_remove_gap(pool_mgr, node->alloc_record.size);
+    } else if (_mem_remove_from_gap_ix(pool_mgr, 0, node) != ALLOC_OK){
+        exit(0);
+    }
+}
+
+/*
+ * Function Name: _mem_coalesce
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: unsigned
+ * Purpose: This function does the work of mem_pool_coalesce on one pool
+ * with the pool lock (if any) held. The quick lists are emptied, and one
+ * walk of the segments merges every run of neighbouring gaps into the
+ * first gap of the run, which goes into the gap index. Returns the number
+ * of parked blocks merged.
+ */
+static unsigned _mem_coalesce(pool_mgr_pt pool_mgr) {
+    const unsigned parked = pool_mgr->num_parked;
+    if (parked == 0){
+        return 0;
+    }
+    memset(pool_mgr->quick_bins, 0, sizeof(pool_mgr->quick_bins));
+    pool_mgr->num_parked = 0;
+    pool_mgr->changes++;
+
+    node_pt node = pool_mgr->node_list;
+    while (node != NULL){
+        if (node->allocated){
+            node = node->next;
+            continue;
+        }
+        _mem_unlink_free_gap(pool_mgr, node);
+        size_t size = node->alloc_record.size;
+        node_pt next = node->next;
+        while (next != NULL && !next->allocated){
+            _mem_unlink_free_gap(pool_mgr, next);
+            size += next->alloc_record.size;
+            _mem_profile_count(PROFILE_MERGES, 1);
+            node->next = next->next;
+            if (node->next != NULL){
+                node->next->prev = node;
+            }
+            _mem_release_node(pool_mgr, next);
+            pool_mgr->used_nodes--;
+            next = node->next;
+        }
+        if (_mem_add_to_gap_ix(pool_mgr, size, node) != ALLOC_OK){
+            exit(0);
+        }
+        node = next;
+    }
+
+    return parked;
+}
+
+/*
+ * Function Name: _mem_profile_rec_acquire
+ * Passed Variables: None
+ * Return Type: profile_rec_pt
+ * Purpose: This function gives the calling thread a record of profiling
+ * counters, taking one that an exited thread left behind if there is one.
+ * The counters go on from where the exited thread left them, so the sums
+ * still hold. Records are never freed.
+ */
+static profile_rec_pt _mem_profile_rec_acquire() {
+    pthread_once(&profile_key_once, _mem_profile_make_key);
+    profile_rec_pt rec;
+    for (rec = atomic_load(&profile_recs); rec != NULL; rec = rec->next){
+        int free_rec = 0;
+        if (atomic_load_explicit(&rec->in_use, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&rec->in_use, &free_rec, 1)){
+            break;
+        }
+    }
+    if (rec == NULL){
+        rec = calloc(1, sizeof(profile_rec_t));
+        assert(rec);
+        atomic_init(&rec->in_use, 1);
+        rec->next = atomic_load(&profile_recs);
+        while (!atomic_compare_exchange_weak(&profile_recs, &rec->next, rec)){
+        }
+    }
+    pthread_setspecific(profile_key, rec);
+    return rec;
+}
+
+/*
+ * Function Name: _mem_profile_make_key
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function creates the thread-specific key whose destructor
+ * hands a thread's profiling record back when the thread exits.
+ */
+static void _mem_profile_make_key() {
+    pthread_key_create(&profile_key, _mem_profile_thread_exit);
+}
+
+/*
+ * Function Name: _mem_profile_thread_exit
+ * Passed Variables: void *rec
+ * Return Type: void
+ * Purpose: This function runs when a thread with a profiling record
+ * exits. The record is marked free for the next thread to take.
+ */
+static void _mem_profile_thread_exit(void *rec) {
+    profile_rec_pt profile_rec = rec;
+    atomic_store(&profile_rec->in_use, 0);
+    thread_profile_rec = NULL;
+}
+
+/*
+ * Function Name: _mem_profile_sum
+ * Passed Variables: mem_profile_pt profile
+ * Return Type: void
+ * Purpose: This function adds up the counters of every thread's record.
+ */
+static void _mem_profile_sum(mem_profile_pt profile) {
+    memset(profile, 0, sizeof(mem_profile_t));
+    for (profile_rec_pt rec = atomic_load(&profile_recs); rec != NULL; rec = rec->next){
+        for (unsigned op = 0; op < MEM_PROFILE_NUM_OPS; ++op){
+            profile->calls[op] += atomic_load_explicit(&rec->calls[op], memory_order_relaxed);
+            profile->total_ns[op] += atomic_load_explicit(&rec->total_ns[op], memory_order_relaxed);
+            for (unsigned b = 0; b < MEM_PROFILE_NUM_BUCKETS; ++b){
+                profile->latency_histogram[op][b] +=
+                        atomic_load_explicit(&rec->latency_histogram[op][b], memory_order_relaxed);
+            }
+        }
+        profile->searches += atomic_load_explicit(&rec->counters[PROFILE_SEARCHES], memory_order_relaxed);
+        profile->search_steps += atomic_load_explicit(&rec->counters[PROFILE_SEARCH_STEPS], memory_order_relaxed);
+        profile->splits += atomic_load_explicit(&rec->counters[PROFILE_SPLITS], memory_order_relaxed);
+        profile->merges += atomic_load_explicit(&rec->counters[PROFILE_MERGES], memory_order_relaxed);
+        profile->quick_hits += atomic_load_explicit(&rec->counters[PROFILE_QUICK_HITS], memory_order_relaxed);
+        profile->node_heap_resizes +=
+                atomic_load_explicit(&rec->counters[PROFILE_NODE_HEAP_RESIZES], memory_order_relaxed);
+        profile->gap_ix_resizes += atomic_load_explicit(&rec->counters[PROFILE_GAP_IX_RESIZES], memory_order_relaxed);
+    }
+}
+
+/*
+ * Function Name: _mem_profile_add
+ * Passed Variables: atomic_ulong *counter, unsigned long n
+ * Return Type: void
+ * Purpose: This function adds n to a counter of the calling thread's
+ * record. No other thread writes it, so there is no need for an atomic
+ * read-modify-write.
+ */
+static inline void _mem_profile_add(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/*
+ * Function Name: _mem_profile_count
+ * Passed Variables: profile_counter counter, unsigned long n
+ * Return Type: void
+ * Purpose: This function adds n to one of the calling thread's operation
+ * counters if profiling is on.
+ */
+static inline void _mem_profile_count(profile_counter counter, unsigned long n) {
+    if (!atomic_load_explicit(&profile_enabled, memory_order_relaxed)){
+        return;
+    }
+    if (thread_profile_rec == NULL){
+        thread_profile_rec = _mem_profile_rec_acquire();
+    }
+    _mem_profile_add(&thread_profile_rec->counters[counter], n);
+}
+
+/*
+ * Function Name: _mem_profile_start
+ * Passed Variables: None
+ * Return Type: uint64_t
+ * Purpose: This function returns the monotonic clock in nanoseconds if
+ * profiling is on, and 0 if it is off.
+ */
+static inline uint64_t _mem_profile_start() {
+    if (!atomic_load_explicit(&profile_enabled, memory_order_relaxed)){
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * Function Name: _mem_profile_stop
+ * Passed Variables: mem_op op, uint64_t start
+ * Return Type: void
+ * Purpose: This function counts a call of the passed operation that began
+ * at start, and puts its latency into the histogram bucket of its power
+ * of two of nanoseconds. Does nothing if profiling was off at the start.
+ */
+static void _mem_profile_stop(mem_op op, uint64_t start) {
+    if (start == 0){
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec - start;
+    unsigned bucket = (ns <= 1) ? 0 : 63 - __builtin_clzll((unsigned long long) ns);
+    if (bucket >= MEM_PROFILE_NUM_BUCKETS){
+        bucket = MEM_PROFILE_NUM_BUCKETS - 1;
+    }
+    if (thread_profile_rec == NULL){
+        thread_profile_rec = _mem_profile_rec_acquire();
+    }
+    _mem_profile_add(&thread_profile_rec->calls[op], 1);
+    _mem_profile_add(&thread_profile_rec->total_ns[op], ns);
+    _mem_profile_add(&thread_profile_rec->latency_histogram[op][bucket], 1);
+}
@@ -7,10 +7,23 @@
 
 #include <stddef.h>
 
+#define POOL_STATS_NUM_BUCKETS 32
+#define MEM_PROFILE_NUM_OPS 3
+#define MEM_PROFILE_NUM_BUCKETS 32
+
 /* type declarations */
 
 typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
 
+typedef enum _pool_flag {
+    POOL_DEFAULT       = 0x0,
+    POOL_CLONEABLE     = 0x1, // back the pool memory with a memfd so clones share pages
+    POOL_LOCKED        = 0x2, // lock the pool internally so threads can share it
+    POOL_THREAD_CACHE  = 0x4, // serve small allocations from per-thread caches (implies POOL_LOCKED)
+    POOL_REMOTE_FREE   = 0x8, // queue deallocations from threads other than the opening one
+    POOL_LAZY_COALESCE = 0x10 // park freed blocks on per-size lists and merge gaps later
+} pool_flag;
+
 typedef struct _pool {
     char *mem;
     alloc_policy policy;
@@ -30,6 +43,60 @@ typedef struct _pool_segment {
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+typedef struct _compact_progress {
+    size_t step_bytes;  // bytes moved by the last step
+    size_t total_bytes; // bytes moved by compaction since the pool was opened
+    size_t free_bytes;
+    size_t largest_gap; // free_bytes == largest_gap when there is nothing left to do
+    unsigned num_gaps;
+    int done;           // 1 once a pass has pushed every movable allocation down
+} compact_progress_t, *compact_progress_pt;
+
+typedef struct _maintenance_config {
+    unsigned interval_ms;   // how often the background thread wakes up
+    unsigned max_gaps;      // compact while the pool has more gaps, 0 for no limit
+    double min_gap_ratio;   // compact while largest gap / free bytes is lower, 0 for no limit
+    size_t compact_budget;  // bytes per compaction step, 0 to never compact; moves unpinned
+                            // allocations while other threads run, so pin what they touch
+    size_t purge_min_bytes; // purge the pages of gaps with at least this many, 0 to never purge
+} maintenance_config_t, *maintenance_config_pt;
+
+typedef struct _maintenance_stats {
+    unsigned long wakeups;
+    unsigned long compact_steps;
+    size_t compacted_bytes;
+    size_t purged_bytes;
+    unsigned long reclaimed; // deferred deallocations released
+    unsigned long coalesced; // parked blocks merged into the gaps
+} maintenance_stats_t, *maintenance_stats_pt;
+
+typedef struct _pool_stats {
+    size_t total_size;
+    size_t alloc_size;
+    size_t free_bytes;
+    size_t largest_gap;   // an allocation of up to this size succeeds
+    unsigned num_allocs;
+    unsigned num_gaps;
+    double fragmentation; // 1 - largest_gap / free_bytes, 0 without free space
+    size_t metadata_bytes; // the pool's manager, node heap and gap index
+    unsigned gap_histogram[POOL_STATS_NUM_BUCKETS]; // gaps of 2^i to 2^(i+1)-1 bytes, the last takes the rest
+} pool_stats_t, *pool_stats_pt;
+
+typedef enum _mem_op { MEM_OP_NEW_ALLOC, MEM_OP_DEL_ALLOC, MEM_OP_POOL_OPEN } mem_op;
+
+typedef struct _mem_profile {
+    unsigned long calls[MEM_PROFILE_NUM_OPS];      // by mem_op
+    unsigned long total_ns[MEM_PROFILE_NUM_OPS];
+    unsigned long latency_histogram[MEM_PROFILE_NUM_OPS][MEM_PROFILE_NUM_BUCKETS]; // calls of 2^i to 2^(i+1)-1 ns
+    unsigned long searches;      // allocations that looked for a gap
+    unsigned long search_steps;  // gaps or segments looked at by those
+    unsigned long splits;        // gaps split by an allocation
+    unsigned long merges;        // gaps merged with a neighbour
+    unsigned long quick_hits;    // allocations served by a parked block
+    unsigned long node_heap_resizes;
+    unsigned long gap_ix_resizes;
+} mem_profile_t, *mem_profile_pt;
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
@@ -48,15 +115,96 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_pool_open_ex(size_t size, alloc_policy policy, unsigned flags);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
+pool_pt
+mem_pool_open_sharded(size_t size, alloc_policy policy, unsigned num_shards, unsigned flags);
+
+pool_pt
+mem_pool_open_partitioned(size_t size, alloc_policy policy, unsigned num_regions);
+
+pool_pt
+mem_pool_open_fixed(size_t block_size, unsigned num_blocks, unsigned flags);
+
+pool_pt
+mem_pool_clone(pool_pt pool);
+
+alloc_pt
+mem_pool_clone_alloc(pool_pt clone, pool_pt pool, alloc_pt alloc);
+
 alloc_pt
 mem_new_alloc(pool_pt pool, size_t size);
 
 alloc_status
 mem_del_alloc(pool_pt pool, alloc_pt alloc);
 
+char *
+mem_fixed_alloc(pool_pt pool);
+
+alloc_status
+mem_fixed_free(pool_pt pool, char *block);
+
+alloc_status
+mem_pool_flush_thread_cache(pool_pt pool);
+
+alloc_status
+mem_pool_lock(pool_pt pool);
+
+alloc_status
+mem_pool_unlock(pool_pt pool);
+
+void
+mem_epoch_enter();
+
+void
+mem_epoch_exit();
+
+alloc_status
+mem_del_alloc_deferred(pool_pt pool, alloc_pt alloc);
+
+unsigned
+mem_pool_reclaim(pool_pt pool);
+
+unsigned
+mem_pool_coalesce(pool_pt pool);
+
+alloc_status
+mem_pin_alloc(pool_pt pool, alloc_pt alloc);
+
+alloc_status
+mem_unpin_alloc(pool_pt pool, alloc_pt alloc);
+
+alloc_status
+mem_pool_compact(pool_pt pool);
+
+alloc_status
+mem_pool_compact_step(pool_pt pool, size_t budget, compact_progress_pt progress);
+
+alloc_status
+mem_pool_start_maintenance(pool_pt pool, const maintenance_config_t *config);
+
+alloc_status
+mem_pool_stop_maintenance(pool_pt pool);
+
+alloc_status
+mem_pool_maintenance_stats(pool_pt pool, maintenance_stats_pt stats);
+
+alloc_status
+mem_pool_stats(pool_pt pool, pool_stats_pt stats);
+
+void
+mem_profile_enable(int enable);
+
+void
+mem_profile_read(mem_profile_pt profile);
+
+void
+mem_profile_reset();
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 
@@ -0,0 +1,485 @@
+/*
+ * A malloc replacement backed by the pools, to run unmodified programs on
+ * them with LD_PRELOAD:
+ *
+ *   LD_PRELOAD=./libmem_preload.so MEM_PRELOAD_STATS=1 program args...
+ *
+ * It serves malloc, free, calloc, realloc, posix_memalign, aligned_alloc,
+ * memalign and malloc_usable_size from a growing list of pools. It is set
+ * up from the environment on the first call:
+ *
+ *   MEM_PRELOAD_POLICY     first-fit or best-fit (first-fit)
+ *   MEM_PRELOAD_POOL_SIZE  bytes of the first pool (64 MiB)
+ *   MEM_PRELOAD_GROWTH     how many times larger each further pool is (2)
+ *   MEM_PRELOAD_FLAGS      mem_pool_open_ex flags of the pools; POOL_LOCKED
+ *                          is always added (0)
+ *   MEM_PRELOAD_STATS      1 to print the pools and calls at exit
+ *
+ * An allocation is taken from the newest pool that has room, and a pool
+ * at least large enough for it is opened when none does, up to
+ * MEM_PRELOAD_MAX_POOLS pools. The pools are never closed. Every block
+ * starts MEM_PRELOAD_HEADER bytes after its allocation, which is stored
+ * right in front of it, and free finds the block's pool by address.
+ *
+ * The allocator's own bookkeeping, and memory asked for while it runs, come
+ * from glibc, as do blocks of pointers the pools did not hand out, such as
+ * those from valloc. So do the allocations of a thread that is exiting:
+ * the destructor of a pool's thread caches runs the allocator without
+ * going through here, and must not end up waiting on the cache it holds.
+ * This relies on glibc running the destructors of thread-specific data in
+ * the order of their keys, the shim's key being made first. Around a
+ * fork, the forking thread holds preload_mutex and every pool's lock, so
+ * the child gets the pools in a consistent state even if other threads
+ * were in the allocator; what it allocates meanwhile, such as in other
+ * fork handlers, comes from glibc.
+ */
+
+#define _GNU_SOURCE // for RTLD_NEXT
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <malloc.h> // for memalign() and malloc_usable_size()
+
+#include "mem_pool.h"
+
+/* Constants */
+static const size_t     MEM_PRELOAD_HEADER          = 16; // keeps blocks 16-byte aligned
+static const size_t     MEM_PRELOAD_DEFAULT_SIZE    = 64 << 20;
+static const double     MEM_PRELOAD_DEFAULT_GROWTH  = 2.0;
+#define MEM_PRELOAD_MAX_POOLS 64
+
+
+
+/* glibc's own allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+
+
+/* Static global variables */
+static _Atomic(pool_pt) preload_pools[MEM_PRELOAD_MAX_POOLS]; // in the order they were opened
+static atomic_uint preload_num_pools = 0;
+static atomic_int preload_ready = 0;
+static pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER; // for setting up and growing
+static alloc_policy preload_policy = FIRST_FIT;
+static size_t preload_next_size = 0; // of the next pool to open
+static double preload_growth = 0.0;
+static unsigned preload_flags = POOL_LOCKED;
+static size_t (*preload_libc_usable_size)(void *ptr) = NULL;
+static atomic_ulong preload_allocs = 0;
+static atomic_ulong preload_frees = 0;
+static atomic_ulong preload_failures = 0;
+static atomic_ulong preload_libc_frees = 0; // of memory no pool has, glibc's own included
+static _Thread_local unsigned preload_depth = 0; // > 0 while the thread is in the allocator
+static _Thread_local int preload_thread_seen = 0;
+static pthread_key_t preload_exit_key;
+
+
+
+/* Forward declarations of static functions */
+static int _mem_preload_init();
+static void _mem_preload_report();
+static void _mem_preload_thread_exit(void *unused);
+static void _mem_preload_fork_prepare();
+static void _mem_preload_fork_release();
+static pool_pt _mem_preload_pool_of(const void *ptr);
+static pool_pt _mem_preload_open(size_t size);
+static alloc_pt _mem_preload_grow(size_t size, unsigned seen);
+static void *_mem_preload_alloc(size_t size, size_t alignment);
+
+
+
+/* Definitions of the interposed functions */
+
+/*
+ * Function Name: malloc
+ * Passed Variables: size_t size
+ * Return Type: void *
+ * Purpose: This function allocates a block from the pools, with glibc
+ * behind it while the allocator itself is running.
+ */
+void *malloc(size_t size) {
+    if (preload_depth > 0){
+        return __libc_malloc(size);
+    }
+    return _mem_preload_alloc(size, MEM_PRELOAD_HEADER);
+}
+
+/*
+ * Function Name: free
+ * Passed Variables: void *ptr
+ * Return Type: void
+ * Purpose: This function frees a block into its pool, or hands it to
+ * glibc if no pool has it.
+ */
+void free(void *ptr) {
+    if (ptr == NULL){
+        return;
+    }
+    pool_pt pool = _mem_preload_pool_of(ptr);
+    if (pool == NULL){
+        atomic_fetch_add_explicit(&preload_libc_frees, 1, memory_order_relaxed);
+        __libc_free(ptr);
+        return;
+    }
+    preload_depth++;
+    mem_del_alloc(pool, ((alloc_pt *) ptr)[-1]);
+    preload_depth--;
+    atomic_fetch_add_explicit(&preload_frees, 1, memory_order_relaxed);
+}
+
+/*
+ * Function Name: calloc
+ * Passed Variables: size_t count, size_t size
+ * Return Type: void *
+ * Purpose: This function allocates a zeroed block. The pools reuse their
+ * memory, so it is cleared here.
+ */
+void *calloc(size_t count, size_t size) {
+    if (preload_depth > 0){
+        return __libc_calloc(count, size);
+    }
+    if (size != 0 && count > SIZE_MAX / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = _mem_preload_alloc(count * size, MEM_PRELOAD_HEADER);
+    if (ptr != NULL){
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/*
+ * Function Name: realloc
+ * Passed Variables: void *ptr, size_t size
+ * Return Type: void *
+ * Purpose: This function resizes a block. A block that still has room is
+ * kept, others are moved to a new block. A size of 0 frees the block, as
+ * glibc does.
+ */
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL){
+        return malloc(size);
+    }
+    if (_mem_preload_pool_of(ptr) == NULL){
+        return __libc_realloc(ptr, size);
+    }
+    if (size == 0){
+        free(ptr);
+        return NULL;
+    }
+    const size_t usable = malloc_usable_size(ptr);
+    if (size <= usable){
+        return ptr;
+    }
+    void *moved = malloc(size);
+    if (moved != NULL){
+        memcpy(moved, ptr, usable);
+        free(ptr);
+    }
+    return moved;
+}
+
+/*
+ * Function Name: posix_memalign
+ * Passed Variables: void **ptr, size_t alignment, size_t size
+ * Return Type: int
+ * Purpose: This function allocates an aligned block. The alignment must
+ * be a power of two and a multiple of sizeof(void *).
+ */
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0){
+        return EINVAL;
+    }
+    void *block = (preload_depth > 0) ? __libc_memalign(alignment, size) :
+                  _mem_preload_alloc(size, (alignment < MEM_PRELOAD_HEADER) ? MEM_PRELOAD_HEADER : alignment);
+    if (block == NULL){
+        return ENOMEM;
+    }
+    *ptr = block;
+    return 0;
+}
+
+/*
+ * Function Name: aligned_alloc
+ * Passed Variables: size_t alignment, size_t size
+ * Return Type: void *
+ * Purpose: This function allocates an aligned block, see posix_memalign.
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    const int status = posix_memalign(&ptr, (alignment < sizeof(void *)) ? sizeof(void *) : alignment, size);
+    if (status != 0){
+        errno = status;
+        return NULL;
+    }
+    return ptr;
+}
+
+/*
+ * Function Name: memalign
+ * Passed Variables: size_t alignment, size_t size
+ * Return Type: void *
+ * Purpose: This function allocates an aligned block, see posix_memalign.
+ */
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+/*
+ * Function Name: malloc_usable_size
+ * Passed Variables: void *ptr
+ * Return Type: size_t
+ * Purpose: This function returns how many bytes of a block can be used,
+ * which is all of its allocation after it.
+ */
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL){
+        return 0;
+    }
+    if (_mem_preload_pool_of(ptr) == NULL){
+        return (preload_libc_usable_size != NULL) ? preload_libc_usable_size(ptr) : 0;
+    }
+    const alloc_t *alloc = ((alloc_pt *) ptr)[-1];
+    return (size_t) (alloc->mem + alloc->size - (char *) ptr);
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _mem_preload_init
+ * Passed Variables: none
+ * Return Type: int
+ * Purpose: This function reads the environment and opens the first pool,
+ * once. Returns 0 if that failed.
+ */
+static int _mem_preload_init() {
+    if (atomic_load(&preload_ready)){
+        return 1;
+    }
+    pthread_mutex_lock(&preload_mutex);
+    if (!atomic_load(&preload_ready)){
+        preload_depth++;
+        const char *policy = getenv("MEM_PRELOAD_POLICY");
+        const char *size = getenv("MEM_PRELOAD_POOL_SIZE");
+        const char *growth = getenv("MEM_PRELOAD_GROWTH");
+        const char *flags = getenv("MEM_PRELOAD_FLAGS");
+        const char *stats = getenv("MEM_PRELOAD_STATS");
+        preload_policy = (policy != NULL && strcmp(policy, "best-fit") == 0) ? BEST_FIT : FIRST_FIT;
+        preload_next_size = (size != NULL) ? strtoull(size, NULL, 0) : MEM_PRELOAD_DEFAULT_SIZE;
+        preload_next_size = (preload_next_size < 4096) ? 4096 : preload_next_size;
+        preload_growth = (growth != NULL) ? strtod(growth, NULL) : MEM_PRELOAD_DEFAULT_GROWTH;
+        preload_growth = (preload_growth < 1.0) ? 1.0 : preload_growth;
+        preload_flags = POOL_LOCKED | ((flags != NULL) ? (unsigned) strtoul(flags, NULL, 0) : 0);
+        *(void **) &preload_libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+
+        if (pthread_key_create(&preload_exit_key, _mem_preload_thread_exit) == 0 &&
+            pthread_atfork(_mem_preload_fork_prepare, _mem_preload_fork_release,
+                           _mem_preload_fork_release) == 0 &&
+            mem_init() != ALLOC_FAIL && _mem_preload_open(0) != NULL){
+            atomic_store(&preload_ready, 1);
+            if (stats != NULL && strcmp(stats, "1") == 0){
+                atexit(_mem_preload_report);
+            }
+        }
+        preload_depth--;
+    }
+    pthread_mutex_unlock(&preload_mutex);
+    return atomic_load(&preload_ready);
+}
+
+/*
+ * Function Name: _mem_preload_report
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function prints the calls and every pool's statistics to
+ * stderr. The frees passed to glibc are all those of memory no pool has:
+ * glibc's frees of its own memory and the shim's bookkeeping as well as
+ * the program's pointers from elsewhere, so it is no count of foreign
+ * pointers.
+ */
+static void _mem_preload_report() {
+    preload_depth++;
+    fprintf(stderr, "mem_preload: %lu allocations, %lu frees, %lu failed, %lu frees passed to glibc\n",
+            atomic_load(&preload_allocs), atomic_load(&preload_frees), atomic_load(&preload_failures),
+            atomic_load(&preload_libc_frees));
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    for (unsigned i = 0; i < num_pools; ++i){
+        pool_stats_t stats;
+        if (mem_pool_stats(atomic_load(&preload_pools[i]), &stats) == ALLOC_OK){
+            fprintf(stderr, "mem_preload: pool %u: %zu bytes, %zu allocated in %u allocations, %u gaps, "
+                            "largest %zu, fragmentation %.3f, metadata %zu bytes\n",
+                    i, stats.total_size, stats.alloc_size, stats.num_allocs, stats.num_gaps,
+                    stats.largest_gap, stats.fragmentation, stats.metadata_bytes);
+        }
+    }
+    preload_depth--;
+}
+
+/*
+ * Function Name: _mem_preload_thread_exit
+ * Passed Variables: void *unused
+ * Return Type: void
+ * Purpose: This function runs first when a thread that allocated exits,
+ * and sends the rest of the thread's allocations to glibc.
+ */
+static void _mem_preload_thread_exit(void *unused) {
+    (void) unused;
+    preload_depth = 1;
+}
+
+/*
+ * Function Name: _mem_preload_fork_prepare
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function runs before a fork, and takes preload_mutex and
+ * then every pool's lock, in the order _mem_preload_grow takes them, so
+ * no other thread is in the allocator when the process is copied.
+ */
+static void _mem_preload_fork_prepare() {
+    pthread_mutex_lock(&preload_mutex);
+    preload_depth++;
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    for (unsigned i = 0; i < num_pools; ++i){
+        mem_pool_lock(atomic_load(&preload_pools[i]));
+    }
+}
+
+/*
+ * Function Name: _mem_preload_fork_release
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function runs after a fork, in the parent and in the
+ * child, and releases what _mem_preload_fork_prepare took.
+ */
+static void _mem_preload_fork_release() {
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    for (unsigned i = num_pools; i > 0; --i){
+        mem_pool_unlock(atomic_load(&preload_pools[i - 1]));
+    }
+    preload_depth--;
+    pthread_mutex_unlock(&preload_mutex);
+}
+
+/*
+ * Function Name: _mem_preload_pool_of
+ * Passed Variables: const void *ptr
+ * Return Type: pool_pt
+ * Purpose: This function returns the pool whose memory a pointer is in,
+ * or NULL if it is in none.
+ */
+static pool_pt _mem_preload_pool_of(const void *ptr) {
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    for (unsigned i = 0; i < num_pools; ++i){
+        pool_pt pool = atomic_load(&preload_pools[i]);
+        if ((const char *) ptr >= pool->mem && (const char *) ptr < pool->mem + pool->total_size){
+            return pool;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_preload_open
+ * Passed Variables: size_t size
+ * Return Type: pool_pt
+ * Purpose: This function opens the next pool, at least large enough for
+ * an allocation of the passed size, and adds it to the list. The caller
+ * holds preload_mutex. Returns NULL if there can be no more pools or the
+ * pool cannot be opened.
+ */
+static pool_pt _mem_preload_open(size_t size) {
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    if (num_pools == MEM_PRELOAD_MAX_POOLS){
+        return NULL;
+    }
+    // in whole 16-byte blocks, see _mem_preload_alloc
+    const size_t pool_size = ((size > preload_next_size) ? size : preload_next_size) & ~(size_t) 15;
+    pool_pt pool = mem_pool_open_ex(pool_size, preload_policy, preload_flags);
+    if (pool != NULL){
+        atomic_store(&preload_pools[num_pools], pool);
+        atomic_store(&preload_num_pools, num_pools + 1);
+        preload_next_size = (size_t) (pool_size * preload_growth);
+    }
+    return pool;
+}
+
+/*
+ * Function Name: _mem_preload_grow
+ * Passed Variables: size_t size, unsigned seen
+ * Return Type: alloc_pt
+ * Purpose: This function makes an allocation after none of the first
+ * seen pools had room for it. It first tries the pools other threads
+ * opened in the meantime, then opens a pool for it. Returns NULL if that
+ * fails.
+ */
+static alloc_pt _mem_preload_grow(size_t size, unsigned seen) {
+    pthread_mutex_lock(&preload_mutex);
+    alloc_pt alloc = NULL;
+    for (unsigned i = atomic_load(&preload_num_pools); alloc == NULL && i > seen; --i){
+        alloc = mem_new_alloc(atomic_load(&preload_pools[i - 1]), size);
+    }
+    if (alloc == NULL){
+        pool_pt pool = _mem_preload_open(size);
+        alloc = (pool != NULL) ? mem_new_alloc(pool, size) : NULL;
+    }
+    pthread_mutex_unlock(&preload_mutex);
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_preload_alloc
+ * Passed Variables: size_t size, size_t alignment
+ * Return Type: void *
+ * Purpose: This function allocates a block with the passed alignment, at
+ * least MEM_PRELOAD_HEADER, from the newest pool with room for it. The
+ * pool memory and every allocation are in whole 16-byte blocks, so an
+ * allocation has room for the header and block at any alignment up to
+ * MEM_PRELOAD_HEADER; a larger alignment needs that much more. Returns
+ * NULL and sets errno if out of memory.
+ */
+static void *_mem_preload_alloc(size_t size, size_t alignment) {
+    const size_t extra = alignment; // the header, and the padding to align the block past it
+    if (size > SIZE_MAX - extra - 15 || !_mem_preload_init()){
+        errno = ENOMEM;
+        return NULL;
+    }
+    const size_t request = ((size + 15) & ~(size_t) 15) + extra;
+
+    preload_depth++;
+    if (!preload_thread_seen){
+        preload_thread_seen = 1;
+        pthread_setspecific(preload_exit_key, &preload_thread_seen);
+    }
+    alloc_pt alloc = NULL;
+    const unsigned num_pools = atomic_load(&preload_num_pools);
+    for (unsigned i = num_pools; alloc == NULL && i > 0; --i){
+        alloc = mem_new_alloc(atomic_load(&preload_pools[i - 1]), request);
+    }
+    if (alloc == NULL){
+        alloc = _mem_preload_grow(request, num_pools);
+    }
+    preload_depth--;
+    if (alloc == NULL){
+        atomic_fetch_add_explicit(&preload_failures, 1, memory_order_relaxed);
+        errno = ENOMEM;
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&preload_allocs, 1, memory_order_relaxed);
+
+    char *block = (char *) (((uintptr_t) alloc->mem + MEM_PRELOAD_HEADER + alignment - 1) & ~(alignment - 1));
+    ((alloc_pt *) block)[-1] = alloc;
+    return block;
+}
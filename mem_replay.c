@@ -0,0 +1,588 @@
+/*
+ * Replays a trace written by mem_trace_start against every allocation
+ * policy and reports how each did.
+ *
+ * usage: mem_replay [-s samples] [-x flags] trace_file
+ *
+ *   -s samples  how many times to sample the pools during a replay (20)
+ *   -x flags    pool_flag bits to add to every pool, e.g. 0x10 for
+ *               POOL_LAZY_COALESCE
+ *
+ * The records are put in time order and replayed on one thread, so a
+ * trace of several threads is replayed as the interleaving it recorded.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt()
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem_pool.h"
+#include "mem_trace.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const unsigned   REPLAY_DEFAULT_SAMPLES  = 20;
+static const size_t     REPLAY_TABLE_MIN_SIZE   = 1024; // live allocations table, a power of two
+static const double     REPLAY_PERCENTILES[]    = {50.0, 90.0, 99.0, 99.9};
+#define REPLAY_NUM_PERCENTILES (sizeof(REPLAY_PERCENTILES) / sizeof(REPLAY_PERCENTILES[0]))
+
+
+
+/* Type declarations */
+
+typedef struct _replay_order {
+    uint64_t time_ns;
+    size_t index; // breaks ties in file order, which is a thread's own order
+} replay_order_t, *replay_order_pt;
+
+typedef struct _replay_slot {
+    uint64_t handle; // 0 for an empty slot
+    uint32_t pool;
+    alloc_pt alloc;
+} replay_slot_t, *replay_slot_pt;
+
+/* the allocations live in the replay, by their handle in the trace */
+typedef struct _replay_table {
+    replay_slot_pt slots;
+    size_t capacity;
+    size_t count;
+} replay_table_t, *replay_table_pt;
+
+typedef struct _replay_result {
+    const char *name;
+    unsigned long ops;
+    unsigned long failed_allocs;  // failed in the replay
+    unsigned long trace_failures; // failed when the trace was recorded
+    unsigned long failed_opens;
+    unsigned long skipped;        // the operations of pools or allocations that failed
+    uint64_t wall_ns;
+    bench_latency_t alloc_latency;
+    bench_latency_t free_latency;
+    unsigned long nodes;          // allocations and gaps of the open pools
+    unsigned long gaps;
+    unsigned long peak_nodes;
+    unsigned long peak_gaps;
+    size_t alloc_size;
+    size_t peak_alloc_size;
+} replay_result_t, *replay_result_pt;
+
+typedef struct _replay_policy {
+    alloc_policy policy;
+    const char *name;
+} replay_policy_t;
+
+static const replay_policy_t REPLAY_POLICIES[] = {
+        {FIRST_FIT, "first-fit"},
+        {BEST_FIT,  "best-fit"}
+};
+#define REPLAY_NUM_POLICIES (sizeof(REPLAY_POLICIES) / sizeof(REPLAY_POLICIES[0]))
+
+
+
+/* Forward declarations of static functions */
+static const mem_trace_record_t *_replay_map(const char *path, size_t *num_records, size_t *map_size);
+static replay_order_pt _replay_sort(const mem_trace_record_t *records, size_t num_records);
+static int _replay_order_cmp(const void *a, const void *b);
+static int _replay_table_put(replay_table_pt table, uint64_t handle, uint32_t pool, alloc_pt alloc);
+static replay_slot_pt _replay_table_find(replay_table_pt table, uint64_t handle);
+static void _replay_table_remove(replay_table_pt table, replay_slot_pt slot);
+static void _replay_close_pool(replay_table_pt table, pool_pt *pools, uint32_t pool);
+static void _replay_account(replay_result_pt result, const pool_t *pool, unsigned long nodes,
+                            unsigned long gaps, size_t alloc_size);
+static void _replay_sample(pool_pt *pools, uint32_t num_pools, unsigned long ops);
+static void _replay_run(const mem_trace_record_t *records, const replay_order_t *order,
+                        size_t num_records, alloc_policy policy, unsigned extra_flags,
+                        unsigned samples, replay_result_pt result);
+static void _replay_report(const replay_result_t *results, unsigned num_results);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    unsigned samples = REPLAY_DEFAULT_SAMPLES;
+    unsigned extra_flags = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:x:")) != -1){
+        switch (opt){
+            case 's':
+                samples = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                extra_flags = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s samples] [-x flags] trace_file\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1){
+        fprintf(stderr, "usage: %s [-s samples] [-x flags] trace_file\n", argv[0]);
+        return 2;
+    }
+
+    size_t num_records, map_size;
+    const mem_trace_record_t *records = _replay_map(argv[optind], &num_records, &map_size);
+    if (records == NULL){
+        return 1;
+    }
+    replay_order_pt order = _replay_sort(records, num_records);
+    if (order == NULL){
+        perror("mem_replay");
+        return 1;
+    }
+    printf("%s: %zu records\n", argv[optind], num_records);
+
+    replay_result_t results[REPLAY_NUM_POLICIES];
+    for (unsigned p = 0; p < REPLAY_NUM_POLICIES; ++p){
+        memset(&results[p], 0, sizeof(replay_result_t));
+        results[p].name = REPLAY_POLICIES[p].name;
+        printf("\n%s\n", REPLAY_POLICIES[p].name);
+        _replay_run(records, order, num_records, REPLAY_POLICIES[p].policy, extra_flags,
+                    samples, &results[p]);
+    }
+    _replay_report(results, REPLAY_NUM_POLICIES);
+
+    free(order);
+    munmap((void *) ((const char *) records - sizeof(mem_trace_header_t)), map_size);
+    return 0;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _replay_map
+ * Passed Variables: const char *path, size_t *num_records, size_t *map_size
+ * Return Type: const mem_trace_record_t *
+ * Purpose: This function maps a trace file and checks its header. Returns
+ * the records, in place in the mapping, or NULL after printing what is
+ * wrong with the file. A partly written last record is left out.
+ */
+static const mem_trace_record_t *_replay_map(const char *path, size_t *num_records, size_t *map_size) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(mem_trace_header_t)){
+        fprintf(stderr, "%s: not a trace\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        perror(path);
+        return NULL;
+    }
+
+    const mem_trace_header_t *header = map;
+    if (memcmp(header->magic, MEM_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MEM_TRACE_VERSION || header->record_size != sizeof(mem_trace_record_t)){
+        fprintf(stderr, "%s: not a version %d trace\n", path, MEM_TRACE_VERSION);
+        munmap(map, (size_t) st.st_size);
+        return NULL;
+    }
+
+    *map_size = (size_t) st.st_size;
+    *num_records = (*map_size - sizeof(mem_trace_header_t)) / sizeof(mem_trace_record_t);
+    return (const mem_trace_record_t *) (header + 1);
+}
+
+/*
+ * Function Name: _replay_sort
+ * Passed Variables: const mem_trace_record_t *records, size_t num_records
+ * Return Type: replay_order_pt
+ * Purpose: This function returns the order to replay the records in: by
+ * time, and in file order for equal times. Returns NULL if out of memory.
+ */
+static replay_order_pt _replay_sort(const mem_trace_record_t *records, size_t num_records) {
+    replay_order_pt order = malloc((num_records + 1) * sizeof(replay_order_t));
+    if (order == NULL){
+        return NULL;
+    }
+    for (size_t i = 0; i < num_records; ++i){
+        order[i].time_ns = records[i].time_ns;
+        order[i].index = i;
+    }
+    qsort(order, num_records, sizeof(replay_order_t), _replay_order_cmp);
+    return order;
+}
+
+/*
+ * Function Name: _replay_order_cmp
+ * Passed Variables: const void *a, const void *b
+ * Return Type: int
+ * Purpose: This function is the qsort comparator of _replay_sort.
+ */
+static int _replay_order_cmp(const void *a, const void *b) {
+    const replay_order_t *order_a = a;
+    const replay_order_t *order_b = b;
+    if (order_a->time_ns != order_b->time_ns){
+        return (order_a->time_ns < order_b->time_ns) ? -1 : 1;
+    }
+    return (order_a->index < order_b->index) ? -1 : (order_a->index > order_b->index);
+}
+
+/*
+ * Function Name: _replay_table_put
+ * Passed Variables: replay_table_pt table, uint64_t handle, uint32_t pool, alloc_pt alloc
+ * Return Type: int
+ * Purpose: This function adds a live allocation to the table, which is
+ * kept at most half full. Returns 0 if the table cannot grow.
+ */
+static int _replay_table_put(replay_table_pt table, uint64_t handle, uint32_t pool, alloc_pt alloc) {
+    if ((table->count + 1) * 2 > table->capacity){
+        const size_t capacity = (table->capacity == 0) ? REPLAY_TABLE_MIN_SIZE : table->capacity * 2;
+        replay_slot_pt slots = calloc(capacity, sizeof(replay_slot_t));
+        if (slots == NULL){
+            return 0;
+        }
+        for (size_t i = 0; i < table->capacity; ++i){
+            if (table->slots[i].handle != 0){
+                size_t s = table->slots[i].handle & (capacity - 1);
+                while (slots[s].handle != 0){
+                    s = (s + 1) & (capacity - 1);
+                }
+                slots[s] = table->slots[i];
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    size_t s = handle & (table->capacity - 1);
+    while (table->slots[s].handle != 0){
+        s = (s + 1) & (table->capacity - 1);
+    }
+    table->slots[s].handle = handle;
+    table->slots[s].pool = pool;
+    table->slots[s].alloc = alloc;
+    table->count++;
+    return 1;
+}
+
+/*
+ * Function Name: _replay_table_find
+ * Passed Variables: replay_table_pt table, uint64_t handle
+ * Return Type: replay_slot_pt
+ * Purpose: This function returns the slot of a live allocation, or NULL.
+ */
+static replay_slot_pt _replay_table_find(replay_table_pt table, uint64_t handle) {
+    if (table->count == 0){
+        return NULL;
+    }
+    size_t s = handle & (table->capacity - 1);
+    while (table->slots[s].handle != 0){
+        if (table->slots[s].handle == handle){
+            return &table->slots[s];
+        }
+        s = (s + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _replay_table_remove
+ * Passed Variables: replay_table_pt table, replay_slot_pt slot
+ * Return Type: void
+ * Purpose: This function empties a slot, shifting back the entries after
+ * it that were pushed past it so that every entry stays findable.
+ */
+static void _replay_table_remove(replay_table_pt table, replay_slot_pt slot) {
+    const size_t mask = table->capacity - 1;
+    size_t hole = (size_t) (slot - table->slots);
+    size_t s = hole;
+    for (;;){
+        s = (s + 1) & mask;
+        if (table->slots[s].handle == 0){
+            break;
+        }
+        const size_t home = table->slots[s].handle & mask;
+        /* the entry may fill the hole if its home is not between the hole and it */
+        if (((s - home) & mask) >= ((s - hole) & mask)){
+            table->slots[hole] = table->slots[s];
+            hole = s;
+        }
+    }
+    table->slots[hole].handle = 0;
+    table->count--;
+}
+
+/*
+ * Function Name: _replay_close_pool
+ * Passed Variables: replay_table_pt table, pool_pt *pools, uint32_t pool
+ * Return Type: void
+ * Purpose: This function closes a pool of the replay, freeing first the
+ * allocations that are still live in it, which happens when an allocation
+ * that failed in the trace succeeds in the replay.
+ */
+static void _replay_close_pool(replay_table_pt table, pool_pt *pools, uint32_t pool) {
+    if (pools[pool]->num_allocs > 0){
+        for (size_t s = 0; s < table->capacity; ++s){
+            if (table->slots[s].handle != 0 && table->slots[s].pool == pool){
+                mem_del_alloc(pools[pool], table->slots[s].alloc);
+                _replay_table_remove(table, &table->slots[s]);
+                --s; // the slot may have been refilled
+            }
+        }
+    }
+    mem_pool_close(pools[pool]);
+    pools[pool] = NULL;
+}
+
+/*
+ * Function Name: _replay_account
+ * Passed Variables: replay_result_pt result, const pool_t *pool, unsigned long nodes,
+ *                   unsigned long gaps, size_t alloc_size
+ * Return Type: void
+ * Purpose: This function updates the totals of the open pools after an
+ * operation on one of them, whose counts were as passed before it.
+ */
+static void _replay_account(replay_result_pt result, const pool_t *pool, unsigned long nodes,
+                            unsigned long gaps, size_t alloc_size) {
+    result->nodes = result->nodes - nodes + pool->num_allocs + pool->num_gaps;
+    result->gaps = result->gaps - gaps + pool->num_gaps;
+    result->alloc_size = result->alloc_size - alloc_size + pool->alloc_size;
+    if (result->nodes > result->peak_nodes){
+        result->peak_nodes = result->nodes;
+    }
+    if (result->gaps > result->peak_gaps){
+        result->peak_gaps = result->gaps;
+    }
+    if (result->alloc_size > result->peak_alloc_size){
+        result->peak_alloc_size = result->alloc_size;
+    }
+}
+
+/*
+ * Function Name: _replay_sample
+ * Passed Variables: pool_pt *pools, uint32_t num_pools, unsigned long ops
+ * Return Type: void
+ * Purpose: This function prints a line of the time series: the totals of
+ * the open pools, and their fragmentation, 1 - largest gaps / free bytes.
+ */
+static void _replay_sample(pool_pt *pools, uint32_t num_pools, unsigned long ops) {
+    size_t alloc_size = 0, free_bytes = 0, largest_gaps = 0;
+    unsigned long num_allocs = 0, num_gaps = 0;
+    for (uint32_t p = 1; p <= num_pools; ++p){
+        pool_stats_t stats;
+        if (pools[p] == NULL || mem_pool_stats(pools[p], &stats) != ALLOC_OK){
+            continue;
+        }
+        alloc_size += stats.alloc_size;
+        free_bytes += stats.free_bytes;
+        largest_gaps += stats.largest_gap;
+        num_allocs += stats.num_allocs;
+        num_gaps += stats.num_gaps;
+    }
+    const double fragmentation = (free_bytes == 0) ? 0.0 : 1.0 - (double) largest_gaps / (double) free_bytes;
+    printf("%12lu %14zu %10lu %10lu %14zu %8.4f\n",
+           ops, alloc_size, num_allocs, num_gaps, largest_gaps, fragmentation);
+}
+
+/*
+ * Function Name: _replay_run
+ * Passed Variables: const mem_trace_record_t *records, const replay_order_t *order,
+ *                   size_t num_records, alloc_policy policy, unsigned extra_flags,
+ *                   unsigned samples, replay_result_pt result
+ * Return Type: void
+ * Purpose: This function replays the trace with every pool opened with
+ * the passed policy, timing every allocation and deallocation and
+ * printing the time series along the way. An allocation that failed in
+ * the trace is tried and, if it succeeds, freed right away; the
+ * operations of pools and allocations that fail in the replay are
+ * skipped.
+ */
+static void _replay_run(const mem_trace_record_t *records, const replay_order_t *order,
+                        size_t num_records, alloc_policy policy, unsigned extra_flags,
+                        unsigned samples, replay_result_pt result) {
+    replay_table_t table = {NULL, 0, 0};
+    pool_pt *pools = NULL;
+    uint32_t num_pools = 0;
+    const unsigned long interval = (samples == 0) ? 0 : (num_records + samples - 1) / samples;
+
+    mem_init();
+    printf("%12s %14s %10s %10s %14s %8s\n", "ops", "alloc bytes", "allocs", "gaps", "largest gaps", "frag");
+    const uint64_t wall_start = mem_bench_now_ns();
+    for (size_t i = 0; i < num_records; ++i){
+        const mem_trace_record_t *record = &records[order[i].index];
+        const uint32_t p = record->pool;
+        if (pools == NULL || p > num_pools){
+            uint32_t new_num = (num_pools == 0) ? 64 : num_pools;
+            while (new_num < p){
+                new_num *= 2;
+            }
+            pool_pt *new_pools = realloc(pools, (new_num + 1) * sizeof(pool_pt));
+            if (new_pools == NULL){
+                perror("mem_replay");
+                exit(1);
+            }
+            memset(new_pools + num_pools + 1, 0, (new_num - num_pools) * sizeof(pool_pt));
+            pools = new_pools;
+            num_pools = new_num;
+        }
+        result->ops++;
+
+        switch (record->op){
+            case MEM_TRACE_POOL_OPEN:
+                pools[p] = mem_pool_open_ex(record->size, policy, (unsigned) record->handle | extra_flags);
+                if (pools[p] == NULL){
+                    result->failed_opens++;
+                } else {
+                    _replay_account(result, pools[p], 0, 0, 0);
+                }
+                break;
+
+            case MEM_TRACE_POOL_CLOSE:
+                if (pools[p] != NULL){
+                    result->nodes -= pools[p]->num_allocs + pools[p]->num_gaps;
+                    result->gaps -= pools[p]->num_gaps;
+                    result->alloc_size -= pools[p]->alloc_size;
+                    _replay_close_pool(&table, pools, p);
+                }
+                break;
+
+            case MEM_TRACE_NEW_ALLOC: {
+                pool_pt pool = pools[p];
+                if (record->handle == 0){
+                    result->trace_failures++;
+                }
+                if (pool == NULL){
+                    result->skipped++;
+                    break;
+                }
+                const unsigned long nodes = pool->num_allocs + pool->num_gaps, gaps = pool->num_gaps;
+                const size_t alloc_size = pool->alloc_size;
+                const uint64_t start = mem_bench_now_ns();
+                alloc_pt alloc = mem_new_alloc(pool, record->size);
+                mem_bench_latency_add(&result->alloc_latency, mem_bench_now_ns() - start);
+                if (alloc == NULL){
+                    result->failed_allocs++;
+                } else if (record->handle == 0 || !_replay_table_put(&table, record->handle, p, alloc)){
+                    mem_del_alloc(pool, alloc);
+                }
+                _replay_account(result, pool, nodes, gaps, alloc_size);
+                break;
+            }
+
+            case MEM_TRACE_DEL_ALLOC: {
+                replay_slot_pt slot = _replay_table_find(&table, record->handle);
+                if (slot == NULL || pools[p] == NULL){
+                    result->skipped++;
+                    break;
+                }
+                pool_pt pool = pools[p];
+                const unsigned long nodes = pool->num_allocs + pool->num_gaps, gaps = pool->num_gaps;
+                const size_t alloc_size = pool->alloc_size;
+                const uint64_t start = mem_bench_now_ns();
+                mem_del_alloc(pool, slot->alloc);
+                mem_bench_latency_add(&result->free_latency, mem_bench_now_ns() - start);
+                _replay_table_remove(&table, slot);
+                _replay_account(result, pool, nodes, gaps, alloc_size);
+                break;
+            }
+
+            default:
+                result->skipped++;
+                break;
+        }
+
+        if (interval != 0 && (result->ops % interval == 0 || i == num_records - 1)){
+            _replay_sample(pools, num_pools, result->ops);
+        }
+    }
+    result->wall_ns = mem_bench_now_ns() - wall_start;
+
+    /* close what the trace left open */
+    for (uint32_t p = 1; p <= num_pools; ++p){
+        if (pools[p] != NULL){
+            _replay_close_pool(&table, pools, p);
+        }
+    }
+    mem_free();
+    free(pools);
+    free(table.slots);
+}
+
+/*
+ * Function Name: _replay_report
+ * Passed Variables: const replay_result_t *results, unsigned num_results
+ * Return Type: void
+ * Purpose: This function prints the policies side by side.
+ */
+static void _replay_report(const replay_result_t *results, unsigned num_results) {
+    printf("\n%-22s", "");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14s", results[r].name);
+    }
+    printf("\n%-22s", "ops/s");
+    for (unsigned r = 0; r < num_results; ++r){
+        const uint64_t ns = results[r].alloc_latency.total_ns + results[r].free_latency.total_ns;
+        const unsigned long calls = results[r].alloc_latency.count + results[r].free_latency.count;
+        printf(" %14.0f", (ns == 0) ? 0.0 : (double) calls * 1e9 / (double) ns);
+    }
+    printf("\n%-22s", "wall ms");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14.1f", (double) results[r].wall_ns / 1e6);
+    }
+    for (int op = 0; op < 2; ++op){
+        for (unsigned q = 0; q <= REPLAY_NUM_PERCENTILES; ++q){
+            char label[32];
+            if (q < REPLAY_NUM_PERCENTILES){
+                snprintf(label, sizeof(label), "%s p%g ns", op ? "free" : "alloc", REPLAY_PERCENTILES[q]);
+            } else {
+                snprintf(label, sizeof(label), "%s max ns", op ? "free" : "alloc");
+            }
+            printf("\n%-22s", label);
+            for (unsigned r = 0; r < num_results; ++r){
+                const bench_latency_t *latency = op ? &results[r].free_latency : &results[r].alloc_latency;
+                printf(" %14llu", (unsigned long long) ((q < REPLAY_NUM_PERCENTILES) ?
+                        mem_bench_latency_percentile(latency, REPLAY_PERCENTILES[q]) : latency->max_ns));
+            }
+        }
+    }
+    printf("\n%-22s", "peak nodes");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].peak_nodes);
+    }
+    printf("\n%-22s", "peak gaps");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].peak_gaps);
+    }
+    printf("\n%-22s", "peak alloc bytes");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14zu", results[r].peak_alloc_size);
+    }
+    printf("\n%-22s", "failed allocs");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].failed_allocs);
+    }
+    printf("\n%-22s", "failed in trace");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].trace_failures);
+    }
+    printf("\n%-22s", "failed opens");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].failed_opens);
+    }
+    printf("\n%-22s", "skipped");
+    for (unsigned r = 0; r < num_results; ++r){
+        printf(" %14lu", results[r].skipped);
+    }
+    printf("\n");
+}
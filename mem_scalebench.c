@@ -0,0 +1,442 @@
+/*
+ * Scalability benchmark: N threads churn allocations, for N from 1 to the
+ * number of CPUs, in each of the ways the pools can be shared, and the
+ * throughput and latency are printed against N.
+ *
+ * usage: mem_scalebench [-n ops] [-T threads] [-p size] [-P first|best] [-m mode] [-c] [-e]
+ *
+ *   -n ops       operations per thread (200000)
+ *   -T threads   the most threads (the number of CPUs)
+ *   -p size      bytes of a thread's pool, or its share of a shared one (16 MiB)
+ *   -P policy    first or best (first)
+ *   -m mode      run only this mode
+ *   -c           print CSV instead of a table
+ *   -e           count cycles, instructions, L1d, LLC and dTLB misses and
+ *                branch mispredictions per operation, summed over the
+ *                threads, with perf_event_open
+ *
+ * Modes:
+ *
+ *   private       a plain pool per thread
+ *   shared        one POOL_LOCKED pool
+ *   tcache        one POOL_THREAD_CACHE pool
+ *   sharded       one pool from mem_pool_open_sharded
+ *   partitioned   one pool from mem_pool_open_partitioned
+ *   cross-locked  one POOL_LOCKED pool; every thread frees what the
+ *                 previous one allocated
+ *   cross-remote  a POOL_REMOTE_FREE pool per thread; every thread frees
+ *                 what the previous one allocated
+ *
+ * The thread counts are the powers of two below the most, and the most.
+ * Every call is timed for the percentiles, which adds the cost of two
+ * clock reads to each.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt() and pthread barriers
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mem_pool.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const unsigned long  SCALE_DEFAULT_OPS       = 200000;
+static const size_t         SCALE_DEFAULT_POOL_SIZE = 16 << 20;
+static const size_t         SCALE_MIN_SIZE          = 16;
+static const size_t         SCALE_MAX_SIZE          = 256;
+#define SCALE_SLOTS 256
+#define SCALE_RING_SIZE 1024 // allocations in flight to the next thread, a power of two
+
+
+
+/* Type declarations */
+
+typedef enum _scale_mode {
+    SCALE_PRIVATE,
+    SCALE_SHARED,
+    SCALE_TCACHE,
+    SCALE_SHARDED,
+    SCALE_PARTITIONED,
+    SCALE_CROSS_LOCKED,
+    SCALE_CROSS_REMOTE,
+    SCALE_NUM_MODES
+} scale_mode;
+
+static const char *SCALE_MODE_NAMES[] = {
+        "private", "shared", "tcache", "sharded", "partitioned", "cross-locked", "cross-remote"
+};
+
+/* a single-producer single-consumer ring of allocations for the next thread */
+typedef struct _scale_ring {
+    struct {
+        pool_pt pool;
+        alloc_pt alloc;
+    } items[SCALE_RING_SIZE];
+    atomic_ulong head; // moved by the producer
+    atomic_ulong tail; // moved by the consumer
+} scale_ring_t, *scale_ring_pt;
+
+typedef struct _scale_run {
+    scale_mode mode;
+    unsigned num_threads;
+    unsigned long num_ops;
+    size_t pool_size;
+    alloc_policy policy;
+    int counters;
+    pool_pt shared;
+    pthread_barrier_t start;
+    pthread_barrier_t sent;  // every thread has stopped handing allocations on
+    pthread_barrier_t freed; // and has freed what was handed to it
+} scale_run_t, *scale_run_pt;
+
+typedef struct _scale_thread {
+    scale_run_pt run;
+    unsigned id;
+    pthread_t thread;
+    pool_pt pool;
+    scale_ring_pt out; // to the next thread, which is the consumer
+    scale_ring_pt in;  // from the previous thread
+    uint64_t rng;
+    unsigned long failed;
+    double counts[MEM_BENCH_NUM_COUNTERS]; // negative if not counted
+    bench_latency_t alloc_latency;
+    bench_latency_t free_latency;
+} scale_thread_t, *scale_thread_pt;
+
+
+
+/* Forward declarations of static functions */
+static int _scale_ring_push(scale_ring_pt ring, pool_pt pool, alloc_pt alloc);
+static int _scale_ring_pop(scale_ring_pt ring, pool_pt *pool, alloc_pt *alloc);
+static void _scale_free(scale_thread_pt thread, pool_pt pool, alloc_pt alloc);
+static void *_scale_thread(void *arg);
+static int _scale_measure(scale_run_pt run, double *ops_per_s, scale_thread_pt total);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    scale_run_t run;
+    memset(&run, 0, sizeof(run));
+    run.num_ops = SCALE_DEFAULT_OPS;
+    run.pool_size = SCALE_DEFAULT_POOL_SIZE;
+    run.policy = FIRST_FIT;
+    unsigned max_threads = (num_cpus > 0) ? (unsigned) num_cpus : 1;
+    int only_mode = -1, csv = 0, opt;
+    while ((opt = getopt(argc, argv, "n:T:p:P:m:ce")) != -1){
+        switch (opt){
+            case 'n': run.num_ops = strtoul(optarg, NULL, 0); break;
+            case 'T': max_threads = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'p': run.pool_size = strtoul(optarg, NULL, 0); break;
+            case 'P': run.policy = (strcmp(optarg, "best") == 0) ? BEST_FIT : FIRST_FIT; break;
+            case 'm':
+                for (int m = 0; m < SCALE_NUM_MODES; ++m){
+                    if (strcmp(optarg, SCALE_MODE_NAMES[m]) == 0){
+                        only_mode = m;
+                    }
+                }
+                if (only_mode < 0){
+                    fprintf(stderr, "%s: no mode %s\n", argv[0], optarg);
+                    return 2;
+                }
+                break;
+            case 'c': csv = 1; break;
+            case 'e': run.counters = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-n ops] [-T threads] [-p size] [-P first|best] [-m mode] [-c] [-e]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (max_threads == 0){
+        max_threads = 1;
+    }
+
+    mem_init();
+    if (csv){
+        printf("mode,threads,ops_per_s,speedup,alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,"
+               "free_p50_ns,free_p99_ns,free_p999_ns,failed");
+    } else {
+        printf("%-13s %7s %12s %8s %9s %9s %9s %9s %9s %9s %8s", "mode", "threads", "Mops/s", "speedup",
+               "alloc p50", "p99", "p99.9", "free p50", "p99", "p99.9", "failed");
+    }
+    for (bench_counter e = 0; run.counters && e < MEM_BENCH_NUM_COUNTERS; ++e){
+        printf(csv ? ",%s" : " %13s", mem_bench_counter_name(e));
+    }
+    printf("\n");
+    for (int m = 0; m < SCALE_NUM_MODES; ++m){
+        if (only_mode >= 0 && m != only_mode){
+            continue;
+        }
+        run.mode = (scale_mode) m;
+        double base = 0.0;
+        for (unsigned n = 1;; n = (n * 2 < max_threads) ? n * 2 : max_threads){
+            run.num_threads = n;
+            double ops_per_s;
+            scale_thread_t total;
+            if (!_scale_measure(&run, &ops_per_s, &total)){
+                fprintf(stderr, "mem_scalebench: cannot run %s with %u threads\n", SCALE_MODE_NAMES[m], n);
+                break;
+            }
+            if (n == 1){
+                base = ops_per_s;
+            }
+            const double speedup = (base == 0.0) ? 0.0 : ops_per_s / base;
+            const bench_latency_t *a = &total.alloc_latency, *f = &total.free_latency;
+            printf(csv ? "%s,%u,%.0f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%lu" :
+                         "%-13s %7u %12.3f %8.2f %9llu %9llu %9llu %9llu %9llu %9llu %8lu",
+                   SCALE_MODE_NAMES[m], n, csv ? ops_per_s : ops_per_s / 1e6, speedup,
+                   (unsigned long long) mem_bench_latency_percentile(a, 50.0),
+                   (unsigned long long) mem_bench_latency_percentile(a, 99.0),
+                   (unsigned long long) mem_bench_latency_percentile(a, 99.9),
+                   (unsigned long long) mem_bench_latency_percentile(f, 50.0),
+                   (unsigned long long) mem_bench_latency_percentile(f, 99.0),
+                   (unsigned long long) mem_bench_latency_percentile(f, 99.9),
+                   total.failed);
+            const unsigned long ops = a->count + f->count;
+            for (bench_counter e = 0; run.counters && e < MEM_BENCH_NUM_COUNTERS; ++e){
+                if (total.counts[e] < 0.0 || ops == 0){
+                    printf(csv ? "," : " %13s", "-");
+                } else {
+                    printf(csv ? ",%.2f" : " %13.2f", total.counts[e] / ops);
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+            if (n == max_threads){
+                break;
+            }
+        }
+    }
+    mem_free();
+
+    return 0;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _scale_ring_push
+ * Passed Variables: scale_ring_pt ring, pool_pt pool, alloc_pt alloc
+ * Return Type: int
+ * Purpose: This function hands an allocation to the next thread. Returns
+ * 0 if the ring is full.
+ */
+static int _scale_ring_push(scale_ring_pt ring, pool_pt pool, alloc_pt alloc) {
+    const unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == SCALE_RING_SIZE){
+        return 0;
+    }
+    ring->items[head & (SCALE_RING_SIZE - 1)].pool = pool;
+    ring->items[head & (SCALE_RING_SIZE - 1)].alloc = alloc;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Function Name: _scale_ring_pop
+ * Passed Variables: scale_ring_pt ring, pool_pt *pool, alloc_pt *alloc
+ * Return Type: int
+ * Purpose: This function takes an allocation handed over by the previous
+ * thread. Returns 0 if the ring is empty.
+ */
+static int _scale_ring_pop(scale_ring_pt ring, pool_pt *pool, alloc_pt *alloc) {
+    const unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail){
+        return 0;
+    }
+    *pool = ring->items[tail & (SCALE_RING_SIZE - 1)].pool;
+    *alloc = ring->items[tail & (SCALE_RING_SIZE - 1)].alloc;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Function Name: _scale_free
+ * Passed Variables: scale_thread_pt thread, pool_pt pool, alloc_pt alloc
+ * Return Type: void
+ * Purpose: This function frees an allocation, timing it.
+ */
+static void _scale_free(scale_thread_pt thread, pool_pt pool, alloc_pt alloc) {
+    const uint64_t start = mem_bench_now_ns();
+    mem_del_alloc(pool, alloc);
+    mem_bench_latency_add(&thread->free_latency, mem_bench_now_ns() - start);
+}
+
+/*
+ * Function Name: _scale_thread
+ * Passed Variables: void *arg
+ * Return Type: void *
+ * Purpose: This function is the body of a thread. In the cross modes
+ * every allocation goes to the next thread, and the thread frees what
+ * the previous one sends it; otherwise it frees or refills a random
+ * slot of its own.
+ */
+static void *_scale_thread(void *arg) {
+    scale_thread_pt thread = arg;
+    scale_run_pt run = thread->run;
+    const int cross = (run->mode == SCALE_CROSS_LOCKED || run->mode == SCALE_CROSS_REMOTE);
+    alloc_pt slots[SCALE_SLOTS] = {NULL};
+
+    /* a pool of the thread's own must be opened by the thread */
+    if (run->mode == SCALE_PRIVATE || run->mode == SCALE_CROSS_REMOTE){
+        thread->pool = mem_pool_open_ex(run->pool_size, run->policy,
+                                        (run->mode == SCALE_CROSS_REMOTE) ? POOL_REMOTE_FREE : POOL_DEFAULT);
+    } else {
+        thread->pool = run->shared;
+    }
+    bench_counters_t counters;
+    const int counting = run->counters && mem_bench_counters_open(&counters) > 0;
+    pthread_barrier_wait(&run->start);
+    if (counting){
+        mem_bench_counters_start(&counters);
+    }
+
+    for (unsigned long op = 0; thread->pool != NULL && op < run->num_ops; ++op){
+        thread->rng ^= thread->rng << 13;
+        thread->rng ^= thread->rng >> 7;
+        thread->rng ^= thread->rng << 17;
+        pool_pt pool;
+        alloc_pt alloc;
+        if (cross && (op & 1) && _scale_ring_pop(thread->in, &pool, &alloc)){
+            _scale_free(thread, pool, alloc);
+            continue;
+        }
+        const unsigned slot = (unsigned) (thread->rng % SCALE_SLOTS);
+        if (!cross && slots[slot] != NULL){
+            _scale_free(thread, thread->pool, slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+        const size_t size = SCALE_MIN_SIZE + (thread->rng >> 32) % (SCALE_MAX_SIZE - SCALE_MIN_SIZE + 1);
+        const uint64_t start = mem_bench_now_ns();
+        alloc = mem_new_alloc(thread->pool, size);
+        mem_bench_latency_add(&thread->alloc_latency, mem_bench_now_ns() - start);
+        if (alloc == NULL){
+            thread->failed++;
+        } else if (!cross){
+            slots[slot] = alloc;
+        } else if (!_scale_ring_push(thread->out, thread->pool, alloc)){
+            _scale_free(thread, thread->pool, alloc);
+        }
+    }
+
+    if (counting){
+        mem_bench_counters_stop(&counters, thread->counts);
+        mem_bench_counters_close(&counters);
+    } else {
+        for (unsigned e = 0; e < MEM_BENCH_NUM_COUNTERS; ++e){
+            thread->counts[e] = -1.0;
+        }
+    }
+    pthread_barrier_wait(&run->sent);
+    if (cross){
+        pool_pt pool;
+        alloc_pt alloc;
+        while (_scale_ring_pop(thread->in, &pool, &alloc)){
+            _scale_free(thread, pool, alloc);
+        }
+    }
+    for (unsigned slot = 0; slot < SCALE_SLOTS; ++slot){
+        if (slots[slot] != NULL){
+            mem_del_alloc(thread->pool, slots[slot]);
+        }
+    }
+    pthread_barrier_wait(&run->freed);
+    return NULL;
+}
+
+/*
+ * Function Name: _scale_measure
+ * Passed Variables: scale_run_pt run, double *ops_per_s, scale_thread_pt total
+ * Return Type: int
+ * Purpose: This function runs a mode with a number of threads and passes
+ * back the throughput, from the start barrier to the last thread done,
+ * and the threads' latencies, failures and counters summed. Returns 0 if the pools
+ * cannot be opened.
+ */
+static int _scale_measure(scale_run_pt run, double *ops_per_s, scale_thread_pt total) {
+    const unsigned n = run->num_threads;
+    const size_t shared_size = run->pool_size * n;
+    switch (run->mode){
+        case SCALE_SHARED:
+        case SCALE_CROSS_LOCKED:
+            run->shared = mem_pool_open_ex(shared_size, run->policy, POOL_LOCKED);
+            break;
+        case SCALE_TCACHE:
+            run->shared = mem_pool_open_ex(shared_size, run->policy, POOL_THREAD_CACHE);
+            break;
+        case SCALE_SHARDED:
+            run->shared = mem_pool_open_sharded(shared_size, run->policy, 0, POOL_DEFAULT);
+            break;
+        case SCALE_PARTITIONED:
+            run->shared = mem_pool_open_partitioned(shared_size, run->policy, 0);
+            break;
+        default:
+            run->shared = NULL;
+            break;
+    }
+
+    scale_thread_pt threads = calloc(n, sizeof(scale_thread_t));
+    scale_ring_pt rings = calloc(n, sizeof(scale_ring_t));
+    if (threads == NULL || rings == NULL){
+        free(threads);
+        free(rings);
+        return 0;
+    }
+    pthread_barrier_init(&run->start, NULL, n + 1);
+    pthread_barrier_init(&run->sent, NULL, n);
+    pthread_barrier_init(&run->freed, NULL, n);
+    for (unsigned t = 0; t < n; ++t){
+        threads[t].run = run;
+        threads[t].id = t;
+        threads[t].rng = 0x9E3779B97F4A7C15ull * (t + 1);
+        threads[t].out = &rings[t];
+        threads[t].in = &rings[(t + n - 1) % n];
+        pthread_create(&threads[t].thread, NULL, _scale_thread, &threads[t]);
+    }
+    pthread_barrier_wait(&run->start);
+    const uint64_t start = mem_bench_now_ns();
+    for (unsigned t = 0; t < n; ++t){
+        pthread_join(threads[t].thread, NULL);
+    }
+    const uint64_t elapsed = mem_bench_now_ns() - start;
+
+    int ok = 1;
+    memset(total, 0, sizeof(scale_thread_t));
+    for (unsigned t = 0; t < n; ++t){
+        if (threads[t].pool == NULL){
+            ok = 0;
+        } else if (threads[t].pool != run->shared){
+            mem_pool_close(threads[t].pool);
+        }
+        total->failed += threads[t].failed;
+        for (unsigned e = 0; e < MEM_BENCH_NUM_COUNTERS; ++e){
+            total->counts[e] = (threads[t].counts[e] < 0.0 || total->counts[e] < 0.0) ?
+                               -1.0 : total->counts[e] + threads[t].counts[e];
+        }
+        mem_bench_latency_merge(&total->alloc_latency, &threads[t].alloc_latency);
+        mem_bench_latency_merge(&total->free_latency, &threads[t].free_latency);
+    }
+    if (run->shared != NULL){
+        mem_pool_close(run->shared);
+    }
+    pthread_barrier_destroy(&run->start);
+    pthread_barrier_destroy(&run->sent);
+    pthread_barrier_destroy(&run->freed);
+    free(threads);
+    free(rings);
+
+    const unsigned long ops = total->alloc_latency.count + total->free_latency.count;
+    *ops_per_s = (elapsed == 0) ? 0.0 : (double) ops * 1e9 / (double) elapsed;
+    return ok;
+}
@@ -0,0 +1,413 @@
+/*
+ * Binary trace of the allocation events of the pools.
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime()
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mem_trace.h"
+
+/* Constants */
+#define MEM_TRACE_RING_SIZE 4096 // records per thread, a power of two
+
+static const unsigned   MEM_TRACE_FLUSH_INTERVAL_MS     = 10;
+static const unsigned   MEM_TRACE_HANDLE_SHIFT          = 48; // handle = 1 + thread << shift | count
+
+
+
+/* Type declarations */
+
+/*
+ * A thread's ring of records. The thread is the only producer and moves
+ * head; whoever holds the lock, the flusher or the thread itself when the
+ * ring is full, is the consumer and moves tail.
+ */
+typedef struct _trace_ring {
+    mem_trace_record_t records[MEM_TRACE_RING_SIZE];
+    atomic_ulong head;
+    atomic_ulong tail;
+    pthread_mutex_t lock;
+    uint64_t handles;  // allocation handles handed out so far
+    uint16_t thread;
+    atomic_int in_use; // 0 once the thread has exited
+    struct _trace_ring *next;
+} trace_ring_t, *trace_ring_pt;
+
+
+/* Static global variables */
+static atomic_int trace_active = 0;
+static _Atomic(trace_ring_pt) trace_rings = NULL; // every thread's ring, never freed
+static atomic_uint trace_num_rings = 0;
+static atomic_uint trace_num_pools = 0;  // pools opened in this session
+static atomic_uint trace_session = 0;    // bumped by every mem_trace_start
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local trace_ring_pt thread_trace_ring = NULL;
+
+static pthread_mutex_t trace_file_lock = PTHREAD_MUTEX_INITIALIZER; // guards trace_file
+static FILE *trace_file = NULL;
+static pthread_t trace_flusher;
+static pthread_mutex_t trace_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_flusher_cond = PTHREAD_COND_INITIALIZER;
+static int trace_flusher_stop = 0;
+
+
+/* Forward declarations of static functions */
+static trace_ring_pt _mem_trace_ring_acquire();
+static void _mem_trace_make_key();
+static void _mem_trace_thread_exit(void *ring);
+static int _mem_trace_current(uint32_t pool, uint32_t session);
+static void _mem_trace_append(mem_trace_op op, uint32_t pool, uint64_t handle,
+                              uint64_t size, uint8_t policy);
+static void _mem_trace_drain(trace_ring_pt ring, int discard);
+static void _mem_trace_drain_all(int discard);
+static void *_mem_trace_flusher(void *arg);
+
+
+/* Definitions of user-facing functions */
+
+/*
+ * Function Name: mem_trace_start
+ * Passed Variables: const char *path
+ * Return Type: alloc_status
+ * Purpose: This function starts tracing the pools into the file at path,
+ * which is truncated. From then on every mem_pool_open, mem_pool_close,
+ * mem_new_alloc and mem_del_alloc of a pool opened with mem_pool_open or
+ * mem_pool_open_ex appends a record to the calling thread's ring, and a
+ * background thread writes the rings out every
+ * MEM_TRACE_FLUSH_INTERVAL_MS milliseconds. A thread whose ring is full
+ * writes it out itself, so no record is lost. Pools opened and
+ * allocations made before the start are not traced, even if they were in
+ * an earlier trace: every start begins a new session, whose pools are
+ * numbered from 1 again, and the pools of older sessions are ignored.
+ * Returns
+ * ALLOC_CALLED_AGAIN if tracing is already on and ALLOC_FAIL if the file
+ * cannot be written.
+ */
+alloc_status mem_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_file_lock);
+    if (trace_file != NULL){
+        pthread_mutex_unlock(&trace_file_lock);
+        return ALLOC_CALLED_AGAIN;
+    }
+    FILE *file = fopen(path, "wb");
+    mem_trace_header_t header;
+    memcpy(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MEM_TRACE_VERSION;
+    header.record_size = sizeof(mem_trace_record_t);
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1){
+        if (file != NULL){
+            fclose(file);
+        }
+        pthread_mutex_unlock(&trace_file_lock);
+        return ALLOC_FAIL;
+    }
+    trace_file = file;
+    pthread_mutex_unlock(&trace_file_lock);
+
+    /* Whatever was left in the rings by the last trace is dropped */
+    _mem_trace_drain_all(1);
+    atomic_store(&trace_num_pools, 0);
+    atomic_fetch_add(&trace_session, 1);
+    trace_flusher_stop = 0;
+    if (pthread_create(&trace_flusher, NULL, _mem_trace_flusher, NULL) != 0){
+        pthread_mutex_lock(&trace_file_lock);
+        fclose(trace_file);
+        trace_file = NULL;
+        pthread_mutex_unlock(&trace_file_lock);
+        return ALLOC_FAIL;
+    }
+    atomic_store(&trace_active, 1);
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_trace_stop
+ * Passed Variables: None
+ * Return Type: alloc_status
+ * Purpose: This function stops tracing, writes out what is left in the
+ * rings and closes the file. Records that other threads are appending
+ * meanwhile may be dropped. Returns ALLOC_CALLED_AGAIN if tracing is off
+ * and ALLOC_FAIL if the file could not be written completely.
+ */
+alloc_status mem_trace_stop() {
+    int active = 1;
+    if (!atomic_compare_exchange_strong(&trace_active, &active, 0)){
+        return ALLOC_CALLED_AGAIN;
+    }
+    pthread_mutex_lock(&trace_flusher_lock);
+    trace_flusher_stop = 1;
+    pthread_cond_signal(&trace_flusher_cond);
+    pthread_mutex_unlock(&trace_flusher_lock);
+    pthread_join(trace_flusher, NULL);
+    _mem_trace_drain_all(0);
+
+    pthread_mutex_lock(&trace_file_lock);
+    const int failed = ferror(trace_file);
+    const int closed = fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_file_lock);
+
+    return (failed || closed != 0) ? ALLOC_FAIL : ALLOC_OK;
+}
+
+/*
+ * Function Name: mem_trace_active
+ * Passed Variables: None
+ * Return Type: int
+ * Purpose: This function returns 1 while tracing is on, 0 otherwise.
+ */
+int mem_trace_active() {
+    return atomic_load_explicit(&trace_active, memory_order_relaxed);
+}
+
+/*
+ * Function Name: mem_trace_log_open
+ * Passed Variables: size_t size, alloc_policy policy, unsigned flags, uint32_t *session
+ * Return Type: uint32_t
+ * Purpose: This function records the opening of a pool and returns the
+ * number the pool goes by in the trace, or 0 if tracing is off. The
+ * session the number belongs to is passed back in session, and goes with
+ * the number to the other mem_trace_log functions.
+ */
+uint32_t mem_trace_log_open(size_t size, alloc_policy policy, unsigned flags, uint32_t *session) {
+    *session = atomic_load(&trace_session);
+    if (!mem_trace_active()){
+        return 0;
+    }
+    const uint32_t pool = atomic_fetch_add(&trace_num_pools, 1) + 1;
+    _mem_trace_append(MEM_TRACE_POOL_OPEN, pool, flags, size, (uint8_t) policy);
+    return pool;
+}
+
+/*
+ * Function Name: mem_trace_log_close
+ * Passed Variables: uint32_t pool, uint32_t session
+ * Return Type: void
+ * Purpose: This function records the closing of a pool traced in the
+ * current session.
+ */
+void mem_trace_log_close(uint32_t pool, uint32_t session) {
+    if (_mem_trace_current(pool, session)){
+        _mem_trace_append(MEM_TRACE_POOL_CLOSE, pool, 0, 0, 0);
+    }
+}
+
+/*
+ * Function Name: mem_trace_log_alloc
+ * Passed Variables: uint32_t pool, uint32_t session, size_t size, int ok
+ * Return Type: uint64_t
+ * Purpose: This function records an allocation of a pool traced in the
+ * current session and returns the handle it goes by in the trace. A
+ * failed allocation is recorded with handle 0. Returns 0 if there is
+ * nothing to record.
+ */
+uint64_t mem_trace_log_alloc(uint32_t pool, uint32_t session, size_t size, int ok) {
+    if (!_mem_trace_current(pool, session)){
+        return 0;
+    }
+    if (thread_trace_ring == NULL){
+        thread_trace_ring = _mem_trace_ring_acquire();
+    }
+    uint64_t handle = 0;
+    if (ok){
+        handle = ((uint64_t) thread_trace_ring->thread << MEM_TRACE_HANDLE_SHIFT | thread_trace_ring->handles++) + 1;
+    }
+    _mem_trace_append(MEM_TRACE_NEW_ALLOC, pool, handle, size, 0);
+    return handle;
+}
+
+/*
+ * Function Name: mem_trace_log_free
+ * Passed Variables: uint32_t pool, uint32_t session, uint64_t handle
+ * Return Type: void
+ * Purpose: This function records a deallocation of an allocation traced
+ * in the current session.
+ */
+void mem_trace_log_free(uint32_t pool, uint32_t session, uint64_t handle) {
+    if (handle != 0 && _mem_trace_current(pool, session)){
+        _mem_trace_append(MEM_TRACE_DEL_ALLOC, pool, handle, 0, 0);
+    }
+}
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _mem_trace_ring_acquire
+ * Passed Variables: None
+ * Return Type: trace_ring_pt
+ * Purpose: This function gives the calling thread a ring, taking one that
+ * an exited thread left behind if there is one. The thread takes over the
+ * ring's number and goes on with its handles, so handles stay unique.
+ */
+static trace_ring_pt _mem_trace_ring_acquire() {
+    pthread_once(&trace_key_once, _mem_trace_make_key);
+    trace_ring_pt ring;
+    for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next){
+        int free_ring = 0;
+        if (atomic_load_explicit(&ring->in_use, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&ring->in_use, &free_ring, 1)){
+            break;
+        }
+    }
+    if (ring == NULL){
+        ring = calloc(1, sizeof(trace_ring_t));
+        assert(ring);
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->in_use, 1);
+        pthread_mutex_init(&ring->lock, NULL);
+        ring->thread = (uint16_t) atomic_fetch_add(&trace_num_rings, 1);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring)){
+        }
+    }
+    pthread_setspecific(trace_key, ring);
+    return ring;
+}
+
+/*
+ * Function Name: _mem_trace_make_key
+ * Passed Variables: none
+ * Return Type: void
+ * Purpose: This function creates the thread-specific key whose destructor
+ * hands a thread's ring back when the thread exits.
+ */
+static void _mem_trace_make_key() {
+    pthread_key_create(&trace_key, _mem_trace_thread_exit);
+}
+
+/*
+ * Function Name: _mem_trace_thread_exit
+ * Passed Variables: void *ring
+ * Return Type: void
+ * Purpose: This function runs when a thread with a ring exits. The
+ * records stay for the flusher and the ring is marked free for the next
+ * thread to take.
+ */
+static void _mem_trace_thread_exit(void *ring) {
+    trace_ring_pt trace_ring = ring;
+    atomic_store(&trace_ring->in_use, 0);
+    thread_trace_ring = NULL;
+}
+
+/*
+ * Function Name: _mem_trace_current
+ * Passed Variables: uint32_t pool, uint32_t session
+ * Return Type: int
+ * Purpose: This function returns 1 if tracing is on and the pool was
+ * opened in the current session, 0 otherwise.
+ */
+static int _mem_trace_current(uint32_t pool, uint32_t session) {
+    return pool != 0 && mem_trace_active() &&
+           session == atomic_load_explicit(&trace_session, memory_order_relaxed);
+}
+
+/*
+ * Function Name: _mem_trace_append
+ * Passed Variables: mem_trace_op op, uint32_t pool, uint64_t handle, uint64_t size, uint8_t policy
+ * Return Type: void
+ * Purpose: This function appends a record to the calling thread's ring,
+ * writing the ring out first if it is full.
+ */
+static void _mem_trace_append(mem_trace_op op, uint32_t pool, uint64_t handle,
+                              uint64_t size, uint8_t policy) {
+    if (thread_trace_ring == NULL){
+        thread_trace_ring = _mem_trace_ring_acquire();
+    }
+    trace_ring_pt ring = thread_trace_ring;
+    const unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == MEM_TRACE_RING_SIZE){
+        _mem_trace_drain(ring, 0);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    mem_trace_record_pt record = &ring->records[head % MEM_TRACE_RING_SIZE];
+    record->time_ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    record->handle = handle;
+    record->size = size;
+    record->pool = pool;
+    record->op = (uint8_t) op;
+    record->policy = policy;
+    record->thread = ring->thread;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Function Name: _mem_trace_drain
+ * Passed Variables: trace_ring_pt ring, int discard
+ * Return Type: void
+ * Purpose: This function writes the records of a ring to the trace file,
+ * or just drops them if discard is set or there is no file.
+ */
+static void _mem_trace_drain(trace_ring_pt ring, int discard) {
+    pthread_mutex_lock(&ring->lock);
+    const unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (head != tail && !discard){
+        pthread_mutex_lock(&trace_file_lock);
+        while (trace_file != NULL && tail != head){
+            /* the records up to the end of the ring, then the rest from its start */
+            const unsigned long start = tail % MEM_TRACE_RING_SIZE;
+            unsigned long count = head - tail;
+            if (start + count > MEM_TRACE_RING_SIZE){
+                count = MEM_TRACE_RING_SIZE - start;
+            }
+            fwrite(&ring->records[start], sizeof(mem_trace_record_t), count, trace_file);
+            tail += count;
+        }
+        pthread_mutex_unlock(&trace_file_lock);
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Function Name: _mem_trace_drain_all
+ * Passed Variables: int discard
+ * Return Type: void
+ * Purpose: This function drains every thread's ring.
+ */
+static void _mem_trace_drain_all(int discard) {
+    for (trace_ring_pt ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next){
+        _mem_trace_drain(ring, discard);
+    }
+}
+
+/*
+ * Function Name: _mem_trace_flusher
+ * Passed Variables: void *arg
+ * Return Type: void *
+ * Purpose: This function is the body of the thread that writes the rings
+ * out every MEM_TRACE_FLUSH_INTERVAL_MS milliseconds until tracing stops.
+ */
+static void *_mem_trace_flusher(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&trace_flusher_lock);
+    while (!trace_flusher_stop){
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (long) MEM_TRACE_FLUSH_INTERVAL_MS * 1000000;
+        if (wake.tv_nsec >= 1000000000){
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&trace_flusher_cond, &trace_flusher_lock, &wake);
+        pthread_mutex_unlock(&trace_flusher_lock);
+        _mem_trace_drain_all(0);
+        pthread_mutex_lock(&trace_flusher_lock);
+    }
+    pthread_mutex_unlock(&trace_flusher_lock);
+
+    return NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * Binary trace of the allocation events of the pools.
+ */
+
+#ifndef DENVER_OS_PA_C_MEM_TRACE_H
+#define DENVER_OS_PA_C_MEM_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem_pool.h"
+
+/* type declarations */
+
+typedef enum _mem_trace_op {
+    MEM_TRACE_POOL_OPEN  = 1,
+    MEM_TRACE_POOL_CLOSE = 2,
+    MEM_TRACE_NEW_ALLOC  = 3,
+    MEM_TRACE_DEL_ALLOC  = 4
+} mem_trace_op;
+
+/*
+ * A trace file is a mem_trace_header_t followed by mem_trace_record_t's.
+ * Every thread's records are in time order, but the threads' records are
+ * interleaved in the order they were flushed, so a reader sorts them by
+ * time_ns first.
+ */
+typedef struct _mem_trace_header {
+    char magic[8];        // MEM_TRACE_MAGIC, not 0-terminated
+    uint32_t version;     // MEM_TRACE_VERSION
+    uint32_t record_size; // sizeof(mem_trace_record_t)
+} mem_trace_header_t, *mem_trace_header_pt;
+
+typedef struct _mem_trace_record {
+    uint64_t time_ns; // monotonic clock
+    uint64_t handle;  // the allocation, 0 for a failed one; the pool flags for MEM_TRACE_POOL_OPEN
+    uint64_t size;    // bytes asked for; the pool size for MEM_TRACE_POOL_OPEN
+    uint32_t pool;    // pools are numbered from 1 in the order they were opened
+    uint8_t op;       // mem_trace_op
+    uint8_t policy;   // alloc_policy of MEM_TRACE_POOL_OPEN
+    uint16_t thread;  // the recording thread, numbered from 0
+} mem_trace_record_t, *mem_trace_record_pt;
+
+#define MEM_TRACE_MAGIC "MEMTRACE"
+#define MEM_TRACE_VERSION 1
+
+/* function declarations */
+
+alloc_status
+mem_trace_start(const char *path);
+
+alloc_status
+mem_trace_stop();
+
+int
+mem_trace_active();
+
+uint32_t
+mem_trace_log_open(size_t size, alloc_policy policy, unsigned flags, uint32_t *session);
+
+void
+mem_trace_log_close(uint32_t pool, uint32_t session);
+
+uint64_t
+mem_trace_log_alloc(uint32_t pool, uint32_t session, size_t size, int ok);
+
+void
+mem_trace_log_free(uint32_t pool, uint32_t session, uint64_t handle);
+
+#endif //DENVER_OS_PA_C_MEM_TRACE_H
@@ -0,0 +1,599 @@
+/*
+ * Synthetic workload generator: drives pools with allocations of a chosen
+ * size distribution that live for a chosen lifetime distribution, on one
+ * or more threads, and can trace what it did for mem_replay.
+ *
+ * usage: mem_workload [options]
+ *
+ *   -n ops       operations in all, allocations and deallocations (1000000)
+ *   -t threads   threads, each with a pool of its own unless -S (1)
+ *   -S           share one POOL_LOCKED pool between the threads
+ *   -p size      bytes per pool (64 MiB)
+ *   -P policy    first or best (first)
+ *   -f flags     pool_flag bits to open the pools with, e.g. 0x10
+ *   -d dist      sizes: uniform, zipf, bimodal or pow2 (uniform)
+ *   -m min       smallest size (16)
+ *   -M max       largest size (4096)
+ *   -z s         Zipf exponent; size min + 8 * (k - 1) has weight 1 / k^s (1.0)
+ *   -l lifetime  exponential, phased, fifo or lifo (exponential)
+ *   -L live      allocations live per thread: the mean for exponential,
+ *                the most for the others (10000)
+ *   -r seed      random seed (1)
+ *   -o path      trace the run into path
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getopt()
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mem_pool.h"
+#include "mem_trace.h"
+#include "mem_bench.h"
+
+/* Constants */
+static const unsigned long  WORKLOAD_DEFAULT_OPS        = 1000000;
+static const size_t         WORKLOAD_DEFAULT_POOL_SIZE  = 64 << 20;
+static const size_t         WORKLOAD_DEFAULT_MIN_SIZE   = 16;
+static const size_t         WORKLOAD_DEFAULT_MAX_SIZE   = 4096;
+static const unsigned       WORKLOAD_DEFAULT_LIVE       = 10000;
+static const unsigned       WORKLOAD_ZIPF_STEP          = 8;    // bytes between the Zipf sizes
+static const double         WORKLOAD_BIMODAL_SMALL      = 0.9;  // share of small bimodal sizes
+static const double         WORKLOAD_PHASED_SURVIVORS   = 0.1;  // share of a phase that lives on
+
+
+
+/* Type declarations */
+
+typedef enum _size_dist { SIZE_UNIFORM, SIZE_ZIPF, SIZE_BIMODAL, SIZE_POW2 } size_dist;
+
+typedef enum _lifetime_dist { LIFE_EXPONENTIAL, LIFE_PHASED, LIFE_FIFO, LIFE_LIFO } lifetime_dist;
+
+typedef struct _workload_config {
+    unsigned long num_ops;
+    unsigned num_threads;
+    int shared;
+    size_t pool_size;
+    alloc_policy policy;
+    unsigned flags;
+    size_dist sizes;
+    size_t min_size;
+    size_t max_size;
+    double zipf_exponent;
+    lifetime_dist lifetime;
+    unsigned live;
+    uint64_t seed;
+    const char *trace_path;
+    double *zipf_cdf;  // of the sizes min, min + step, ... max
+    unsigned zipf_num;
+} workload_config_t, *workload_config_pt;
+
+/*
+ * The allocations a thread holds. For the exponential lifetime it is a
+ * heap ordered by time of death; otherwise a ring, oldest first.
+ */
+typedef struct _live_set {
+    alloc_pt *allocs;
+    uint64_t *deaths;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} live_set_t, *live_set_pt;
+
+typedef struct _workload_thread {
+    const workload_config_t *config;
+    pool_pt pool;
+    pthread_t thread;
+    uint64_t rng;
+    live_set_t live;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long failed;
+    bench_latency_t alloc_latency;
+    bench_latency_t free_latency;
+} workload_thread_t, *workload_thread_pt;
+
+
+
+/* Forward declarations of static functions */
+static int _workload_parse(int argc, char *argv[], workload_config_pt config);
+static uint64_t _workload_rand(uint64_t *state);
+static double _workload_uniform(uint64_t *state);
+static size_t _workload_size(workload_thread_pt thread);
+static int _workload_live_grow(live_set_pt live);
+static void _workload_heap_push(live_set_pt live, alloc_pt alloc, uint64_t death);
+static alloc_pt _workload_heap_pop(live_set_pt live);
+static alloc_pt _workload_take(workload_thread_pt thread, uint64_t clock);
+static void _workload_free(workload_thread_pt thread, alloc_pt alloc);
+static void *_workload_run(void *arg);
+
+
+
+/* main */
+int main(int argc, char *argv[]) {
+    workload_config_t config;
+    if (!_workload_parse(argc, argv, &config)){
+        return 2;
+    }
+
+    workload_thread_pt threads = calloc(config.num_threads, sizeof(workload_thread_t));
+    if (threads == NULL){
+        perror("mem_workload");
+        return 1;
+    }
+    mem_init();
+    if (config.trace_path != NULL && mem_trace_start(config.trace_path) != ALLOC_OK){
+        fprintf(stderr, "%s: cannot trace\n", config.trace_path);
+        return 1;
+    }
+
+    pool_pt shared = NULL;
+    if (config.shared){
+        shared = mem_pool_open_ex(config.pool_size, config.policy, config.flags | POOL_LOCKED);
+    }
+    for (unsigned t = 0; t < config.num_threads; ++t){
+        threads[t].config = &config;
+        threads[t].rng = config.seed * 0x9E3779B97F4A7C15ull + t + 1;
+        threads[t].pool = config.shared ? shared :
+                          mem_pool_open_ex(config.pool_size, config.policy, config.flags);
+        if (threads[t].pool == NULL){
+            fprintf(stderr, "mem_workload: cannot open a pool of %zu bytes\n", config.pool_size);
+            return 1;
+        }
+    }
+
+    const uint64_t start = mem_bench_now_ns();
+    for (unsigned t = 0; t < config.num_threads; ++t){
+        pthread_create(&threads[t].thread, NULL, _workload_run, &threads[t]);
+    }
+    for (unsigned t = 0; t < config.num_threads; ++t){
+        pthread_join(threads[t].thread, NULL);
+    }
+    const uint64_t elapsed = mem_bench_now_ns() - start;
+
+    workload_thread_t total;
+    memset(&total, 0, sizeof(total));
+    pool_stats_t stats;
+    size_t free_bytes = 0, largest_gaps = 0, alloc_size = 0;
+    unsigned long num_gaps = 0;
+    for (unsigned t = 0; t < config.num_threads; ++t){
+        total.allocs += threads[t].allocs;
+        total.frees += threads[t].frees;
+        total.failed += threads[t].failed;
+        mem_bench_latency_merge(&total.alloc_latency, &threads[t].alloc_latency);
+        mem_bench_latency_merge(&total.free_latency, &threads[t].free_latency);
+        if ((t == 0 || !config.shared) && mem_pool_stats(threads[t].pool, &stats) == ALLOC_OK){
+            free_bytes += stats.free_bytes;
+            largest_gaps += stats.largest_gap;
+            alloc_size += stats.alloc_size;
+            num_gaps += stats.num_gaps;
+        }
+    }
+
+    const unsigned long ops = total.allocs + total.frees + total.failed;
+    printf("ops            %lu (%lu allocs, %lu frees, %lu failed allocs)\n",
+           ops, total.allocs, total.frees, total.failed);
+    printf("threads        %u, %s\n", config.num_threads, config.shared ? "one shared pool" : "a pool each");
+    printf("wall ms        %.1f\n", (double) elapsed / 1e6);
+    printf("ops/s          %.0f\n", (elapsed == 0) ? 0.0 : (double) ops * 1e9 / (double) elapsed);
+    printf("alloc ns       p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long) mem_bench_latency_percentile(&total.alloc_latency, 50.0),
+           (unsigned long long) mem_bench_latency_percentile(&total.alloc_latency, 99.0),
+           (unsigned long long) mem_bench_latency_percentile(&total.alloc_latency, 99.9),
+           (unsigned long long) total.alloc_latency.max_ns);
+    printf("free ns        p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long) mem_bench_latency_percentile(&total.free_latency, 50.0),
+           (unsigned long long) mem_bench_latency_percentile(&total.free_latency, 99.0),
+           (unsigned long long) mem_bench_latency_percentile(&total.free_latency, 99.9),
+           (unsigned long long) total.free_latency.max_ns);
+    printf("at the end     %zu bytes live, %lu gaps, fragmentation %.4f\n", alloc_size, num_gaps,
+           (free_bytes == 0) ? 0.0 : 1.0 - (double) largest_gaps / (double) free_bytes);
+
+    /* let go of what is still live */
+    for (unsigned t = 0; t < config.num_threads; ++t){
+        alloc_pt alloc;
+        while ((alloc = _workload_take(&threads[t], UINT64_MAX)) != NULL){
+            mem_del_alloc(threads[t].pool, alloc);
+        }
+        if (!config.shared){
+            mem_pool_close(threads[t].pool);
+        }
+        free(threads[t].live.allocs);
+        free(threads[t].live.deaths);
+    }
+    if (shared != NULL){
+        mem_pool_close(shared);
+    }
+    if (config.trace_path != NULL){
+        mem_trace_stop();
+    }
+    mem_free();
+    free(config.zipf_cdf);
+    free(threads);
+
+    return 0;
+}
+
+
+
+/* Definitions of static functions */
+
+/*
+ * Function Name: _workload_parse
+ * Passed Variables: int argc, char *argv[], workload_config_pt config
+ * Return Type: int
+ * Purpose: This function fills the configuration from the command line,
+ * see the top of the file. Returns 0 after printing the usage if the
+ * command line is wrong.
+ */
+static int _workload_parse(int argc, char *argv[], workload_config_pt config) {
+    static const char *size_names[] = {"uniform", "zipf", "bimodal", "pow2"};
+    static const char *lifetime_names[] = {"exponential", "phased", "fifo", "lifo"};
+
+    memset(config, 0, sizeof(workload_config_t));
+    config->num_ops = WORKLOAD_DEFAULT_OPS;
+    config->num_threads = 1;
+    config->pool_size = WORKLOAD_DEFAULT_POOL_SIZE;
+    config->policy = FIRST_FIT;
+    config->min_size = WORKLOAD_DEFAULT_MIN_SIZE;
+    config->max_size = WORKLOAD_DEFAULT_MAX_SIZE;
+    config->zipf_exponent = 1.0;
+    config->live = WORKLOAD_DEFAULT_LIVE;
+    config->seed = 1;
+
+    int opt, ok = 1;
+    while (ok && (opt = getopt(argc, argv, "n:t:Sp:P:f:d:m:M:z:l:L:r:o:")) != -1){
+        switch (opt){
+            case 'n': config->num_ops = strtoul(optarg, NULL, 0); break;
+            case 't': config->num_threads = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'S': config->shared = 1; break;
+            case 'p': config->pool_size = strtoul(optarg, NULL, 0); break;
+            case 'P':
+                ok = (strcmp(optarg, "first") == 0 || strcmp(optarg, "best") == 0);
+                config->policy = (strcmp(optarg, "best") == 0) ? BEST_FIT : FIRST_FIT;
+                break;
+            case 'f': config->flags = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'd':
+                ok = 0;
+                for (unsigned d = 0; d < sizeof(size_names) / sizeof(size_names[0]); ++d){
+                    if (strcmp(optarg, size_names[d]) == 0){
+                        config->sizes = (size_dist) d;
+                        ok = 1;
+                    }
+                }
+                break;
+            case 'm': config->min_size = strtoul(optarg, NULL, 0); break;
+            case 'M': config->max_size = strtoul(optarg, NULL, 0); break;
+            case 'z': config->zipf_exponent = strtod(optarg, NULL); break;
+            case 'l':
+                ok = 0;
+                for (unsigned l = 0; l < sizeof(lifetime_names) / sizeof(lifetime_names[0]); ++l){
+                    if (strcmp(optarg, lifetime_names[l]) == 0){
+                        config->lifetime = (lifetime_dist) l;
+                        ok = 1;
+                    }
+                }
+                break;
+            case 'L': config->live = (unsigned) strtoul(optarg, NULL, 0); break;
+            case 'r': config->seed = strtoull(optarg, NULL, 0); break;
+            case 'o': config->trace_path = optarg; break;
+            default: ok = 0; break;
+        }
+    }
+    if (!ok || optind != argc || config->num_threads == 0 || config->live == 0 ||
+        config->min_size == 0 || config->min_size > config->max_size){
+        fprintf(stderr, "usage: %s [-n ops] [-t threads] [-S] [-p pool_size] [-P first|best] [-f flags]\n"
+                        "       [-d uniform|zipf|bimodal|pow2] [-m min] [-M max] [-z exponent]\n"
+                        "       [-l exponential|phased|fifo|lifo] [-L live] [-r seed] [-o trace]\n", argv[0]);
+        return 0;
+    }
+
+    if (config->sizes == SIZE_ZIPF){
+        config->zipf_num = (unsigned) ((config->max_size - config->min_size) / WORKLOAD_ZIPF_STEP + 1);
+        config->zipf_cdf = malloc(config->zipf_num * sizeof(double));
+        if (config->zipf_cdf == NULL){
+            perror("mem_workload");
+            return 0;
+        }
+        double sum = 0.0;
+        for (unsigned k = 0; k < config->zipf_num; ++k){
+            sum += 1.0 / pow(k + 1, config->zipf_exponent);
+            config->zipf_cdf[k] = sum;
+        }
+        for (unsigned k = 0; k < config->zipf_num; ++k){
+            config->zipf_cdf[k] /= sum;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function Name: _workload_rand
+ * Passed Variables: uint64_t *state
+ * Return Type: uint64_t
+ * Purpose: This function returns the next number of a xorshift64*
+ * generator, one per thread so the threads do not contend.
+ */
+static uint64_t _workload_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Function Name: _workload_uniform
+ * Passed Variables: uint64_t *state
+ * Return Type: double
+ * Purpose: This function returns a random number in [0, 1).
+ */
+static double _workload_uniform(uint64_t *state) {
+    return (double) (_workload_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Function Name: _workload_size
+ * Passed Variables: workload_thread_pt thread
+ * Return Type: size_t
+ * Purpose: This function returns the size of the next allocation.
+ * Bimodal sizes are mostly in [min, 4 * min] and otherwise in
+ * [max / 2, max]; pow2 sizes are the powers of two from min to max.
+ */
+static size_t _workload_size(workload_thread_pt thread) {
+    const workload_config_t *config = thread->config;
+    const size_t min = config->min_size, max = config->max_size;
+    switch (config->sizes){
+        case SIZE_ZIPF: {
+            const double u = _workload_uniform(&thread->rng);
+            unsigned low = 0, high = config->zipf_num - 1;
+            while (low < high){
+                const unsigned mid = (low + high) / 2;
+                if (config->zipf_cdf[mid] < u){
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            return min + (size_t) low * WORKLOAD_ZIPF_STEP;
+        }
+        case SIZE_BIMODAL:
+            if (_workload_uniform(&thread->rng) < WORKLOAD_BIMODAL_SMALL){
+                const size_t top = (4 * min < max) ? 4 * min : max;
+                return min + _workload_rand(&thread->rng) % (top - min + 1);
+            } else {
+                const size_t bottom = (max / 2 > min) ? max / 2 : min;
+                return bottom + _workload_rand(&thread->rng) % (max - bottom + 1);
+            }
+        case SIZE_POW2: {
+            size_t size = 1;
+            while (size < min){
+                size <<= 1;
+            }
+            unsigned num = 0;
+            for (size_t s = size; s <= max; s <<= 1){
+                ++num;
+            }
+            return (num == 0) ? min : size << (_workload_rand(&thread->rng) % num);
+        }
+        case SIZE_UNIFORM:
+        default:
+            return min + _workload_rand(&thread->rng) % (max - min + 1);
+    }
+}
+
+/*
+ * Function Name: _workload_live_grow
+ * Passed Variables: live_set_pt live
+ * Return Type: int
+ * Purpose: This function doubles the room of a live set, keeping a ring
+ * in order. Returns 0 if out of memory.
+ */
+static int _workload_live_grow(live_set_pt live) {
+    const size_t capacity = (live->capacity == 0) ? 1024 : live->capacity * 2;
+    alloc_pt *allocs = malloc(capacity * sizeof(alloc_pt));
+    uint64_t *deaths = malloc(capacity * sizeof(uint64_t));
+    if (allocs == NULL || deaths == NULL){
+        free(allocs);
+        free(deaths);
+        return 0;
+    }
+    for (size_t i = 0; i < live->count; ++i){
+        allocs[i] = live->allocs[(live->head + i) % live->capacity];
+        deaths[i] = live->deaths[(live->head + i) % live->capacity];
+    }
+    free(live->allocs);
+    free(live->deaths);
+    live->allocs = allocs;
+    live->deaths = deaths;
+    live->head = 0;
+    live->capacity = capacity;
+    return 1;
+}
+
+/*
+ * Function Name: _workload_heap_push
+ * Passed Variables: live_set_pt live, alloc_pt alloc, uint64_t death
+ * Return Type: void
+ * Purpose: This function adds an allocation to a heap live set. There
+ * must be room for it.
+ */
+static void _workload_heap_push(live_set_pt live, alloc_pt alloc, uint64_t death) {
+    size_t i = live->count++;
+    while (i > 0 && live->deaths[(i - 1) / 2] > death){
+        live->allocs[i] = live->allocs[(i - 1) / 2];
+        live->deaths[i] = live->deaths[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    live->allocs[i] = alloc;
+    live->deaths[i] = death;
+}
+
+/*
+ * Function Name: _workload_heap_pop
+ * Passed Variables: live_set_pt live
+ * Return Type: alloc_pt
+ * Purpose: This function takes the allocation that dies first off a
+ * heap live set that is not empty.
+ */
+static alloc_pt _workload_heap_pop(live_set_pt live) {
+    alloc_pt top = live->allocs[0];
+    const alloc_pt last = live->allocs[--live->count];
+    const uint64_t death = live->deaths[live->count];
+    size_t i = 0;
+    for (;;){
+        size_t child = 2 * i + 1;
+        if (child >= live->count){
+            break;
+        }
+        if (child + 1 < live->count && live->deaths[child + 1] < live->deaths[child]){
+            ++child;
+        }
+        if (live->deaths[child] >= death){
+            break;
+        }
+        live->allocs[i] = live->allocs[child];
+        live->deaths[i] = live->deaths[child];
+        i = child;
+    }
+    live->allocs[i] = last;
+    live->deaths[i] = death;
+    return top;
+}
+
+/*
+ * Function Name: _workload_take
+ * Passed Variables: workload_thread_pt thread, uint64_t clock
+ * Return Type: alloc_pt
+ * Purpose: This function takes the allocation to free next off the live
+ * set, according to the lifetime distribution: the first to die by clock,
+ * the oldest, the newest, or a random one. Returns NULL if there is none.
+ */
+static alloc_pt _workload_take(workload_thread_pt thread, uint64_t clock) {
+    live_set_pt live = &thread->live;
+    if (live->count == 0){
+        return NULL;
+    }
+    switch (thread->config->lifetime){
+        case LIFE_EXPONENTIAL:
+            return (live->deaths[0] <= clock) ? _workload_heap_pop(live) : NULL;
+        case LIFE_FIFO: {
+            alloc_pt alloc = live->allocs[live->head];
+            live->head = (live->head + 1) % live->capacity;
+            live->count--;
+            return alloc;
+        }
+        case LIFE_PHASED: {
+            /* swap a random one with the newest */
+            const size_t newest = (live->head + live->count - 1) % live->capacity;
+            const size_t pick = (live->head + _workload_rand(&thread->rng) % live->count) % live->capacity;
+            alloc_pt alloc = live->allocs[pick];
+            live->allocs[pick] = live->allocs[newest];
+            live->count--;
+            return alloc;
+        }
+        case LIFE_LIFO:
+        default:
+            return live->allocs[(live->head + --live->count) % live->capacity];
+    }
+}
+
+/*
+ * Function Name: _workload_free
+ * Passed Variables: workload_thread_pt thread, alloc_pt alloc
+ * Return Type: void
+ * Purpose: This function frees an allocation of the thread, timing it.
+ */
+static void _workload_free(workload_thread_pt thread, alloc_pt alloc) {
+    const uint64_t start = mem_bench_now_ns();
+    mem_del_alloc(thread->pool, alloc);
+    mem_bench_latency_add(&thread->free_latency, mem_bench_now_ns() - start);
+    thread->frees++;
+}
+
+/*
+ * Function Name: _workload_run
+ * Passed Variables: void *arg
+ * Return Type: void *
+ * Purpose: This function is the body of a thread: its share of the
+ * operations, each an allocation or the deallocation the lifetime
+ * distribution calls for. The clock of the exponential lifetime counts
+ * allocations, so by Little's law about live allocations are live at a
+ * time. After a failed allocation the next operation frees, if it can.
+ */
+static void *_workload_run(void *arg) {
+    workload_thread_pt thread = arg;
+    const workload_config_t *config = thread->config;
+    live_set_pt live = &thread->live;
+    const unsigned long num_ops = config->num_ops / config->num_threads;
+    uint64_t clock = 0;
+    int growing = 1, failed = 0;
+
+    for (unsigned long op = 0; op < num_ops; ++op){
+        int release;
+        switch (config->lifetime){
+            case LIFE_EXPONENTIAL:
+                release = (live->count > 0 && live->deaths[0] <= clock);
+                break;
+            case LIFE_PHASED:
+                if (growing && live->count >= config->live){
+                    growing = 0;
+                } else if (!growing && live->count <= config->live * WORKLOAD_PHASED_SURVIVORS){
+                    growing = 1;
+                }
+                release = !growing;
+                break;
+            case LIFE_LIFO:
+                release = (live->count >= config->live ||
+                           (live->count > 0 && (_workload_rand(&thread->rng) & 1)));
+                break;
+            case LIFE_FIFO:
+            default:
+                release = (live->count >= config->live);
+                break;
+        }
+        if (failed && live->count > 0){
+            release = 1;
+        }
+
+        if (release){
+            alloc_pt alloc = _workload_take(thread, (config->lifetime == LIFE_EXPONENTIAL && !failed) ?
+                                                    clock : UINT64_MAX);
+            if (alloc != NULL){
+                _workload_free(thread, alloc);
+            }
+            failed = 0;
+            continue;
+        }
+
+        if (live->count == live->capacity && !_workload_live_grow(live)){
+            perror("mem_workload");
+            exit(1);
+        }
+        const size_t size = _workload_size(thread);
+        const uint64_t start = mem_bench_now_ns();
+        alloc_pt alloc = mem_new_alloc(thread->pool, size);
+        mem_bench_latency_add(&thread->alloc_latency, mem_bench_now_ns() - start);
+        if (alloc == NULL){
+            thread->failed++;
+            failed = 1;
+            continue;
+        }
+        thread->allocs++;
+        ++clock;
+        if (config->lifetime == LIFE_EXPONENTIAL){
+            const double lifetime = -log(1.0 - _workload_uniform(&thread->rng)) * config->live;
+            _workload_heap_push(live, alloc, clock + (uint64_t) lifetime);
+        } else {
+            live->allocs[(live->head + live->count) % live->capacity] = alloc;
+            live->count++;
+        }
+    }
+    return NULL;
+}
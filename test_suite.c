@@ -2,8 +2,16 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _GNU_SOURCE // for rand_r() and clock_gettime()
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -11,6 +19,7 @@
 
 #include "cmocka.h"
 #include "mem_pool.h"
+#include "mem_trace.h"
 #include "test_suite.h"
 
 
@@ -2316,132 +2325,1750 @@ static void test_pool_scenario19(void **state) {
 }
 
 /*******************************************/
-/***          5. STRESS TEST             ***/
-/***                                     ***/
-/***         [non-functional]            ***/
-/***         [see NOTE below]            ***/
+/***         5. POOL EXTENSIONS          ***/
 /*******************************************/
 
-void test_pool_stresstest(void **state) {
+static void test_pool_clone(void **state) {
     (void) state; /* unused */
 
-    const unsigned num_pools = 200;
-    const unsigned num_allocations = 1000;
-    const unsigned min_alloc_size = 10;
-    const unsigned pool_size =
-            (num_allocations / 2) *
-            (2 * min_alloc_size + (num_allocations - 1) * min_alloc_size);
-    assert_int_equal(pool_size, 5005000);
+    /*
+     * Clone:
+     *
+     * 1. Open a cloneable pool, allocate 100 and 1000, fill the 100.
+     * 2. Clone the pool. Overwrite the 100 in the pool.
+     * 3. The clone still sees the old contents and the same segments.
+     * 4. Deallocating in the clone does not touch the pool.
+     * 5. Clone the (now diverged) pool again.
+     * 6. Blocks in the thread cache of a POOL_THREAD_CACHE pool are
+     *    free in its clone.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
 
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_CLONEABLE);
+    assert_non_null(pool);
 
-    pool_pt pools[num_pools];
-    alloc_pt allocations[num_pools][num_allocations];
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc1);
+    memset(alloc0->mem, 'a', alloc0->size);
+
+    pool_segment_t exp0[3] =
+            {
+                    {100, 1},
+                    {1000, 1},
+                    {POOL_SIZE - 1100, 0}
+            };
+    pool_segment_t exp1[2] =
+            {
+                    {100, 1},
+                    {POOL_SIZE - 100, 0}
+            };
+
+    INFO("Cloning pool\n");
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    assert_true(clone->mem != pool->mem);
+    check_pool(clone, exp0);
+
+    memset(alloc0->mem, 'b', alloc0->size);
+
+    alloc_pt clone0 = mem_pool_clone_alloc(clone, pool, alloc0);
+    alloc_pt clone1 = mem_pool_clone_alloc(clone, pool, alloc1);
+    assert_non_null(clone0);
+    assert_non_null(clone1);
+    assert_true(clone0->mem - clone->mem == alloc0->mem - pool->mem);
+    assert_int_equal(clone0->mem[0], 'a');
+    assert_int_equal(clone0->mem[99], 'a');
+    assert_int_equal(alloc0->mem[0], 'b');
+
+    assert_int_equal(mem_del_alloc(clone, clone1), ALLOC_OK);
+    check_pool(clone, exp1);
+    check_pool(pool, exp0);
+
+    INFO("Cloning diverged pool\n");
+    pool_pt clone2 = mem_pool_clone(pool);
+    assert_non_null(clone2);
+    alloc_pt clone20 = mem_pool_clone_alloc(clone2, pool, alloc0);
+    alloc_pt clone21 = mem_pool_clone_alloc(clone2, pool, alloc1);
+    assert_non_null(clone20);
+    assert_non_null(clone21);
+    assert_int_equal(clone20->mem[0], 'b');
+    check_pool(clone2, exp0);
+
+    // clean up
+    assert_int_equal(mem_del_alloc(clone2, clone21), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(clone2, clone20), ALLOC_OK);
+    assert_int_equal(mem_pool_close(clone2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(clone, clone0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Cloning pool with a thread cache\n");
+    pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_THREAD_CACHE);
+    assert_non_null(pool);
+    alloc0 = mem_new_alloc(pool, 64);
+    assert_non_null(alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_true(pool->num_allocs > 0);
+    clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    assert_int_equal(clone->num_allocs, 0);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+typedef struct _churn_arg {
+    pool_pt pool;
+    unsigned id;
+    unsigned num_ops;
+    unsigned errors;
+} churn_arg_t;
+
+#define CHURN_MAX_LIVE 32
+
+static void *churn_thread(void *arg) {
+    churn_arg_t *churn = arg;
+    alloc_pt allocs[CHURN_MAX_LIVE] = {NULL};
+    unsigned seed = churn->id + 1;
+
+    for (unsigned op = 0; op < churn->num_ops; ++op) {
+        unsigned slot = rand_r(&seed) % CHURN_MAX_LIVE;
+        if (allocs[slot]) {
+            // every byte must still carry this thread's fill pattern
+            for (size_t b = 0; b < allocs[slot]->size; ++b) {
+                if (allocs[slot]->mem[b] != (char) churn->id) {
+                    churn->errors++;
+                    break;
+                }
+            }
+            if (mem_del_alloc(churn->pool, allocs[slot]) != ALLOC_OK)
+                churn->errors++;
+            allocs[slot] = NULL;
+        } else {
+            size_t size = 16 + rand_r(&seed) % 512;
+            allocs[slot] = mem_new_alloc(churn->pool, size);
+            if (!allocs[slot]) {
+                churn->errors++;
+                continue;
+            }
+            memset(allocs[slot]->mem, (char) churn->id, allocs[slot]->size);
+        }
+    }
+    for (unsigned slot = 0; slot < CHURN_MAX_LIVE; ++slot) {
+        if (allocs[slot] && mem_del_alloc(churn->pool, allocs[slot]) != ALLOC_OK)
+            churn->errors++;
+    }
+
+    return NULL;
+}
+
+static double churn_pool(pool_pt pool, unsigned num_threads, unsigned num_ops) {
+    pthread_t threads[num_threads];
+    churn_arg_t args[num_threads];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < num_threads; ++i) {
+        args[i] = (churn_arg_t) {pool, i + 1, num_ops, 0};
+        assert_int_equal(pthread_create(&threads[i], NULL, churn_thread, &args[i]), 0);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        assert_int_equal(args[i].errors, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return num_threads * num_ops / seconds;
+}
+
+static void *fork_churn_thread(void *arg) {
+    pool_pt pool = arg;
+
+    for (unsigned i = 0; i < 20000; ++i) {
+        alloc_pt alloc = mem_new_alloc(pool, 16 + i % 200);
+        if (alloc)
+            mem_del_alloc(pool, alloc);
+    }
+
+    return NULL;
+}
+
+static void test_pool_threads(void **state) {
+    (void) state; /* unused */
 
     /*
-     * NOTE: This will work iff the address of the allocation
-     * in the pool is returned to the user instead of the
-     * address of the allocation record. Since allocation records
-     * are a part of the nodes, when the node heap is reallocated
-     * the node addresses shift with it, and so do the allocation
-     * record addresses. The allocation addresses on the pool
-     * remain the same, however, so they can be returned to the
-     * user and gotten from the user upon request for deletion.
+     * Threads:
+     *
+     * 1. Open a locked pool, and a pool with thread caches.
+     * 2. 1 and 4 threads churn allocations of random sizes,
+     *    checking that nobody else wrote into their allocations.
+     * 3. The pool is a single gap again.
+     * 4. Fork with the pool locked while a thread churns it. The child
+     *    unlocks its copy and can allocate from it.
      */
 
+    const unsigned num_threads[] = {1, 4};
+    const unsigned pool_flags[] = {POOL_LOCKED, POOL_THREAD_CACHE};
+    const unsigned num_ops = 20000;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (int f = 0; f < 2; ++f) {
+        for (int p = 0; p < 2; ++p) {
+            alloc_policy POOL_POLICY = p ? BEST_FIT : FIRST_FIT;
+            pool_pt pool = mem_pool_open_ex(POOL_SIZE, POOL_POLICY, pool_flags[f]);
+            assert_non_null(pool);
+
+            for (int t = 0; t < 2; ++t) {
+                double ops = churn_pool(pool, num_threads[t], num_ops);
+                INFO("%s, %s, %u threads: %.0f ops/s\n",
+                     (pool_flags[f] == POOL_LOCKED) ? "POOL_LOCKED" : "POOL_THREAD_CACHE",
+                     (POOL_POLICY == FIRST_FIT) ? "FIRST_FIT" : "BEST_FIT",
+                     num_threads[t], ops);
+
+                pool_segment_t exp0[1] =
+                        {
+                                {POOL_SIZE, 0}
+                        };
+                check_pool(pool, exp0);
+                assert_int_equal(pool->num_allocs, 0);
+                assert_int_equal(pool->alloc_size, 0);
+            }
+
+            assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+        }
+    }
+
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LOCKED);
+    assert_non_null(pool);
+    pthread_t churner;
+    assert_int_equal(pthread_create(&churner, NULL, fork_churn_thread, pool), 0);
+    for (int i = 0; i < 8; ++i) {
+        assert_int_equal(mem_pool_lock(pool), ALLOC_OK);
+        const pid_t child = fork();
+        if (child == 0) {
+            mem_pool_unlock(pool);
+            alloc_pt alloc = mem_new_alloc(pool, 100);
+            _exit(alloc != NULL && mem_del_alloc(pool, alloc) == ALLOC_OK ? 0 : 1);
+        }
+        assert_int_equal(mem_pool_unlock(pool), ALLOC_OK);
+        assert_true(child > 0);
+        int status = 0;
+        assert_int_equal(waitpid(child, &status, 0), child);
+        assert_true(WIFEXITED(status));
+        assert_int_equal(WEXITSTATUS(status), 0);
+    }
+    assert_int_equal(pthread_join(churner, NULL), 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *tcache_exit_thread(void *arg) {
+    pool_pt pool = arg;
+    alloc_pt allocs[8];
+
+    for (unsigned i = 0; i < 8; ++i) {
+        allocs[i] = mem_new_alloc(pool, 64);
+    }
+    for (unsigned i = 0; i < 8; ++i) {
+        if (allocs[i])
+            mem_del_alloc(pool, allocs[i]);
+    }
+
+    return NULL;
+}
+
+static void test_pool_thread_cache(void **state) {
+    (void) state; /* unused */
+
     /*
-     * Testing dynamic reallocation of pool structures:
+     * Thread cache:
      *
-     * 1. 200 pools of 5005000 each (many pools)
-     * 2. In each pool 1000 allocations of different sizes (many allocations)
-     * 3. In each pool 500 deallocations (many gaps)
+     * 1. Allocate 100 from a pool with thread caches. It is rounded up
+     *    to 128 and the cache is refilled with a batch of 128s.
+     * 2. Deallocate it, twice, which fails, and allocate 120. The
+     *    cached block comes back, once.
+     * 3. Flushing the cache leaves only the live allocation.
+     * 4. Closing the pool with a live allocation flushes the cache too.
+     * 5. Cloning while threads with caches exit. Once they are gone a
+     *    clone has nothing allocated.
      */
 
-    // initialize store
     assert_int_equal(mem_init(), ALLOC_OK);
 
-    // allocate pools
-    for (unsigned pix=0; pix < num_pools; ++pix) {
-        // open pool
-        pools[pix] =
-                mem_pool_open(pool_size, (pix % 2) ? FIRST_FIT : BEST_FIT);
-        assert_non_null(pools[pix]);
-        // allocate pool
-        unsigned allocated = 0;
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            allocations[pix][aix] =
-                    mem_new_alloc(pools[pix], (aix + 1) * min_alloc_size);
-            allocated += (aix + 1) * min_alloc_size;
-            if (!allocations[pix][aix]) {
-                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %u\n", pix, aix, allocated);
-            }
-            assert_non_null(allocations[pix][aix]);
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_THREAD_CACHE);
+    assert_non_null(pool);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_int_equal(alloc0->size, 128);
+    assert_true(pool->num_allocs > 1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    alloc_pt alloc1 = mem_new_alloc(pool, 120);
+    assert_true(alloc1 == alloc0);
+    alloc_pt alloc2 = mem_new_alloc(pool, 120);
+    assert_true(alloc2 != alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+    assert_int_equal(mem_pool_flush_thread_cache(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 1);
+    assert_int_equal(pool->alloc_size, 128);
+
+    mem_new_alloc(pool, 16);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(pool->num_allocs, 2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_flush_thread_cache(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 1);
+
+    INFO("Cloning while threads exit\n");
+    pool_pt shared = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LOCKED | POOL_THREAD_CACHE);
+    assert_non_null(shared);
+    for (unsigned round = 0; round < 16; ++round) {
+        pthread_t threads[4];
+        for (unsigned i = 0; i < 4; ++i) {
+            assert_int_equal(pthread_create(&threads[i], NULL, tcache_exit_thread, shared), 0);
         }
-        // delete every other allocation
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (aix % 2) {
-                assert_int_equal(
-                        mem_del_alloc(pools[pix], allocations[pix][aix]),
-                        ALLOC_OK);
-                allocations[pix][aix] = NULL;
-            }
+        for (unsigned i = 0; i < 4; ++i) {
+            pool_pt clone = mem_pool_clone(shared);
+            assert_non_null(clone);
+            // a thread may hold a block right now, then the clone keeps it
+            mem_pool_close(clone);
+        }
+        for (unsigned i = 0; i < 4; ++i) {
+            assert_int_equal(pthread_join(threads[i], NULL), 0);
         }
     }
+    pool_pt clone = mem_pool_clone(shared);
+    assert_non_null(clone);
+    assert_int_equal(clone->num_allocs, 0);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_pool_close(shared), ALLOC_OK);
 
-    // delete pools
-    for (unsigned pix=0; pix < num_pools; ++pix) {
-        // delete pool's allocations
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (allocations[pix][aix]) {
-                // delete allocation
-                assert_int_equal(
-                    mem_del_alloc(pools[pix], allocations[pix][aix]),
-                    ALLOC_OK);
-            }
+    // the 16 is still out, so this only works because mem_free releases everything
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void *open_close_thread(void *arg) {
+    churn_arg_t *churn = arg;
+    pool_pt pools[8] = {NULL};
+    unsigned seed = churn->id + 1;
+
+    for (unsigned op = 0; op < churn->num_ops; ++op) {
+        unsigned slot = rand_r(&seed) % 8;
+        if (pools[slot]) {
+            if (mem_pool_close(pools[slot]) != ALLOC_OK)
+                churn->errors++;
+            pools[slot] = NULL;
+        } else {
+            pools[slot] = mem_pool_open(1000, (op % 2) ? FIRST_FIT : BEST_FIT);
+            if (!pools[slot])
+                churn->errors++;
         }
-        // close pool
-        assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
+    }
+    for (unsigned slot = 0; slot < 8; ++slot) {
+        if (pools[slot] && mem_pool_close(pools[slot]) != ALLOC_OK)
+            churn->errors++;
+    }
+
+    return NULL;
+}
+
+static void test_pool_store_threads(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Pool store threads:
+     *
+     * 1. 4 threads open and close small pools at random,
+     *    keeping up to 8 open each.
+     * 2. Every open and close succeeds.
+     */
+
+    const unsigned num_threads = 4;
+    const unsigned num_ops = 20000;
+    pthread_t threads[num_threads];
+    churn_arg_t args[num_threads];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned i = 0; i < num_threads; ++i) {
+        args[i] = (churn_arg_t) {NULL, i + 1, num_ops, 0};
+        assert_int_equal(pthread_create(&threads[i], NULL, open_close_thread, &args[i]), 0);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        assert_int_equal(args[i].errors, 0);
     }
 
-    // free store
     assert_int_equal(mem_free(), ALLOC_OK);
 }
 
+static void test_pool_sharded(void **state) {
+    (void) state; /* unused */
 
-/*******************************************/
-/***         6. DRIVER ROUTINE           ***/
-/*******************************************/
+    /*
+     * Sharded pool:
+     *
+     * 1. Open a pool of 4 shards of 4096.
+     * 2. Allocate 3000 five times: one per shard, the 5th fails.
+     *    A size larger than a shard fails.
+     * 3. Deallocate through the pool, close.
+     * 4. Threads churn a sharded pool with thread caches.
+     * 5. A small pool gets fewer shards, one too small for a word
+     *    is not opened.
+     */
 
-int run_test_suite() {
-    const struct CMUnitTest tests[] = {
-            cmocka_unit_test(test_pool_store_smoketest),
-            cmocka_unit_test(test_pool_smoketest),
+    const size_t shard_size = 4096;
 
-            cmocka_unit_test(test_pool_nonempty),
+    assert_int_equal(mem_init(), ALLOC_OK);
 
-            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+    pool_pt pool = mem_pool_open_sharded(4 * shard_size, FIRST_FIT, 4, POOL_DEFAULT);
+    assert_non_null(pool);
 
-            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+    pool_segment_t exp0[4] =
+            {
+                    {shard_size, 0},
+                    {shard_size, 0},
+                    {shard_size, 0},
+                    {shard_size, 0}
+            };
+    check_pool(pool, exp0);
 
-            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+    alloc_pt allocs[4];
+    for (int i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, 3000);
+        assert_non_null(allocs[i]);
+    }
+    assert_null(mem_new_alloc(pool, 3000));
+    assert_null(mem_new_alloc(pool, shard_size + 1));
+    assert_null(mem_pool_clone(pool));
+
+    pool_segment_t exp1[8] =
+            {
+                    {3000, 1},
+                    {shard_size - 3000, 0},
+                    {3000, 1},
+                    {shard_size - 3000, 0},
+                    {3000, 1},
+                    {shard_size - 3000, 0},
+                    {3000, 1},
+                    {shard_size - 3000, 0}
+            };
+    check_pool(pool, exp1);
+    assert_int_equal(pool->num_allocs, 4);
+    assert_int_equal(pool->alloc_size, 4 * 3000);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    alloc_t foreign = {10, (char *) &foreign};
+    assert_int_equal(mem_del_alloc(pool, &foreign), ALLOC_FAIL);
+    for (int i = 3; i >= 0; --i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_pool(pool, exp0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_sharded(POOL_SIZE, BEST_FIT, 0, POOL_THREAD_CACHE);
+    assert_non_null(pool);
+    INFO("Sharded, POOL_THREAD_CACHE, 4 threads: %.0f ops/s\n", churn_pool(pool, 4, 20000));
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_sharded(20, FIRST_FIT, 4, POOL_DEFAULT);
+    assert_non_null(pool);
+    alloc_pt alloc = mem_new_alloc(pool, 20);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_null(mem_pool_open_sharded(4, FIRST_FIT, 4, POOL_DEFAULT));
+    assert_null(mem_pool_open_partitioned(4, FIRST_FIT, 0));
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_partitioned(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Partitioned pool:
+     *
+     * 1. Open a pool of 4 regions of 4096.
+     * 2. Allocate 3000 four times, then 1000 four times: every
+     *    region holds one of each. A fifth 1000 fails.
+     * 3. Free the 3000 of region 2: 2500 now fits there only.
+     * 4. Free all, the pool is 4 gaps again. Threads churn a
+     *    partitioned pool with the default number of regions.
+     */
+
+    const size_t region_size = 4096;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_partitioned(4 * region_size, FIRST_FIT, 4);
+    assert_non_null(pool);
+
+    alloc_pt big[4], small[4];
+    for (int i = 0; i < 4; ++i) {
+        big[i] = mem_new_alloc(pool, 3000);
+        assert_non_null(big[i]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        small[i] = mem_new_alloc(pool, 1000);
+        assert_non_null(small[i]);
+    }
+    assert_null(mem_new_alloc(pool, 1000));
+
+    pool_segment_t exp0[12] =
+            {
+                    {3000, 1},
+                    {1000, 1},
+                    {region_size - 4000, 0},
+                    {3000, 1},
+                    {1000, 1},
+                    {region_size - 4000, 0},
+                    {3000, 1},
+                    {1000, 1},
+                    {region_size - 4000, 0},
+                    {3000, 1},
+                    {1000, 1},
+                    {region_size - 4000, 0}
+            };
+    check_pool(pool, exp0);
+
+    assert_int_equal(mem_del_alloc(pool, big[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, big[2]), ALLOC_FAIL);
+    big[2] = mem_new_alloc(pool, 2500);
+    assert_non_null(big[2]);
+    assert_true(big[2]->mem == pool->mem + 2 * region_size);
+
+    for (int i = 0; i < 4; ++i) {
+        assert_int_equal(mem_del_alloc(pool, big[i]), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+
+    pool_segment_t exp1[4] =
+            {
+                    {region_size, 0},
+                    {region_size, 0},
+                    {region_size, 0},
+                    {region_size, 0}
+            };
+    check_pool(pool, exp1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_partitioned(POOL_SIZE, BEST_FIT, 0);
+    assert_non_null(pool);
+    INFO("Partitioned, 4 threads: %.0f ops/s\n", churn_pool(pool, 4, 20000));
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+typedef struct _remote_free_arg {
+    pool_pt pool;
+    alloc_pt *allocs;
+    unsigned num_allocs;
+    unsigned errors;
+} remote_free_arg_t;
+
+static void *remote_free_thread(void *arg) {
+    remote_free_arg_t *remote = arg;
+
+    for (unsigned i = 0; i < remote->num_allocs; ++i) {
+        if (mem_del_alloc(remote->pool, remote->allocs[i]) != ALLOC_OK)
+            remote->errors++;
+    }
+
+    return NULL;
+}
+
+static void *remote_clone_thread(void *arg) {
+    pool_pt *pools = arg;
+
+    pools[1] = mem_pool_clone(pools[0]);
+
+    return NULL;
+}
+
+static void test_pool_remote_free(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Remote free:
+     *
+     * 1. Open a POOL_REMOTE_FREE pool, allocate 4 x 1000 blocks of 100.
+     * 2. 4 threads free 1000 each while the owner allocates and
+     *    frees on its own.
+     * 3. The remote frees stay queued until the owner allocates again.
+     * 4. The pool is a single gap again.
+     * 5. A queued free is free in a clone made by another thread,
+     *    and is taken back on close.
+     */
+
+    const unsigned num_threads = 4;
+    const unsigned num_allocs = 1000;
+    pthread_t threads[num_threads];
+    remote_free_arg_t args[num_threads];
+    alloc_pt allocs[num_threads * num_allocs];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, POOL_REMOTE_FREE);
+    assert_non_null(pool);
+
+    for (unsigned i = 0; i < num_threads * num_allocs; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+
+    for (unsigned i = 0; i < num_threads; ++i) {
+        args[i] = (remote_free_arg_t) {pool, allocs + i * num_allocs, num_allocs, 0};
+        assert_int_equal(pthread_create(&threads[i], NULL, remote_free_thread, &args[i]), 0);
+    }
+    for (unsigned op = 0; op < num_allocs; ++op) {
+        alloc_pt alloc = mem_new_alloc(pool, 10 + op % 200);
+        assert_non_null(alloc);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        assert_int_equal(args[i].errors, 0);
+    }
+
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    assert_int_equal(pool->num_allocs, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    pool_segment_t exp0[1] =
+            {
+                    {POOL_SIZE, 0}
+            };
+    check_pool(pool, exp0);
+
+    // a queued free is taken back on close
+    alloc = mem_new_alloc(pool, 100);
+    args[0] = (remote_free_arg_t) {pool, &alloc, 1, 0};
+    assert_int_equal(pthread_create(&threads[0], NULL, remote_free_thread, &args[0]), 0);
+    assert_int_equal(pthread_join(threads[0], NULL), 0);
+    assert_int_equal(pool->num_allocs, 1);
+    pool_pt pools[2] = {pool, NULL};
+    assert_int_equal(pthread_create(&threads[0], NULL, remote_clone_thread, pools), 0);
+    assert_int_equal(pthread_join(threads[0], NULL), 0);
+    assert_non_null(pools[1]);
+    assert_int_equal(pools[1]->num_allocs, 0);
+    assert_int_equal(mem_pool_close(pools[1]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+typedef struct _epoch_arg {
+    _Atomic(alloc_pt) *shared;
+    atomic_int *stop;
+    unsigned errors;
+} epoch_arg_t;
+
+static void *epoch_reader_thread(void *arg) {
+    epoch_arg_t *reader = arg;
+
+    while (!atomic_load(reader->stop)) {
+        mem_epoch_enter();
+        alloc_pt alloc = atomic_load(reader->shared);
+        // the writer fills every allocation with one byte value
+        for (size_t b = 1; b < alloc->size; ++b) {
+            if (alloc->mem[b] != alloc->mem[0]) {
+                reader->errors++;
+                break;
+            }
+        }
+        mem_epoch_exit();
+    }
+
+    return NULL;
+}
+
+static void *epoch_pin_thread(void *arg) {
+    epoch_arg_t *reader = arg;
+
+    mem_epoch_enter();
+    atomic_store(reader->stop, 1);
+    while (atomic_load(reader->stop) == 1)
+        ;
+    mem_epoch_exit();
+
+    return NULL;
+}
+
+static void test_pool_epoch(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Epoch-based reclamation:
+     *
+     * 1. A thread stays in a critical section. A deferred
+     *    deallocation is not reclaimed until it leaves.
+     * 2. 4 readers read a shared allocation without locks while
+     *    the writer replaces it and defers the old one. No reader
+     *    sees an allocation reused under it.
+     * 3. A clone has the deferred deallocations still in limbo
+     *    free, and closes.
+     * 4. Close reclaims what is left.
+     */
+
+    const unsigned num_readers = 4;
+    pthread_t threads[num_readers];
+    epoch_arg_t args[num_readers];
+    atomic_int stop = 0;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LOCKED);
+    assert_non_null(pool);
+
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    args[0] = (epoch_arg_t) {NULL, &stop, 0};
+    assert_int_equal(pthread_create(&threads[0], NULL, epoch_pin_thread, &args[0]), 0);
+    while (atomic_load(&stop) == 0)
+        ;
+    assert_int_equal(mem_del_alloc_deferred(pool, alloc), ALLOC_OK);
+    for (int i = 0; i < 4; ++i) {
+        assert_int_equal(mem_pool_reclaim(pool), 0);
+    }
+    assert_int_equal(pool->num_allocs, 1);
+    atomic_store(&stop, 2);
+    assert_int_equal(pthread_join(threads[0], NULL), 0);
+    unsigned reclaimed = 0;
+    for (int i = 0; i < 3; ++i) {
+        reclaimed += mem_pool_reclaim(pool);
+    }
+    assert_int_equal(reclaimed, 1);
+    assert_int_equal(pool->num_allocs, 0);
+
+    INFO("Readers and a writer\n");
+    _Atomic(alloc_pt) shared = mem_new_alloc(pool, 64);
+    memset(shared->mem, 0, shared->size);
+    atomic_store(&stop, 0);
+    for (unsigned i = 0; i < num_readers; ++i) {
+        args[i] = (epoch_arg_t) {&shared, &stop, 0};
+        assert_int_equal(pthread_create(&threads[i], NULL, epoch_reader_thread, &args[i]), 0);
+    }
+    for (unsigned op = 1; op <= 5000; ++op) {
+        alloc = mem_new_alloc(pool, 64);
+        assert_non_null(alloc);
+        memset(alloc->mem, (char) op, alloc->size);
+        assert_int_equal(mem_del_alloc_deferred(pool, atomic_exchange(&shared, alloc)), ALLOC_OK);
+    }
+    atomic_store(&stop, 1);
+    for (unsigned i = 0; i < num_readers; ++i) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        assert_int_equal(args[i].errors, 0);
+    }
+
+    assert_int_equal(mem_del_alloc_deferred(pool, atomic_load(&shared)), ALLOC_OK);
+    assert_true(pool->num_allocs > 0);
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    assert_int_equal(clone->num_allocs, 0);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_compact(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Compaction:
+     *
+     * 1. Allocate 100, 200, 300, 400 and 500, each filled with its
+     *    own byte. Free the 100 and the 300, pin the 400.
+     * 2. Compact: the 200 slides to the start, the 400 stays with a
+     *    gap before it, the 500 slides down to it.
+     * 3. Unpin and compact again: one gap at the end.
+     * 4. The contents survive. Compacting an empty pool is a no-op.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    alloc_pt allocs[5];
+    for (int i = 0; i < 5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100 * (i + 1));
+        assert_non_null(allocs[i]);
+        memset(allocs[i]->mem, 'a' + i, allocs[i]->size);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pin_alloc(pool, allocs[3]), ALLOC_OK);
+    assert_int_equal(mem_pin_alloc(pool, allocs[0]), ALLOC_FAIL);
+    char *pinned_mem = allocs[3]->mem;
+
+    assert_int_equal(mem_pool_compact(pool), ALLOC_OK);
+    pool_segment_t exp0[5] =
+            {
+                    {200, 1},
+                    {400, 0},
+                    {400, 1},
+                    {500, 1},
+                    {POOL_SIZE - 1500, 0}
+            };
+    check_pool(pool, exp0);
+    assert_true(allocs[1]->mem == pool->mem);
+    assert_true(allocs[3]->mem == pinned_mem);
+    assert_int_equal(pool->num_gaps, 2);
+
+    assert_int_equal(mem_unpin_alloc(pool, allocs[3]), ALLOC_OK);
+    assert_int_equal(mem_unpin_alloc(pool, allocs[3]), ALLOC_FAIL);
+    assert_int_equal(mem_pool_compact(pool), ALLOC_OK);
+    pool_segment_t exp1[4] =
+            {
+                    {200, 1},
+                    {400, 1},
+                    {500, 1},
+                    {POOL_SIZE - 1100, 0}
+            };
+    check_pool(pool, exp1);
+    for (int i = 1; i < 5; i += (i == 1) ? 2 : 1) {
+        for (size_t b = 0; b < allocs[i]->size; ++b) {
+            assert_int_equal(allocs[i]->mem[b], 'a' + i);
+        }
+    }
+
+    // the freed space is usable, the moved allocations can be freed
+    alloc_pt big = mem_new_alloc(pool, POOL_SIZE - 1100);
+    assert_non_null(big);
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+    for (int i = 1; i < 5; i += (i == 1) ? 2 : 1) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_compact(pool), ALLOC_OK);
+    pool_segment_t exp2[1] =
+            {
+                    {POOL_SIZE, 0}
+            };
+    check_pool(pool, exp2);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_compact_step(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Incremental compaction:
+     *
+     * 1. Allocate 100, 200, 300, 400 and 500, each filled with its
+     *    own byte. Free the 100 and the 300.
+     * 2. A step with a budget of 1 byte moves one allocation.
+     * 3. The next step carries on with the next allocation.
+     * 4. A large budget finishes the pass, the contents survive.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    alloc_pt allocs[5];
+    for (int i = 0; i < 5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100 * (i + 1));
+        assert_non_null(allocs[i]);
+        memset(allocs[i]->mem, 'a' + i, allocs[i]->size);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+
+    compact_progress_t progress;
+    assert_int_equal(mem_pool_compact_step(pool, 1, &progress), ALLOC_OK);
+    pool_segment_t exp0[5] =
+            {
+                    {200, 1},
+                    {400, 0},
+                    {400, 1},
+                    {500, 1},
+                    {POOL_SIZE - 1500, 0}
+            };
+    check_pool(pool, exp0);
+    assert_int_equal(progress.step_bytes, 200);
+    assert_int_equal(progress.num_gaps, 2);
+    assert_int_equal(progress.free_bytes, POOL_SIZE - 1100);
+    assert_int_equal(progress.largest_gap, POOL_SIZE - 1500);
+    assert_int_equal(progress.done, 0);
+
+    assert_int_equal(mem_pool_compact_step(pool, 1, &progress), ALLOC_OK);
+    pool_segment_t exp1[5] =
+            {
+                    {200, 1},
+                    {400, 1},
+                    {400, 0},
+                    {500, 1},
+                    {POOL_SIZE - 1500, 0}
+            };
+    check_pool(pool, exp1);
+    assert_int_equal(progress.step_bytes, 400);
+
+    assert_int_equal(mem_pool_compact_step(pool, POOL_SIZE, &progress), ALLOC_OK);
+    pool_segment_t exp2[4] =
+            {
+                    {200, 1},
+                    {400, 1},
+                    {500, 1},
+                    {POOL_SIZE - 1100, 0}
+            };
+    check_pool(pool, exp2);
+    assert_int_equal(progress.step_bytes, 500);
+    assert_int_equal(progress.total_bytes, 1100);
+    assert_int_equal(progress.largest_gap, progress.free_bytes);
+    assert_int_equal(progress.done, 1);
+    for (int i = 1; i < 5; i += (i == 1) ? 2 : 1) {
+        for (size_t b = 0; b < allocs[i]->size; ++b) {
+            assert_int_equal(allocs[i]->mem[b], 'a' + i);
+        }
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_maintenance(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Background maintenance:
+     *
+     * 1. Allocate 20 x 1000 in a locked pool, free every other one.
+     * 2. Start a maintenance thread that compacts above 1 gap and
+     *    purges gaps of a page or more.
+     * 3. Wait until it has compacted and purged, stop it: the
+     *    allocations sit together in front of one gap.
+     * 4. Start it again. After the pages are purged, a big allocation
+     *    uses them and is freed: they are purged again.
+     * 5. Closing the pool stops a running thread.
+     */
+
+    const struct timespec nap = {0, 1000000};
+    maintenance_config_t config = {1, 1, 0, 4096, (size_t) sysconf(_SC_PAGESIZE)};
+    maintenance_stats_t stats = {0, 0, 0, 0, 0};
+    alloc_pt allocs[20];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_start_maintenance(pool, &config), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LOCKED);
+    assert_non_null(pool);
+    for (int i = 0; i < 20; ++i) {
+        allocs[i] = mem_new_alloc(pool, 1000);
+        assert_non_null(allocs[i]);
+    }
+    for (int i = 0; i < 20; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_pool_start_maintenance(pool, &config), ALLOC_OK);
+    assert_int_equal(mem_pool_start_maintenance(pool, &config), ALLOC_CALLED_AGAIN);
+    for (int tries = 0; tries < 5000 && (stats.compact_steps == 0 || stats.purged_bytes == 0); ++tries) {
+        nanosleep(&nap, NULL);
+        assert_int_equal(mem_pool_maintenance_stats(pool, &stats), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_stop_maintenance(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_stop_maintenance(pool), ALLOC_FAIL);
+    INFO("%lu wakeups, %lu steps, %zu bytes compacted, %zu bytes purged\n",
+         stats.wakeups, stats.compact_steps, stats.compacted_bytes, stats.purged_bytes);
+    assert_int_not_equal(stats.compact_steps, 0);
+    assert_int_not_equal(stats.purged_bytes, 0);
+
+    pool_segment_t exp0[11];
+    for (int i = 0; i < 10; ++i) {
+        exp0[i] = (pool_segment_t) {1000, 1};
+    }
+    exp0[10] = (pool_segment_t) {POOL_SIZE - 10000, 0};
+    check_pool(pool, exp0);
+
+    // the purged pages are usable again, and purged again after use, though the gaps look the same
+    assert_int_equal(mem_pool_start_maintenance(pool, &config), ALLOC_OK);
+    stats.purged_bytes = 0;
+    for (int tries = 0; tries < 5000 && stats.purged_bytes == 0; ++tries) {
+        nanosleep(&nap, NULL);
+        assert_int_equal(mem_pool_maintenance_stats(pool, &stats), ALLOC_OK);
+    }
+    const size_t purged = stats.purged_bytes;
+    assert_int_not_equal(purged, 0);
+    alloc_pt big = mem_new_alloc(pool, POOL_SIZE - 10000);
+    assert_non_null(big);
+    memset(big->mem, 'x', big->size);
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+    for (int tries = 0; tries < 5000 && stats.purged_bytes == purged; ++tries) {
+        nanosleep(&nap, NULL);
+        assert_int_equal(mem_pool_maintenance_stats(pool, &stats), ALLOC_OK);
+    }
+    assert_true(stats.purged_bytes > purged);
+
+    for (int i = 1; i < 20; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_lazy_coalesce(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Lazy coalescing:
+     *
+     * 1. Allocate 100, 200 and 300, free the 200 and the 100: they
+     *    stay two gaps side by side.
+     * 2. A new 200 reuses the parked block in place.
+     * 3. Coalescing merges the parked blocks with their neighbours.
+     * 4. An allocation that only fits once the parked blocks are
+     *    merged merges them itself.
+     * 5. Parking more than the threshold merges the blocks parked so far.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LAZY_COALESCE);
+    assert_non_null(pool);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    alloc_pt alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    char *mem1 = alloc1->mem;
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    pool_segment_t exp0[4] =
+            {
+                    {100, 0},
+                    {200, 0},
+                    {300, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp0);
+    assert_int_equal(pool->num_gaps, 3);
+
+    alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc1);
+    assert_true(alloc1->mem == mem1);
+    pool_segment_t exp1[4] =
+            {
+                    {100, 0},
+                    {200, 1},
+                    {300, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_pool_coalesce(pool), 2);
+    assert_int_equal(mem_pool_coalesce(pool), 0);
+    pool_segment_t exp2[3] =
+            {
+                    {100, 0},
+                    {200, 1},
+                    {POOL_SIZE - 300, 0}
+            };
+    check_pool(pool, exp2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    alloc_pt big = mem_new_alloc(pool, POOL_SIZE);
+    assert_non_null(big);
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+
+    alloc_pt small[300];
+    for (int i = 0; i < 300; ++i) {
+        small[i] = mem_new_alloc(pool, 16);
+        assert_non_null(small[i]);
+    }
+    for (int i = 0; i < 300; ++i) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_coalesce(pool), 300 - 256);
+    pool_segment_t exp3[1] =
+            {
+                    {POOL_SIZE, 0}
+            };
+    check_pool(pool, exp3);
+
+    // parked blocks do not keep the pool from closing
+    assert_int_equal(mem_del_alloc(pool, mem_new_alloc(pool, 100)), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void check_pool_stats(pool_pt pool) {
+    pool_stats_t stats;
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    mem_inspect_pool(pool, &segs, &num_segs);
+    size_t largest = 0, free_bytes = 0;
+    unsigned num_gaps = 0, histogram[POOL_STATS_NUM_BUCKETS] = {0};
+    for (unsigned i = 0; i < num_segs; ++i) {
+        if (segs[i].allocated) {
+            continue;
+        }
+        unsigned bucket = 0;
+        while (bucket + 1 < POOL_STATS_NUM_BUCKETS && ((size_t) 2 << bucket) <= segs[i].size) {
+            ++bucket;
+        }
+        histogram[bucket]++;
+        num_gaps++;
+        free_bytes += segs[i].size;
+        largest = (segs[i].size > largest) ? segs[i].size : largest;
+    }
+    free(segs);
+
+    assert_int_equal(stats.largest_gap, largest);
+    assert_int_equal(stats.free_bytes, free_bytes);
+    assert_int_equal(stats.num_gaps, num_gaps);
+    assert_memory_equal(stats.gap_histogram, histogram, sizeof(histogram));
+    assert_true(stats.metadata_bytes > num_segs * sizeof(alloc_t));
+}
+
+static void test_pool_stats(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Statistics:
+     *
+     * 1. A fresh pool is one gap with no fragmentation.
+     * 2. Allocate 300, 100, 400 and 100, free the 300 and the 400.
+     * 3. Take the tail gap: the 400 is the largest gap.
+     * 4. Take the 400: the 300 is the largest gap.
+     * 5. Random churn in a plain and in a lazy coalescing pool: the
+     *    statistics always match an inspection.
+     * 6. Split a pool into 200 allocations and free every other one: the
+     *    node heap and gap index outgrow what the pool was opened with,
+     *    and the metadata grows with them.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    pool_stats_t stats;
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.total_size, POOL_SIZE);
+    assert_int_equal(stats.free_bytes, POOL_SIZE);
+    assert_int_equal(stats.largest_gap, POOL_SIZE);
+    assert_int_equal(stats.num_gaps, 1);
+    assert_int_equal(stats.gap_histogram[19], 1);
+    assert_true(stats.fragmentation == 0.0);
+    const size_t fresh_metadata = stats.metadata_bytes;
+
+    alloc_pt allocs[4];
+    const size_t sizes[4] = {300, 100, 400, 100};
+    for (int i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, sizes[i]);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE - 900);
+    assert_int_equal(stats.num_gaps, 3);
+    assert_int_equal(stats.gap_histogram[8], 2);
+
+    alloc_pt big = mem_new_alloc(pool, POOL_SIZE - 900);
+    assert_non_null(big);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.free_bytes, 700);
+    assert_int_equal(stats.largest_gap, 400);
+    assert_true(stats.fragmentation > 0.42 && stats.fragmentation < 0.43);
+
+    allocs[2] = mem_new_alloc(pool, 400);
+    assert_non_null(allocs[2]);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, 300);
+    assert_int_equal(stats.num_gaps, 1);
+    assert_true(stats.fragmentation == 0.0);
+
+    for (int i = 1; i < 4; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+    check_pool_stats(pool);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    const unsigned flags[2] = {POOL_DEFAULT, POOL_LAZY_COALESCE};
+    srand(39);
+    for (int f = 0; f < 2; ++f) {
+        pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, flags[f]);
+        assert_non_null(pool);
+        alloc_pt live[64] = {NULL};
+        for (int op = 0; op < 5000; ++op) {
+            const int i = rand() % 64;
+            if (live[i] != NULL) {
+                assert_int_equal(mem_del_alloc(pool, live[i]), ALLOC_OK);
+                live[i] = NULL;
+            } else {
+                live[i] = mem_new_alloc(pool, 16 * (1 + rand() % 256));
+            }
+            if (op % 100 == 0) {
+                check_pool_stats(pool);
+            }
+        }
+        for (int i = 0; i < 64; ++i) {
+            if (live[i] != NULL) {
+                assert_int_equal(mem_del_alloc(pool, live[i]), ALLOC_OK);
+            }
+        }
+        check_pool_stats(pool);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    alloc_pt split[200];
+    for (int i = 0; i < 200; ++i) {
+        split[i] = mem_new_alloc(pool, 64);
+        assert_non_null(split[i]);
+    }
+    for (int i = 0; i < 200; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, split[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.num_gaps, 101);
+    assert_true(stats.metadata_bytes > fresh_metadata);
+    check_pool_stats(pool);
+    for (int i = 1; i < 200; i += 2) {
+        assert_int_equal(mem_del_alloc(pool, split[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *profile_thread(void *arg) {
+    pool_pt pool = arg;
+    for (int i = 0; i < 100; ++i) {
+        alloc_pt alloc = mem_new_alloc(pool, 64);
+        assert_non_null(alloc);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    return NULL;
+}
+
+static void test_pool_profile(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Profiling:
+     *
+     * 1. Turn profiling on, open a pool, allocate 100 and 200, free the
+     *    100 and then the 200: two searches, two splits, two merges.
+     * 2. A thread does 100 more pairs; its counts are summed in too.
+     * 3. Every call is in the latency histogram.
+     * 4. With profiling off nothing is counted.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    mem_profile_enable(1);
+    mem_profile_reset();
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_LOCKED);
+    assert_non_null(pool);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    mem_profile_t profile;
+    mem_profile_read(&profile);
+    assert_int_equal(profile.calls[MEM_OP_POOL_OPEN], 1);
+    assert_int_equal(profile.calls[MEM_OP_NEW_ALLOC], 2);
+    assert_int_equal(profile.calls[MEM_OP_DEL_ALLOC], 2);
+    assert_int_equal(profile.searches, 2);
+    assert_int_equal(profile.search_steps, 3);
+    assert_int_equal(profile.splits, 2);
+    assert_int_equal(profile.merges, 2);
+
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, profile_thread, pool), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    mem_profile_read(&profile);
+    assert_int_equal(profile.calls[MEM_OP_NEW_ALLOC], 102);
+    assert_int_equal(profile.calls[MEM_OP_DEL_ALLOC], 102);
+    assert_int_equal(profile.splits, 102);
+    for (int op = 0; op < MEM_PROFILE_NUM_OPS; ++op) {
+        unsigned long calls = 0;
+        for (int b = 0; b < MEM_PROFILE_NUM_BUCKETS; ++b) {
+            calls += profile.latency_histogram[op][b];
+        }
+        assert_int_equal(calls, profile.calls[op]);
+    }
+
+    mem_profile_enable(0);
+    alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    mem_profile_t after;
+    mem_profile_read(&after);
+    assert_memory_equal(&after, &profile, sizeof(mem_profile_t));
+
+    mem_profile_reset();
+    mem_profile_read(&profile);
+    assert_int_equal(profile.calls[MEM_OP_NEW_ALLOC], 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_trace(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Trace:
+     *
+     * 1. Start a trace, open a pool, allocate 100 and 200, free both.
+     *    Allocate 300 and defer its deallocation.
+     * 2. A thread does 100 more pairs (profile_thread). Close, which
+     *    reclaims the 300, stop.
+     * 3. The file has the header, one open and one close, 103 allocs
+     *    and 103 frees, and every free names an allocation made before.
+     * 4. Starting twice fails, pools opened after stop are not traced.
+     * 5. A pool opened in one session and used in the next stays out
+     *    of the second trace, whose pools are numbered from 1 again and
+     *    which replays: every record names a pool opened and every free
+     *    an allocation made before it.
+     */
+
+    const char *path = "test_trace.bin";
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_int_equal(mem_trace_start(path), ALLOC_OK);
+    assert_int_equal(mem_trace_start(path), ALLOC_CALLED_AGAIN);
+    assert_true(mem_trace_active());
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    alloc_pt alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc_deferred(pool, alloc2), ALLOC_OK);
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, profile_thread, pool), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_trace_stop(), ALLOC_OK);
+    assert_false(mem_trace_active());
+    assert_int_equal(mem_trace_stop(), ALLOC_CALLED_AGAIN);
+
+    FILE *file = fopen(path, "rb");
+    assert_non_null(file);
+    mem_trace_header_t header;
+    assert_int_equal(fread(&header, sizeof(header), 1, file), 1);
+    assert_memory_equal(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic));
+    assert_int_equal(header.version, MEM_TRACE_VERSION);
+    assert_int_equal(header.record_size, sizeof(mem_trace_record_t));
+
+    unsigned counts[MEM_TRACE_DEL_ALLOC + 1] = {0};
+    uint64_t handles[103];
+    unsigned num_handles = 0;
+    unsigned frees_found = 0;
+    mem_trace_record_t frees[103];
+    unsigned num_frees = 0;
+    mem_trace_record_t record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        assert_true(record.op >= MEM_TRACE_POOL_OPEN && record.op <= MEM_TRACE_DEL_ALLOC);
+        counts[record.op]++;
+        if (record.op == MEM_TRACE_POOL_OPEN) {
+            assert_int_equal(record.size, POOL_SIZE);
+            assert_int_equal(record.policy, BEST_FIT);
+        } else if (record.op == MEM_TRACE_NEW_ALLOC) {
+            assert_true(record.handle != 0);
+            assert_true(num_handles < 103);
+            handles[num_handles++] = record.handle;
+        } else if (record.op == MEM_TRACE_DEL_ALLOC) {
+            assert_true(num_frees < 103);
+            frees[num_frees++] = record;
+        }
+    }
+    fclose(file);
+    remove(path);
+
+    assert_int_equal(counts[MEM_TRACE_POOL_OPEN], 1);
+    assert_int_equal(counts[MEM_TRACE_POOL_CLOSE], 1);
+    assert_int_equal(counts[MEM_TRACE_NEW_ALLOC], 103);
+    assert_int_equal(counts[MEM_TRACE_DEL_ALLOC], 103);
+    for (unsigned f = 0; f < num_frees; ++f) {
+        for (unsigned h = 0; h < num_handles; ++h) {
+            if (handles[h] == frees[f].handle) {
+                frees_found++;
+                handles[h] = 0; // each allocation is freed once
+                break;
+            }
+        }
+    }
+    assert_int_equal(frees_found, 103);
+
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    INFO("Two sessions\n");
+    assert_int_equal(mem_trace_start(path), ALLOC_OK);
+    pool_pt old = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(old);
+    alloc0 = mem_new_alloc(old, 100);
+    assert_non_null(alloc0);
+    assert_int_equal(mem_trace_stop(), ALLOC_OK);
+    assert_int_equal(mem_trace_start(path), ALLOC_OK);
+    alloc1 = mem_new_alloc(old, 200);
+    assert_non_null(alloc1);
+    assert_int_equal(mem_del_alloc(old, alloc0), ALLOC_OK);
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(old, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(old), ALLOC_OK);
+    assert_int_equal(mem_trace_stop(), ALLOC_OK);
+
+    file = fopen(path, "rb");
+    assert_non_null(file);
+    assert_int_equal(fread(&header, sizeof(header), 1, file), 1);
+    memset(counts, 0, sizeof(counts));
+    num_handles = 0;
+    int open = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        counts[record.op]++;
+        if (record.op == MEM_TRACE_POOL_OPEN) {
+            assert_int_equal(record.pool, 1);
+            open = 1;
+            continue;
+        }
+        assert_int_equal(record.pool, 1);
+        assert_true(open);
+        if (record.op == MEM_TRACE_NEW_ALLOC) {
+            handles[num_handles++] = record.handle;
+        } else if (record.op == MEM_TRACE_DEL_ALLOC) {
+            assert_int_equal(num_handles, 1);
+            assert_true(handles[0] == record.handle);
+        } else {
+            open = 0;
+        }
+    }
+    fclose(file);
+    remove(path);
+    assert_int_equal(counts[MEM_TRACE_POOL_OPEN], 1);
+    assert_int_equal(counts[MEM_TRACE_NEW_ALLOC], 1);
+    assert_int_equal(counts[MEM_TRACE_DEL_ALLOC], 1);
+    assert_int_equal(counts[MEM_TRACE_POOL_CLOSE], 1);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_fixed(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Fixed-size pool:
+     *
+     * 1. Open a pool of 10 blocks of 20 bytes (rounded up to 24).
+     * 2. Allocate all 10, the 11th fails. Closing fails.
+     * 3. The general entry points refuse the pool.
+     * 4. Foreign pointers are refused. Free all, close.
+     */
+
+    const unsigned num_blocks = 10;
+    char *blocks[num_blocks];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_fixed(20, num_blocks, POOL_DEFAULT);
+    assert_non_null(pool);
+    assert_int_equal(pool->total_size, 24 * num_blocks);
+
+    for (unsigned i = 0; i < num_blocks; ++i) {
+        blocks[i] = mem_fixed_alloc(pool);
+        assert_non_null(blocks[i]);
+        assert_true(blocks[i] == pool->mem + 24 * i);
+    }
+    assert_null(mem_fixed_alloc(pool));
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    assert_null(mem_new_alloc(pool, 10));
+    assert_null(mem_pool_clone(pool));
+    assert_int_equal(mem_fixed_free(pool, blocks[0] + 1), ALLOC_FAIL);
+    assert_int_equal(mem_fixed_free(pool, pool->mem + pool->total_size), ALLOC_FAIL);
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    assert_int_equal(mem_fixed_free(pool, blocks[3]), ALLOC_OK);
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, num_blocks);
+    for (unsigned i = 0; i < num_segs; ++i) {
+        assert_int_equal(segs[i].size, 24);
+        assert_int_equal(segs[i].allocated, i != 3);
+    }
+    free(segs);
+    assert_int_equal(pool->num_allocs, num_blocks - 1);
+
+    // last freed, first allocated
+    assert_true(mem_fixed_alloc(pool) == blocks[3]);
+
+    for (unsigned i = 0; i < num_blocks; ++i) {
+        assert_int_equal(mem_fixed_free(pool, blocks[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void *fixed_churn_thread(void *arg) {
+    churn_arg_t *churn = arg;
+    char *live[CHURN_MAX_LIVE] = {NULL};
+    unsigned seed = churn->id;
+
+    for (unsigned op = 0; op < churn->num_ops; ++op) {
+        unsigned slot = rand_r(&seed) % CHURN_MAX_LIVE;
+        if (live[slot]) {
+            for (unsigned i = 0; i < 32; ++i)
+                if (live[slot][i] != (char) churn->id)
+                    churn->errors++;
+            mem_fixed_free(churn->pool, live[slot]);
+            live[slot] = NULL;
+        } else if ((live[slot] = mem_fixed_alloc(churn->pool)) != NULL) {
+            memset(live[slot], churn->id, 32);
+        }
+    }
+    for (unsigned slot = 0; slot < CHURN_MAX_LIVE; ++slot) {
+        if (live[slot])
+            mem_fixed_free(churn->pool, live[slot]);
+    }
+
+    return NULL;
+}
+
+static void test_pool_fixed_threads(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Fixed-size pool threads:
+     *
+     * 1. 4 threads allocate and free 32-byte blocks at random from a
+     *    pool too small for all of them, checking that no block is
+     *    handed out twice.
+     * 2. All the blocks are free afterwards.
+     */
+
+    const unsigned num_threads = 4;
+    pthread_t threads[num_threads];
+    churn_arg_t args[num_threads];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_fixed(32, 64, POOL_DEFAULT);
+    assert_non_null(pool);
+
+    for (unsigned i = 0; i < num_threads; ++i) {
+        args[i] = (churn_arg_t) {pool, i + 1, 200000, 0};
+        assert_int_equal(pthread_create(&threads[i], NULL, fixed_churn_thread, &args[i]), 0);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        assert_int_equal(args[i].errors, 0);
+    }
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          6. STRESS TEST             ***/
+/***                                     ***/
+/***         [non-functional]            ***/
+/***         [see NOTE below]            ***/
+/*******************************************/
+
+void test_pool_stresstest(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_pools = 200;
+    const unsigned num_allocations = 1000;
+    const unsigned min_alloc_size = 10;
+    const unsigned pool_size =
+            (num_allocations / 2) *
+            (2 * min_alloc_size + (num_allocations - 1) * min_alloc_size);
+    assert_int_equal(pool_size, 5005000);
+
+
+    pool_pt pools[num_pools];
+    alloc_pt allocations[num_pools][num_allocations];
+
+    /*
+     * NOTE: This will work iff the address of the allocation
+     * in the pool is returned to the user instead of the
+     * address of the allocation record. Since allocation records
+     * are a part of the nodes, when the node heap is reallocated
+     * the node addresses shift with it, and so do the allocation
+     * record addresses. The allocation addresses on the pool
+     * remain the same, however, so they can be returned to the
+     * user and gotten from the user upon request for deletion.
+     */
+
+    /*
+     * Testing dynamic reallocation of pool structures:
+     *
+     * 1. 200 pools of 5005000 each (many pools)
+     * 2. In each pool 1000 allocations of different sizes (many allocations)
+     * 3. In each pool 500 deallocations (many gaps)
+     */
+
+    // initialize store
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // allocate pools
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        // open pool
+        pools[pix] =
+                mem_pool_open(pool_size, (pix % 2) ? FIRST_FIT : BEST_FIT);
+        assert_non_null(pools[pix]);
+        // allocate pool
+        unsigned allocated = 0;
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            allocations[pix][aix] =
+                    mem_new_alloc(pools[pix], (aix + 1) * min_alloc_size);
+            allocated += (aix + 1) * min_alloc_size;
+            if (!allocations[pix][aix]) {
+                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %u\n", pix, aix, allocated);
+            }
+            assert_non_null(allocations[pix][aix]);
+        }
+        // delete every other allocation
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            if (aix % 2) {
+                assert_int_equal(
+                        mem_del_alloc(pools[pix], allocations[pix][aix]),
+                        ALLOC_OK);
+                allocations[pix][aix] = NULL;
+            }
+        }
+    }
+
+    // delete pools
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        // delete pool's allocations
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            if (allocations[pix][aix]) {
+                // delete allocation
+                assert_int_equal(
+                    mem_del_alloc(pools[pix], allocations[pix][aix]),
+                    ALLOC_OK);
+            }
+        }
+        // close pool
+        assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
+    }
+
+    // free store
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***         7. DRIVER ROUTINE           ***/
+/*******************************************/
+
+int run_test_suite() {
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test(test_pool_store_smoketest),
+            cmocka_unit_test(test_pool_smoketest),
+
+            cmocka_unit_test(test_pool_nonempty),
+
+            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+
+            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+
+            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+
+            cmocka_unit_test(test_pool_clone),
+            cmocka_unit_test(test_pool_threads),
+            cmocka_unit_test(test_pool_thread_cache),
+            cmocka_unit_test(test_pool_store_threads),
+            cmocka_unit_test(test_pool_sharded),
+            cmocka_unit_test(test_pool_partitioned),
+            cmocka_unit_test(test_pool_remote_free),
+            cmocka_unit_test(test_pool_epoch),
+            cmocka_unit_test(test_pool_compact),
+            cmocka_unit_test(test_pool_compact_step),
+            cmocka_unit_test(test_pool_maintenance),
+            cmocka_unit_test(test_pool_lazy_coalesce),
+            cmocka_unit_test(test_pool_stats),
+            cmocka_unit_test(test_pool_profile),
+            cmocka_unit_test(test_pool_trace),
+            cmocka_unit_test(test_pool_fixed),
+            cmocka_unit_test(test_pool_fixed_threads),
 
             // do not uncomment until the project is changed to return the allocation address
 //            cmocka_unit_test(test_pool_stresstest),